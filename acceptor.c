@@ -0,0 +1,300 @@
+/* *
+ * Name: acceptor.c                                                 *
+ *                                                                  *
+ * Description: accept thread with lock-free handoff to event loops *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#define _GNU_SOURCE
+#include "acceptor.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+/*
+ * One thread owns the listening socket and drains its backlog with
+ * accept4() in batches. Each new descriptor goes to the event loop with
+ * the lowest load - its live connections, plus what is still queued to
+ * it, plus its loop lag in ACC_LAG_US units - through a single producer
+ * single consumer ring, and that loop's eventfd is written once per
+ * batch. Loops publish their load with accLoad() after every pass.
+ *
+ * A loop whose slots or ring are full is passed over. When every loop
+ * is full the thread stops accepting, so further connections wait in
+ * the kernel backlog, and it sleeps on its own eventfd until accLoad()
+ * reports a free slot. With a single loop there is nothing to balance;
+ * the thread then only batches accept() off the loop and holds the
+ * backlog while the slots are taken.
+ */
+
+struct accQueue {
+    _Atomic unsigned head;  /* consumer side */
+    _Atomic unsigned tail;  /* producer side */
+    _Atomic unsigned seen;  /* head when live was last published */
+    int fd[ACC_RING];
+    int efd;
+    _Atomic int live;
+    _Atomic long lag;       /* microseconds, smoothed */
+    unsigned long handed;
+};
+
+static struct accQueue queue[ACC_WORKERS];
+static int nWorker;
+static int nSlot;            /* connections one loop can hold */
+static int listenFd = -1;
+static int wakeFd = -1;      /* the accept thread's, while it waits for room */
+static _Atomic int stalled;
+
+/* statistics, written by the accept thread only */
+static unsigned long nAccepted, nBatch, nStall;
+
+static int push(struct accQueue *q, int sd) {
+    unsigned t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if (t - atomic_load_explicit(&q->head, memory_order_acquire) >= ACC_RING) {
+        return -1;
+    }
+    q->fd[t % ACC_RING] = sd;
+    atomic_store_explicit(&q->tail, t + 1, memory_order_release);
+    return 0;
+}
+
+static int pop(struct accQueue *q) {
+    unsigned h = atomic_load_explicit(&q->head, memory_order_relaxed);
+    int sd;
+
+    if (h == atomic_load_explicit(&q->tail, memory_order_acquire)) {
+        return -1;
+    }
+    sd = q->fd[h % ACC_RING];
+    atomic_store_explicit(&q->head, h + 1, memory_order_release);
+    return sd;
+}
+
+/* connections a loop can still take; handed ones it has not counted
+   in live yet are spoken for */
+static int room(struct accQueue *q) {
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&q->head, memory_order_acquire) >=
+        ACC_RING) {
+        return 0;
+    }
+    return nSlot - atomic_load_explicit(&q->live, memory_order_relaxed) -
+           (int)(tail - atomic_load_explicit(&q->seen, memory_order_relaxed));
+}
+
+/* least loaded loop with room, -1 when all are full */
+static int pick(void) {
+    long best = -1, load;
+    int w, k = -1;
+
+    for (w = 0; w < nWorker; w++) {
+        if (room(&queue[w]) <= 0) {
+            continue;
+        }
+        load = nSlot - room(&queue[w]) +
+               atomic_load_explicit(&queue[w].lag, memory_order_relaxed) /
+                   ACC_LAG_US;
+        if (best < 0 || load < best) {
+            best = load;
+            k = w;
+        }
+    }
+    return k;
+}
+
+/* every loop is full: sleep until accLoad() frees a slot */
+static void stall(void) {
+    struct pollfd p;
+    uint64_t n;
+
+    atomic_store(&stalled, 1);
+    // A slot freed before the flag was up would not wake us
+    if (pick() > -1) {
+        atomic_store(&stalled, 0);
+        return;
+    }
+    __atomic_fetch_add(&nStall, 1, __ATOMIC_RELAXED);
+    p.fd = wakeFd;
+    p.events = POLLIN;
+    if (poll(&p, 1, -1) < 0 && errno != EINTR) {
+        perror("S: acceptor poll error");
+    }
+    if (read(wakeFd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        perror("S: acceptor eventfd error");
+    }
+}
+
+static void *acceptor(void *arg) {
+    struct pollfd p;
+    uint64_t one = 1;
+    int woken[ACC_WORKERS];
+    int sd, w, n;
+
+    (void)arg;
+    p.fd = listenFd;
+    p.events = POLLIN;
+    for (;;) {
+        // Full: the kernel backlog holds them, accepting would only reset
+        if (pick() < 0) {
+            stall();
+            continue;
+        }
+        if (poll(&p, 1, -1) < 0) {
+            if (errno != EINTR) {
+                perror("S: acceptor poll error");
+            }
+            continue;
+        }
+        for (w = 0; w < nWorker; w++) {
+            woken[w] = 0;
+        }
+        for (n = 0; n < ACC_BATCH && (w = pick()) > -1; n++) {
+            if ((sd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+                if (errno == EMFILE || errno == ENFILE) {
+                    perror("S: acceptor accept error");
+                    usleep(10000); // the backlog keeps them meanwhile
+                }
+                break;
+            }
+            __atomic_fetch_add(&nAccepted, 1, __ATOMIC_RELAXED);
+            push(&queue[w], sd); // pick() saw room in the ring
+            __atomic_fetch_add(&queue[w].handed, 1, __ATOMIC_RELAXED);
+            woken[w] = 1;
+        }
+        if (n > 0) {
+            __atomic_fetch_add(&nBatch, 1, __ATOMIC_RELAXED);
+        }
+        // One wakeup per loop per batch, not per connection
+        for (w = 0; w < nWorker; w++) {
+            if (woken[w] && write(queue[w].efd, &one, sizeof(one)) < 0) {
+                perror("S: acceptor eventfd error");
+            }
+        }
+    }
+    return NULL;
+}
+
+int accInit(int sockfd, int workers, int slots) {
+    pthread_t t;
+    int w;
+
+    if (workers < 1 || workers > ACC_WORKERS) {
+        workers = 1;
+    }
+    if ((wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("S: accInit eventfd error");
+        return -1;
+    }
+    for (w = 0; w < workers; w++) {
+        if ((queue[w].efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            perror("S: accInit eventfd error");
+            return -1;
+        }
+    }
+    // Batches end at EAGAIN, so the listener must not block
+    if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("S: accInit fcntl error");
+        return -1;
+    }
+    nWorker = workers;
+    nSlot = slots;
+    listenFd = sockfd;
+    if (pthread_create(&t, NULL, acceptor, NULL) != 0) {
+        perror("S: accInit pthread_create error");
+        return -1;
+    }
+    pthread_detach(t);
+    return 0;
+}
+
+int accFd(int w) { return w >= 0 && w < nWorker ? queue[w].efd : -1; }
+
+int accTake(int w) {
+    uint64_t n;
+    int sd;
+
+    if (w < 0 || w >= nWorker) {
+        return -1;
+    }
+    if ((sd = pop(&queue[w])) < 0) {
+        // Drain, then look again: a later handoff writes the eventfd anew
+        if (read(queue[w].efd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+            perror("S: accTake eventfd error");
+        }
+        sd = pop(&queue[w]);
+    }
+    return sd;
+}
+
+void accLoad(int w, int live, long lagUs) {
+    struct accQueue *q;
+    uint64_t one = 1;
+    long lag;
+
+    if (w < 0 || w >= nWorker) {
+        return;
+    }
+    q = &queue[w];
+    lag = atomic_load_explicit(&q->lag, memory_order_relaxed);
+    // live covers everything taken so far
+    atomic_store_explicit(&q->seen,
+                          atomic_load_explicit(&q->head, memory_order_relaxed),
+                          memory_order_relaxed);
+    atomic_store_explicit(&q->live, live, memory_order_relaxed);
+    atomic_store_explicit(&q->lag, lag + (lagUs - lag) / 8,
+                          memory_order_relaxed);
+    // Pairs with stall(): either it sees the slot, or we see its flag
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&stalled) && room(q) > 0 && atomic_exchange(&stalled, 0) &&
+        write(wakeFd, &one, sizeof(one)) < 0) {
+        perror("S: accLoad eventfd error");
+    }
+}
+
+void accReport(char *buf, size_t len) {
+    size_t used;
+    int w;
+
+    if (listenFd < 0) {
+        snprintf(buf, len, "S: accept thread off\n");
+        return;
+    }
+    used = snprintf(buf, len,
+                    "S: accept thread accepted %lu in %lu batches stalled "
+                    "full %lu",
+                    __atomic_load_n(&nAccepted, __ATOMIC_RELAXED),
+                    __atomic_load_n(&nBatch, __ATOMIC_RELAXED),
+                    __atomic_load_n(&nStall, __ATOMIC_RELAXED));
+    for (w = 0; w < nWorker && used < len; w++) {
+        used += snprintf(buf + used, len - used,
+                         " loop %d handed %lu live %d lag %ld us", w,
+                         __atomic_load_n(&queue[w].handed, __ATOMIC_RELAXED),
+                         atomic_load(&queue[w].live),
+                         atomic_load(&queue[w].lag));
+    }
+    if (used < len) {
+        snprintf(buf + used, len - used, "\n");
+    }
+}
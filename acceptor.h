@@ -0,0 +1,37 @@
+/* *
+ * Name: acceptor.h                                                 *
+ *                                                                  *
+ * Description: accept thread include file                          *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __ACCEPTOR_H
+#define __ACCEPTOR_H
+
+#include <stddef.h>
+
+#define ACC_WORKERS 8     /* most event loops one acceptor feeds */
+#define ACC_RING 256      /* handoff ring per loop, a power of two */
+#define ACC_BATCH 32      /* accept4() calls per wakeup */
+#define ACC_LAG_US 100    /* loop lag counted like one more connection */
+
+int accInit(int sockfd, int workers, int slots);
+int accFd(int w);
+int accTake(int w);
+void accLoad(int w, int live, long lagUs);
+void accReport(char *buf, size_t len);
+
+#endif
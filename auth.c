@@ -0,0 +1,328 @@
+/* *
+ * Name: auth.c                                                     *
+ *                                                                  *
+ * Description: login, password hashing and session tokens          *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "auth.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * A password is only ever checked by a worker thread: PBKDF2 is made
+ * to be slow, and one login on the event loop would stall every
+ * client for tens of milliseconds. The loop queues the job, goes on,
+ * and picks the verdict up when the worker writes a byte to the
+ * completion pipe it selects on. A successful login yields a token,
+ * "nick.expiry.mac" with the HMAC-SHA256 of the first two fields
+ * under the server key; presenting it again costs one HMAC and no
+ * lookup. Records live one per file, spread over 256 directories like
+ * the mailboxes, and the first login for a name registers it.
+ */
+
+#ifdef CHAT_TLS
+#include <pthread.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#define AUTH_MAGIC 0x41555448u /* "AUTH" */
+
+struct authRecord {
+    uint32_t magic;
+    uint32_t iter;
+    unsigned char salt[16];
+    unsigned char hash[32];
+};
+
+struct authJob {
+    int slot;
+    unsigned gen;
+    char nick[64];
+    char pass[256];
+};
+
+static char authDir[256] = AUTH_DIR;
+static unsigned char key[32];
+static int pipeFd[2] = {-1, -1};
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t more = PTHREAD_COND_INITIALIZER;
+static struct authJob job[AUTH_QUEUE];
+static struct authResult result[AUTH_QUEUE];
+static unsigned jobHead, jobTail, resHead, resTail; /* free running */
+
+/* statistics */
+static unsigned long nLogin, nFailed, nCreated, nToken, nBadToken;
+static unsigned long long kdfNs, tokenNs;
+
+static unsigned authHash(const char *nick) {
+    unsigned h = 2166136261u;
+
+    while (*nick) {
+        h = (h ^ (unsigned char)*nick++) * 16777619u;
+    }
+    return h & 0xff;
+}
+
+static long long nsNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int derive(const char *pass, const struct authRecord *r,
+                  unsigned char *out) {
+    return PKCS5_PBKDF2_HMAC(pass, strlen(pass), r->salt, sizeof(r->salt),
+                             r->iter, EVP_sha256(), 32, out) == 1
+               ? 0
+               : -1;
+}
+
+/* worker side: verify against the record, or create it */
+static void check(const struct authJob *j, struct authResult *res) {
+    struct authRecord rec;
+    unsigned char hash[32];
+    char path[512];
+    int fd;
+
+    res->slot = j->slot;
+    res->gen = j->gen;
+    res->ok = res->created = 0;
+    snprintf(res->nick, sizeof(res->nick), "%s", j->nick);
+
+    snprintf(path, sizeof(path), "%s/%02x", authDir, authHash(j->nick));
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%02x/%s", authDir, authHash(j->nick),
+             j->nick);
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+        if (read(fd, &rec, sizeof(rec)) == sizeof(rec) &&
+            rec.magic == AUTH_MAGIC && derive(j->pass, &rec, hash) == 0) {
+            res->ok = CRYPTO_memcmp(hash, rec.hash, sizeof(hash)) == 0;
+        }
+        close(fd);
+        return;
+    }
+    // Unknown name: the first login registers it
+    rec.magic = AUTH_MAGIC;
+    rec.iter = AUTH_ITER;
+    if (RAND_bytes(rec.salt, sizeof(rec.salt)) != 1 ||
+        derive(j->pass, &rec, rec.hash) < 0 ||
+        (fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) {
+        return; // a concurrent registration won the race
+    }
+    if (write(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+        res->ok = res->created = 1;
+    }
+    close(fd);
+}
+
+static void *worker(void *arg) {
+    struct authJob j;
+    struct authResult res;
+    long long t0;
+    char one = 1;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (jobHead == jobTail) {
+            pthread_cond_wait(&more, &lock);
+        }
+        j = job[jobHead++ % AUTH_QUEUE];
+        OPENSSL_cleanse(job[(jobHead - 1) % AUTH_QUEUE].pass, sizeof(j.pass));
+        pthread_mutex_unlock(&lock);
+
+        t0 = nsNow();
+        check(&j, &res);
+        OPENSSL_cleanse(j.pass, sizeof(j.pass));
+
+        pthread_mutex_lock(&lock);
+        kdfNs += nsNow() - t0;
+        result[resTail++ % AUTH_QUEUE] = res;
+        pthread_mutex_unlock(&lock);
+        if (write(pipeFd[1], &one, 1) < 0) {
+            perror("S: auth worker pipe error");
+        }
+    }
+    return NULL;
+}
+
+int authInit(const char *dir, int workers, const char *secret) {
+    pthread_t t;
+    int k;
+
+    snprintf(authDir, sizeof(authDir), "%s", dir);
+    if (mkdir(authDir, 0700) < 0 && errno != EEXIST) {
+        perror("S: authInit mkdir error");
+        return -1;
+    }
+    // Without a configured key tokens do not outlive the process
+    if (secret != NULL) {
+        EVP_Digest(secret, strlen(secret), key, NULL, EVP_sha256(), NULL);
+    } else if (RAND_bytes(key, sizeof(key)) != 1) {
+        return -1;
+    }
+    if (pipe(pipeFd) < 0) {
+        perror("S: authInit pipe error");
+        return -1;
+    }
+    fcntl(pipeFd[0], F_SETFL, O_NONBLOCK);
+    for (k = 0; k < workers; k++) {
+        if (pthread_create(&t, NULL, worker, NULL) != 0) {
+            perror("S: authInit pthread_create error");
+            return -1;
+        }
+        pthread_detach(t);
+    }
+    return pipeFd[0];
+}
+
+int authSubmit(int slot, unsigned gen, const char *nick, const char *pass) {
+    struct authJob *j;
+
+    pthread_mutex_lock(&lock);
+    // Bounded by the result ring too, so a verdict always has a place
+    if (jobTail - resHead >= AUTH_QUEUE) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    j = &job[jobTail % AUTH_QUEUE];
+    j->slot = slot;
+    j->gen = gen;
+    snprintf(j->nick, sizeof(j->nick), "%s", nick);
+    snprintf(j->pass, sizeof(j->pass), "%s", pass);
+    jobTail++;
+    pthread_cond_signal(&more);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int authDone(struct authResult *r) {
+    char drain[64];
+    int got = 0;
+
+    // Drain first: a verdict queued after this still leaves a byte
+    while (read(pipeFd[0], drain, sizeof(drain)) > 0) {
+    }
+    pthread_mutex_lock(&lock);
+    if (resHead != resTail) {
+        *r = result[resHead++ % AUTH_QUEUE];
+        got = 1;
+        nLogin++;
+        nFailed += !r->ok;
+        nCreated += r->created;
+    }
+    pthread_mutex_unlock(&lock);
+    return got;
+}
+
+static void mac(const char *msg, size_t len, char *hex) {
+    unsigned char md[32];
+    unsigned int n = sizeof(md);
+    unsigned k;
+
+    HMAC(EVP_sha256(), key, sizeof(key), (const unsigned char *)msg, len, md,
+         &n);
+    for (k = 0; k < n; k++) {
+        sprintf(hex + 2 * k, "%02x", md[k]);
+    }
+}
+
+int authToken(const char *nick, char *out, size_t len) {
+    int n = snprintf(out, len, "%s.%ld", nick, (long)time(NULL) + AUTH_TTL);
+
+    if (n < 0 || (size_t)n + 66 > len) {
+        return -1;
+    }
+    out[n] = '.';
+    mac(out, n, out + n + 1);
+    return 0;
+}
+
+int authVerify(const char *token, char *nick, size_t len) {
+    char hex[65];
+    const char *dot, *sig;
+    long long t0 = nsNow();
+    int ok = 0;
+
+    if ((dot = strchr(token, '.')) != NULL &&
+        (sig = strchr(dot + 1, '.')) != NULL && strlen(sig + 1) == 64 &&
+        (size_t)(dot - token) < len && atol(dot + 1) >= (long)time(NULL)) {
+        mac(token, sig - token, hex);
+        if (CRYPTO_memcmp(hex, sig + 1, 64) == 0) {
+            memcpy(nick, token, dot - token);
+            nick[dot - token] = '\0';
+            ok = 1;
+        }
+    }
+    tokenNs += nsNow() - t0;
+    nToken++;
+    nBadToken += !ok;
+    return ok ? 0 : -1;
+}
+
+int authExists(const char *nick) {
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/%02x/%s", authDir, authHash(nick), nick);
+    return access(path, F_OK) == 0;
+}
+
+void authReport(char *buf, size_t len) {
+    snprintf(buf, len,
+             "S: auth logins %lu failed %lu registered %lu kdf avg %.1f ms "
+             "tokens %lu rejected %lu verify avg %.2f us\n",
+             nLogin, nFailed, nCreated,
+             nLogin ? kdfNs / 1e6 / nLogin : 0.0, nToken, nBadToken,
+             nToken ? tokenNs / 1e3 / nToken : 0.0);
+}
+
+#else
+
+int authInit(const char *dir, int workers, const char *secret) {
+    (void)dir;
+    (void)workers;
+    (void)secret;
+    return -1;
+}
+
+int authSubmit(int slot, unsigned gen, const char *nick, const char *pass) {
+    return (void)slot, (void)gen, (void)nick, (void)pass, -1;
+}
+
+int authDone(struct authResult *r) { return (void)r, 0; }
+int authToken(const char *nick, char *out, size_t len) {
+    return (void)nick, (void)out, (void)len, -1;
+}
+int authVerify(const char *token, char *nick, size_t len) {
+    return (void)token, (void)nick, (void)len, -1;
+}
+int authExists(const char *nick) { return (void)nick, 0; }
+void authReport(char *buf, size_t len) { snprintf(buf, len, "S: auth off\n"); }
+
+#endif
@@ -0,0 +1,51 @@
+/* *
+ * Name: auth.h                                                     *
+ *                                                                  *
+ * Description: login and session tokens include file               *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __AUTH_H
+#define __AUTH_H
+
+#include <stddef.h>
+
+#define AUTH_DIR "users"
+#define AUTH_WORKERS 2
+#define AUTH_QUEUE 64           /* pending logins */
+#define AUTH_ITER 100000        /* PBKDF2-HMAC-SHA256 rounds */
+#define AUTH_TTL (7 * 24 * 3600) /* token lifetime, seconds */
+#define AUTH_TOKEN 128
+#define CMD_LOGIN "/login "
+#define CMD_TOKEN "/token "
+
+struct authResult {
+    int slot;
+    unsigned gen;        /* connection generation when submitted */
+    int ok;
+    int created;         /* first login registered the name */
+    char nick[64];
+};
+
+int authInit(const char *dir, int workers, const char *key);
+int authSubmit(int slot, unsigned gen, const char *nick, const char *pass);
+int authDone(struct authResult *r);
+int authToken(const char *nick, char *out, size_t len);
+int authVerify(const char *token, char *nick, size_t len);
+int authExists(const char *nick);
+void authReport(char *buf, size_t len);
+
+#endif
@@ -0,0 +1,481 @@
+/* *
+ * Name: bitmap.c                                                   *
+ *                                                                  *
+ * Description: compressed bitmaps with vectorized set operations   *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "bitmap.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Two sparse containers are combined with a sorted merge. As soon as
+ * one side is a bit set both sides are taken as bit sets and combined
+ * 256 (AVX2) or 128 (SSE2) bits at a time; the result goes back to an
+ * array when it is small enough.
+ */
+
+enum { OP_OR, OP_AND, OP_ANDNOT };
+
+static uint32_t arrayCap(uint32_t card) {
+    uint32_t cap = 4;
+
+    while (cap < card) {
+        cap <<= 1;
+    }
+    return cap;
+}
+
+static void containerFree(struct container *c) {
+    if (c->isSet) {
+        free(c->u.bits);
+    } else {
+        free(c->u.array);
+    }
+}
+
+static int toSet(struct container *c) {
+    uint64_t *bits;
+    uint32_t k;
+
+    if ((bits = calloc(BITMAP_WORDS, sizeof(*bits))) == NULL) {
+        return -1;
+    }
+    for (k = 0; k < c->card; k++) {
+        bits[c->u.array[k] >> 6] |= 1ULL << (c->u.array[k] & 63);
+    }
+    free(c->u.array);
+    c->u.bits = bits;
+    c->isSet = 1;
+    return 0;
+}
+
+static int toArray(struct container *c) {
+    uint16_t *array;
+    uint32_t w, k = 0;
+    uint64_t word;
+
+    if ((array = malloc(arrayCap(c->card) * sizeof(*array))) == NULL) {
+        return -1;
+    }
+    for (w = 0; w < BITMAP_WORDS; w++) {
+        for (word = c->u.bits[w]; word != 0; word &= word - 1) {
+            array[k++] = (uint16_t)(w * 64 + __builtin_ctzll(word));
+        }
+    }
+    free(c->u.bits);
+    c->u.array = array;
+    c->isSet = 0;
+    return 0;
+}
+
+/* index of key, or -(insertion point) - 1 */
+static int findKey(const struct bitmap *b, uint16_t key) {
+    int lo = 0, hi = b->n - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (b->c[mid].key < key) {
+            lo = mid + 1;
+        } else if (b->c[mid].key > key) {
+            hi = mid - 1;
+        } else {
+            return mid;
+        }
+    }
+    return -lo - 1;
+}
+
+static int findLow(const struct container *c, uint16_t low) {
+    int lo = 0, hi = (int)c->card - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (c->u.array[mid] < low) {
+            lo = mid + 1;
+        } else if (c->u.array[mid] > low) {
+            hi = mid - 1;
+        } else {
+            return mid;
+        }
+    }
+    return -lo - 1;
+}
+
+static int reserve(struct bitmap *b) {
+    struct container *nc;
+    int cap;
+
+    if (b->n < b->cap) {
+        return 0;
+    }
+    cap = b->cap ? b->cap * 2 : 4;
+    if ((nc = realloc(b->c, cap * sizeof(*nc))) == NULL) {
+        return -1;
+    }
+    b->c = nc;
+    b->cap = cap;
+    return 0;
+}
+
+/* appends c (taking ownership) at the end of b; keys must ascend */
+static int push(struct bitmap *b, struct container *c) {
+    if (c->card == 0) {
+        containerFree(c);
+        return 0;
+    }
+    if (reserve(b) < 0) {
+        containerFree(c);
+        return -1;
+    }
+    b->c[b->n++] = *c;
+    return 0;
+}
+
+void bitmapInit(struct bitmap *b) { memset(b, 0, sizeof(*b)); }
+
+void bitmapFree(struct bitmap *b) {
+    int k;
+
+    for (k = 0; k < b->n; k++) {
+        containerFree(&b->c[k]);
+    }
+    free(b->c);
+    bitmapInit(b);
+}
+
+int bitmapAdd(struct bitmap *b, uint32_t v) {
+    uint16_t key = v >> 16, low = v & 0xffff;
+    struct container *c;
+    int k = findKey(b, key), pos;
+
+    if (k < 0) {
+        k = -k - 1;
+        if (reserve(b) < 0) {
+            return -1;
+        }
+        memmove(&b->c[k + 1], &b->c[k], (b->n - k) * sizeof(*b->c));
+        memset(&b->c[k], 0, sizeof(*b->c));
+        b->c[k].key = key;
+        if ((b->c[k].u.array = malloc(arrayCap(1) * sizeof(uint16_t))) ==
+            NULL) {
+            memmove(&b->c[k], &b->c[k + 1], (b->n - k) * sizeof(*b->c));
+            return -1;
+        }
+        b->n++;
+    }
+    c = &b->c[k];
+    if (!c->isSet) {
+        if ((pos = findLow(c, low)) >= 0) {
+            return 0;
+        }
+        if (c->card < BITMAP_ARRAY_MAX) {
+            pos = -pos - 1;
+            if (c->card == arrayCap(c->card)) {
+                uint16_t *na = realloc(c->u.array,
+                                       arrayCap(c->card + 1) * sizeof(*na));
+                if (na == NULL) {
+                    return -1;
+                }
+                c->u.array = na;
+            }
+            memmove(&c->u.array[pos + 1], &c->u.array[pos],
+                    (c->card - pos) * sizeof(uint16_t));
+            c->u.array[pos] = low;
+            c->card++;
+            return 1;
+        }
+        if (toSet(c) < 0) {
+            return -1;
+        }
+    }
+    if (c->u.bits[low >> 6] & (1ULL << (low & 63))) {
+        return 0;
+    }
+    c->u.bits[low >> 6] |= 1ULL << (low & 63);
+    c->card++;
+    return 1;
+}
+
+void bitmapRemove(struct bitmap *b, uint32_t v) {
+    uint16_t low = v & 0xffff;
+    struct container *c;
+    int k = findKey(b, v >> 16), pos;
+
+    if (k < 0) {
+        return;
+    }
+    c = &b->c[k];
+    if (c->isSet) {
+        if (!(c->u.bits[low >> 6] & (1ULL << (low & 63)))) {
+            return;
+        }
+        c->u.bits[low >> 6] &= ~(1ULL << (low & 63));
+        if (--c->card <= BITMAP_ARRAY_MAX) {
+            toArray(c);
+        }
+    } else {
+        if ((pos = findLow(c, low)) < 0) {
+            return;
+        }
+        memmove(&c->u.array[pos], &c->u.array[pos + 1],
+                (c->card - pos - 1) * sizeof(uint16_t));
+        c->card--;
+    }
+    if (c->card == 0) {
+        containerFree(c);
+        memmove(&b->c[k], &b->c[k + 1], (b->n - k - 1) * sizeof(*b->c));
+        b->n--;
+    }
+}
+
+int bitmapContains(const struct bitmap *b, uint32_t v) {
+    uint16_t low = v & 0xffff;
+    const struct container *c;
+    int k = findKey(b, v >> 16);
+
+    if (k < 0) {
+        return 0;
+    }
+    c = &b->c[k];
+    if (c->isSet) {
+        return (c->u.bits[low >> 6] >> (low & 63)) & 1;
+    }
+    return findLow(c, low) >= 0;
+}
+
+uint64_t bitmapCard(const struct bitmap *b) {
+    uint64_t card = 0;
+    int k;
+
+    for (k = 0; k < b->n; k++) {
+        card += b->c[k].card;
+    }
+    return card;
+}
+
+static int copyContainer(struct container *dst, const struct container *src) {
+    size_t size = src->isSet ? BITMAP_WORDS * sizeof(uint64_t)
+                             : arrayCap(src->card) * sizeof(uint16_t);
+
+    *dst = *src;
+    if ((dst->u.bits = malloc(size)) == NULL) {
+        return -1;
+    }
+    memcpy(dst->u.bits, src->u.bits,
+           src->isSet ? size : src->card * sizeof(uint16_t));
+    return 0;
+}
+
+static void wordsOp(uint64_t *out, const uint64_t *a, const uint64_t *b,
+                    int op) {
+    int w = 0;
+
+#if defined(__AVX2__)
+    for (; w < BITMAP_WORDS; w += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + w));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + w));
+        __m256i r = op == OP_OR    ? _mm256_or_si256(x, y)
+                    : op == OP_AND ? _mm256_and_si256(x, y)
+                                   : _mm256_andnot_si256(y, x);
+        _mm256_storeu_si256((__m256i *)(out + w), r);
+    }
+#elif defined(__SSE2__)
+    for (; w < BITMAP_WORDS; w += 2) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + w));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + w));
+        __m128i r = op == OP_OR    ? _mm_or_si128(x, y)
+                    : op == OP_AND ? _mm_and_si128(x, y)
+                                   : _mm_andnot_si128(y, x);
+        _mm_storeu_si128((__m128i *)(out + w), r);
+    }
+#endif
+    for (; w < BITMAP_WORDS; w++) {
+        out[w] = op == OP_OR    ? a[w] | b[w]
+                 : op == OP_AND ? a[w] & b[w]
+                                : a[w] & ~b[w];
+    }
+}
+
+static void setBits(uint64_t *bits, const struct container *c) {
+    uint32_t k;
+
+    if (c->isSet) {
+        memcpy(bits, c->u.bits, BITMAP_WORDS * sizeof(*bits));
+        return;
+    }
+    memset(bits, 0, BITMAP_WORDS * sizeof(*bits));
+    for (k = 0; k < c->card; k++) {
+        bits[c->u.array[k] >> 6] |= 1ULL << (c->u.array[k] & 63);
+    }
+}
+
+static int arrayOp(struct container *out, const struct container *a,
+                   const struct container *b, int op) {
+    uint32_t i = 0, j = 0, n = 0;
+    uint16_t *r;
+
+    if ((r = malloc(arrayCap(a->card + b->card) * sizeof(*r))) == NULL) {
+        return -1;
+    }
+    while (i < a->card && j < b->card) {
+        if (a->u.array[i] < b->u.array[j]) {
+            if (op != OP_AND) {
+                r[n++] = a->u.array[i];
+            }
+            i++;
+        } else if (a->u.array[i] > b->u.array[j]) {
+            if (op == OP_OR) {
+                r[n++] = b->u.array[j];
+            }
+            j++;
+        } else {
+            if (op != OP_ANDNOT) {
+                r[n++] = a->u.array[i];
+            }
+            i++;
+            j++;
+        }
+    }
+    if (op != OP_AND) {
+        while (i < a->card) {
+            r[n++] = a->u.array[i++];
+        }
+    }
+    if (op == OP_OR) {
+        while (j < b->card) {
+            r[n++] = b->u.array[j++];
+        }
+    }
+    out->isSet = 0;
+    out->card = n;
+    out->u.array = r;
+    if (n > BITMAP_ARRAY_MAX) {
+        return toSet(out);
+    }
+    return 0;
+}
+
+static int containerOp(struct container *out, const struct container *a,
+                       const struct container *b, int op) {
+    uint64_t *x, *y;
+    uint32_t w;
+
+    out->key = a->key;
+    if (!a->isSet && !b->isSet) {
+        return arrayOp(out, a, b, op);
+    }
+    x = malloc(BITMAP_WORDS * sizeof(*x));
+    y = malloc(BITMAP_WORDS * sizeof(*y));
+    if (x == NULL || y == NULL) {
+        free(x);
+        free(y);
+        return -1;
+    }
+    setBits(x, a);
+    setBits(y, b);
+    wordsOp(x, x, y, op);
+    free(y);
+    out->isSet = 1;
+    out->u.bits = x;
+    out->card = 0;
+    for (w = 0; w < BITMAP_WORDS; w++) {
+        out->card += __builtin_popcountll(x[w]);
+    }
+    if (out->card <= BITMAP_ARRAY_MAX) {
+        return toArray(out);
+    }
+    return 0;
+}
+
+/* merges the key lists of a and b; dst may alias either input */
+static int bitmapOp(struct bitmap *dst, const struct bitmap *a,
+                    const struct bitmap *b, int op) {
+    struct bitmap r;
+    struct container c;
+    int i = 0, j = 0, rc = 0;
+
+    bitmapInit(&r);
+    while (rc == 0 && (i < a->n || j < b->n)) {
+        if (j >= b->n || (i < a->n && a->c[i].key < b->c[j].key)) {
+            if (op != OP_AND && (rc = copyContainer(&c, &a->c[i])) == 0) {
+                rc = push(&r, &c);
+            }
+            i++;
+        } else if (i >= a->n || a->c[i].key > b->c[j].key) {
+            if (op == OP_OR && (rc = copyContainer(&c, &b->c[j])) == 0) {
+                rc = push(&r, &c);
+            }
+            j++;
+        } else {
+            if ((rc = containerOp(&c, &a->c[i], &b->c[j], op)) == 0) {
+                rc = push(&r, &c);
+            }
+            i++;
+            j++;
+        }
+    }
+    if (rc < 0) {
+        bitmapFree(&r);
+        return -1;
+    }
+    bitmapFree(dst);
+    *dst = r;
+    return 0;
+}
+
+int bitmapOr(struct bitmap *dst, const struct bitmap *a,
+             const struct bitmap *b) {
+    return bitmapOp(dst, a, b, OP_OR);
+}
+
+int bitmapAnd(struct bitmap *dst, const struct bitmap *a,
+              const struct bitmap *b) {
+    return bitmapOp(dst, a, b, OP_AND);
+}
+
+int bitmapAndNot(struct bitmap *dst, const struct bitmap *a,
+                 const struct bitmap *b) {
+    return bitmapOp(dst, a, b, OP_ANDNOT);
+}
+
+size_t bitmapToArray(const struct bitmap *b, uint32_t *out, size_t max) {
+    size_t n = 0;
+    uint32_t k, w, high;
+    uint64_t word;
+    int i;
+
+    for (i = 0; i < b->n && n < max; i++) {
+        high = (uint32_t)b->c[i].key << 16;
+        if (!b->c[i].isSet) {
+            for (k = 0; k < b->c[i].card && n < max; k++) {
+                out[n++] = high | b->c[i].u.array[k];
+            }
+            continue;
+        }
+        for (w = 0; w < BITMAP_WORDS && n < max; w++) {
+            for (word = b->c[i].u.bits[w]; word != 0 && n < max;
+                 word &= word - 1) {
+                out[n++] = high | (w * 64 + __builtin_ctzll(word));
+            }
+        }
+    }
+    return n;
+}
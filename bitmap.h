@@ -0,0 +1,64 @@
+/* *
+ * Name: bitmap.h                                                   *
+ *                                                                  *
+ * Description: compressed bitmaps include file                     *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __BITMAP_H
+#define __BITMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Roaring style: 32 bit values are split by their high 16 bits into
+ * containers. A container holds a sorted array of low halves while it
+ * is sparse and switches to a 65536 bit set once it would hold more
+ * than BITMAP_ARRAY_MAX values.
+ */
+#define BITMAP_ARRAY_MAX 4096
+#define BITMAP_WORDS 1024 /* 64 bit words in a bit set container */
+
+struct container {
+    uint16_t key;   /* high 16 bits */
+    uint16_t isSet; /* 1 for a bit set, 0 for a sorted array */
+    uint32_t card;
+    union {
+        uint16_t *array;
+        uint64_t *bits;
+    } u;
+};
+
+struct bitmap {
+    struct container *c; /* sorted by key */
+    int n;
+    int cap;
+};
+
+void bitmapInit(struct bitmap *b);
+void bitmapFree(struct bitmap *b);
+int bitmapAdd(struct bitmap *b, uint32_t v);
+void bitmapRemove(struct bitmap *b, uint32_t v);
+int bitmapContains(const struct bitmap *b, uint32_t v);
+uint64_t bitmapCard(const struct bitmap *b);
+int bitmapOr(struct bitmap *dst, const struct bitmap *a, const struct bitmap *b);
+int bitmapAnd(struct bitmap *dst, const struct bitmap *a, const struct bitmap *b);
+int bitmapAndNot(struct bitmap *dst, const struct bitmap *a,
+                 const struct bitmap *b);
+size_t bitmapToArray(const struct bitmap *b, uint32_t *out, size_t max);
+
+#endif
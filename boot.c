@@ -0,0 +1,231 @@
+/* *
+ * Name: boot.c                                                     *
+ *                                                                  *
+ * Description: socket activation and prefaulting for fast startup  *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+#include "boot.h"
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+/*
+ * A supervisor (systemd, or a script holding the ports across a
+ * restart) binds and listens, then starts us with the sockets from
+ * descriptor 3 on, LISTEN_FDS saying how many and LISTEN_PID whose
+ * they are. Connections arriving before we are up wait in the
+ * kernel's backlog instead of being refused.
+ *
+ * Prefaulting touches the static tables, the bottom of the malloc
+ * heap and the caller's pools once at startup, and keeps the heap from
+ * being trimmed, so the first minute of traffic does not pay for page
+ * faults.
+ */
+
+/* the executable's initialized data and bss, from the linker */
+extern char __data_start[], end[];
+
+static int inherited[BOOT_MAXFDS]; /* -1 once claimed */
+static int nInherited, nClaimed;
+static struct timespec start, serving;
+static size_t faulted;
+static long faultsAtServing, faultsInWindow = -1;
+
+/* first minute pass times, in power of two microsecond buckets */
+static unsigned long passes[32], nPass;
+static long passMax;
+
+static double msSince(const struct timespec *t0, const struct timespec *t1) {
+    return (t1->tv_sec - t0->tv_sec) * 1000.0 +
+           (t1->tv_nsec - t0->tv_nsec) / 1000000.0;
+}
+
+static long faults(void) {
+    struct rusage ru;
+
+    return getrusage(RUSAGE_SELF, &ru) < 0 ? 0 : ru.ru_minflt + ru.ru_majflt;
+}
+
+void bootPrefault(void *p, size_t len) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char *from = p, *to = from + len;
+    volatile char *c;
+
+    if (len == 0) {
+        return;
+    }
+#ifdef MADV_POPULATE_WRITE
+    // Faults the pages in without touching their contents
+    if (madvise((void *)((size_t)from & ~(page - 1)), to - from,
+                MADV_POPULATE_WRITE) == 0) {
+        faulted += len;
+        return;
+    }
+#endif
+    // Older kernels: write each page back to itself, still single threaded
+    for (c = from; c < to; c = (char *)(((size_t)c & ~(page - 1)) + page)) {
+        *c = *c;
+    }
+    faulted += len;
+}
+
+void bootInit(size_t heap) {
+    char *s = getenv("LISTEN_FDS"), *pid = getenv("LISTEN_PID");
+    void *p;
+    int k;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // The sockets are ours only if they were meant for this process
+    if (s != NULL && (pid == NULL || atol(pid) == (long)getpid())) {
+        nInherited = atoi(s) < BOOT_MAXFDS ? atoi(s) : BOOT_MAXFDS;
+        for (k = 0; k < nInherited; k++) {
+            inherited[k] = BOOT_FDS + k;
+            fcntl(inherited[k], F_SETFD, FD_CLOEXEC);
+        }
+    }
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDNAMES");
+    if (heap == 0) {
+        return;
+    }
+    bootPrefault(__data_start, end - __data_start);
+    // Grow the heap by heap bytes on the first allocation and never trim it
+    mallopt(M_TOP_PAD, (int)heap);
+    mallopt(M_TRIM_THRESHOLD, (int)(heap * 2));
+    if ((p = malloc(1)) != NULL) {
+        bootPrefault(p, (char *)sbrk(0) - (char *)p);
+        free(p);
+    }
+}
+
+int bootListener(int family, int type, int port) {
+    struct sockaddr_in6 addr; /* large enough for either family */
+    socklen_t len;
+    int k, sd, val;
+
+    for (k = 0; k < nInherited; k++) {
+        if ((sd = inherited[k]) < 0) {
+            continue;
+        }
+        len = sizeof(addr);
+        if (getsockname(sd, (struct sockaddr *)&addr, &len) < 0 ||
+            addr.sin6_family != family ||
+            ntohs(addr.sin6_port) != port) { /* same offset in sockaddr_in */
+            continue;
+        }
+        len = sizeof(val);
+        if (getsockopt(sd, SOL_SOCKET, SO_TYPE, &val, &len) < 0 || val != type) {
+            continue;
+        }
+        len = sizeof(val);
+        if (type == SOCK_STREAM &&
+            (getsockopt(sd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) < 0 || !val)) {
+            continue;
+        }
+        inherited[k] = -1;
+        nClaimed++;
+        printf("S: inherited listener on port %d\n", port);
+        return sd;
+    }
+    return -1;
+}
+
+void bootServing(void) {
+    int k;
+
+    // Nothing else will ever read the ones no listener asked for
+    for (k = 0; k < nInherited; k++) {
+        if (inherited[k] > -1) {
+            close(inherited[k]);
+            inherited[k] = -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &serving);
+    faultsAtServing = faults();
+    printf("S: serving after %.1f ms, %d of %d inherited listeners, "
+           "%lu KiB prefaulted\n",
+           msSince(&start, &serving), nClaimed, nInherited,
+           (unsigned long)(faulted / 1024));
+}
+
+static long percentile(unsigned long n) {
+    unsigned long seen = 0;
+    int k;
+
+    for (k = 0; k < 32; k++) {
+        if ((seen += passes[k]) >= n) {
+            return (1L << k) < passMax ? 1L << k : passMax;
+        }
+    }
+    return passMax;
+}
+
+static void window(char *buf, size_t len, const char *what) {
+    snprintf(buf, len,
+             "S: %s passes %lu p50 <= %ld us p99 <= %ld us max %ld us "
+             "page faults %ld\n",
+             what, nPass, percentile((nPass + 1) / 2),
+             percentile(nPass - nPass / 100), passMax,
+             (faultsInWindow < 0 ? faults() : faultsInWindow) - faultsAtServing);
+}
+
+/* us is the time spent on one pass that had work */
+void bootPass(long us) {
+    struct timespec now;
+    char line[160];
+    int k = 0;
+
+    if (faultsInWindow >= 0 || serving.tv_sec == 0) {
+        return;
+    }
+    while (k < 31 && (1L << k) < us) {
+        k++;
+    }
+    passes[k]++;
+    nPass++;
+    passMax = us > passMax ? us : passMax;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - serving.tv_sec >= BOOT_WINDOW) {
+        faultsInWindow = faults();
+        window(line, sizeof(line), "first minute");
+        printf("%s", line);
+    }
+}
+
+void bootReport(char *buf, size_t len) {
+    size_t used;
+
+    used = snprintf(buf, len,
+                    "S: boot serving after %.1f ms inherited %d of %d "
+                    "prefaulted %lu KiB\n",
+                    msSince(&start, &serving), nClaimed, nInherited,
+                    (unsigned long)(faulted / 1024));
+    if (used < len) {
+        window(buf + used, len - used,
+               faultsInWindow < 0 ? "startup so far" : "first minute");
+    }
+}
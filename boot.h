@@ -0,0 +1,40 @@
+/* *
+ * Name: boot.h                                                     *
+ *                                                                  *
+ * Description: fast startup include file                           *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+#ifndef __BOOT_H
+#define __BOOT_H
+
+#include <stddef.h>
+
+#define BOOT_FDS 3            /* first inherited descriptor, as with systemd */
+#define BOOT_MAXFDS 16        /* inherited descriptors looked at */
+#define BOOT_HEAP (8 << 20)   /* heap kept faulted in by CHAT_PREFAULT */
+#define BOOT_INTERN 4096      /* interned strings reserved by CHAT_PREFAULT */
+#define BOOT_WINDOW 60        /* seconds of startup latency tracking */
+
+void bootInit(size_t heap);
+int bootListener(int family, int type, int port);
+void bootPrefault(void *p, size_t len);
+void bootServing(void);
+void bootPass(long us);
+void bootReport(char *buf, size_t len);
+
+#endif
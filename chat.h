@@ -37,8 +37,18 @@
 
 #define MAXCHR 256
 #define MAXCON 5
+#define MAXNICK 32
 #define ACK_S "OK"
 #define MSG_C "exit\n"
+#define CMD_NICK "/nick "
+#define CMD_MSG "/msg "
+#define CMD_JOIN "/join "
+#define CMD_TTL "/ttl "
+#define CMD_AT "/at "
+#define CMD_ANNOUNCE "/announce "
+#define CMD_WHO "/who"
+#define CMD_QUIET "/quiet"
+#define CMD_STATS "/stats"
 
 #ifdef IPV6_CHAT
 typedef struct sockaddr_in6 internet_domain_sockaddr;
@@ -19,6 +19,10 @@
  */
 
 #include "chat.h"
+#include "tls.h"
+#include "rudp.h"
+#include "mcast.h"
+#include "redir.h"
 #include <stdlib.h>
 #include <sys/wait.h>
 #include <signal.h>
@@ -27,8 +31,370 @@
 
 void usage(char *cmd) { printf("USAGE:\n%s <hostname>\n", cmd); }
 
+/* multicast receive socket, or -1 when the room comes over TCP only */
+static int mcastSocket(void) {
+    struct sockaddr_in any;
+    int ud, on = 1, off = 0;
+
+    if ((ud = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("C: mcast socket error");
+        return -1;
+    }
+    memset(&any, 0, sizeof(any));
+    any.sin_family = AF_INET;
+    any.sin_port = htons(MCAST_PORT);
+    // Several clients on one host share the port, each hears its own groups
+    if (setsockopt(ud, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        setsockopt(ud, IPPROTO_IP, IP_MULTICAST_ALL, &off, sizeof(off)) < 0 ||
+        bind(ud, (struct sockaddr *)&any, sizeof(any)) < 0) {
+        perror("C: mcast bind error");
+        close(ud);
+        return -1;
+    }
+    return ud;
+}
+
+static int lineStart = 1; /* the next read starts a line */
+
+/* tag at the start of a line of in: only the server writes those, since
+ * "S" is no nickname and everything relayed starts with its sender */
+static const char *serverLine(const char *in, const char *tag) {
+    const char *p = in;
+    size_t n = strlen(tag);
+
+    if (lineStart && strncmp(p, tag, n) == 0) {
+        return p;
+    }
+    while ((p = strchr(p, '\n')) != NULL) {
+        if (strncmp(++p, tag, n) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* "S: mcast <room> <group> <port> <seq> <tag>": follow our room to its
+   group; tag marks our own lines there */
+static void mcastFollow(int ud, const char *in, struct ip_mreq *mreq,
+                        char *room, uint32_t *expect, uint32_t *self) {
+    const char *p = serverLine(in, "S: mcast ");
+    const char *ifaddr = getenv("CHAT_MCAST_IF");
+    char name[MAXROOM], group[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    unsigned long seq, tag = 0;
+    int port, off;
+
+    if (p == NULL) {
+        return;
+    }
+    off = strncmp(p, "S: mcast off", 12) == 0;
+    if (!off &&
+        (sscanf(p + 9, "%31s %15s %d %lu %lu", name, group, &port, &seq,
+                &tag) < 4 ||
+         inet_pton(AF_INET, group, &addr) != 1)) {
+        return; // a loss report, membership stays
+    }
+    if (mreq->imr_multiaddr.s_addr != 0) {
+        setsockopt(ud, IPPROTO_IP, IP_DROP_MEMBERSHIP, mreq, sizeof(*mreq));
+        mreq->imr_multiaddr.s_addr = 0;
+    }
+    room[0] = '\0';
+    if (off) {
+        return;
+    }
+    mreq->imr_multiaddr = addr;
+    inet_pton(AF_INET, ifaddr ? ifaddr : MCAST_IF, &mreq->imr_interface);
+    if (setsockopt(ud, IPPROTO_IP, IP_ADD_MEMBERSHIP, mreq, sizeof(*mreq)) <
+        0) {
+        perror("C: mcast join error");
+        mreq->imr_multiaddr.s_addr = 0;
+        return;
+    }
+    strcpy(room, name);
+    *expect = (uint32_t)seq;
+    *self = (uint32_t)tag;
+}
+
+/* one datagram: print it in order, NACK whatever was skipped over TCP */
+static void mcastRecv(int sd, int ud, const char *room, uint32_t *expect,
+                      uint32_t self, int loss) {
+    struct {
+        struct mcastHdr h;
+        char line[MAXCHR];
+    } pkt;
+    char nack[MAXCHR];
+    ssize_t n = recv(ud, &pkt, sizeof(pkt) - 1, 0);
+    uint32_t seq;
+
+    if (n < (ssize_t)sizeof(pkt.h) || ntohl(pkt.h.magic) != MCAST_MAGIC ||
+        strncmp(pkt.h.room, room, MAXROOM) != 0) {
+        return; // another room hashed onto the same group
+    }
+    if (loss > 0 && rand() % 100 < loss) {
+        return; // CHAT_MCAST_LOSS percent dropped on purpose, for testing
+    }
+    if ((seq = ntohl(pkt.h.seq)) < *expect) {
+        return; // already repaired over TCP
+    }
+    if (seq > *expect) {
+        snprintf(nack, sizeof(nack), "%s%s %lu %lu\n", CMD_NACK, room,
+                 (unsigned long)*expect, (unsigned long)seq - 1);
+        send(sd, nack, strlen(nack), 0);
+    }
+    *expect = seq + 1;
+    if (self != 0 && ntohl(pkt.h.from) == self) {
+        return; // our own line, which TCP does not echo either
+    }
+    ((char *)&pkt)[n] = '\0';
+    printf("\n%s", pkt.line);
+}
+
+static int pairFd = -1; /* reader child to writer, for a moved socket */
+static int chatFd = -1; /* the descriptor both of them use */
+static char sessId[REDIR_TOKEN]; /* what a genuine redirect quotes */
+
+/* REDIR_SESSION: the id this server gave us alone */
+static void sessionFollow(const char *in) {
+    const char *p = serverLine(in, REDIR_SESSION);
+
+    if (p != NULL) {
+        sscanf(p + strlen(REDIR_SESSION), "%16s", sessId);
+    }
+}
+
+/* writer: the reader connected elsewhere, write there from now on */
+static void onMoved(int sig) {
+    char c = 0;
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&c, 1};
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    int nd, saved = errno;
+
+    (void)sig;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl;
+    mh.msg_controllen = sizeof(ctl);
+    if (recvmsg(pairFd, &mh, 0) == 1 && (cm = CMSG_FIRSTHDR(&mh)) != NULL &&
+        cm->cmsg_type == SCM_RIGHTS) {
+        memcpy(&nd, CMSG_DATA(cm), sizeof(nd));
+        c = dup2(nd, chatFd) == chatFd; // 1 tells the reader we moved
+        close(nd);
+    }
+    if (write(pairFd, &c, 1) < 0) {
+        // the reader notices the lost acknowledgment on its own
+    }
+    errno = saved;
+}
+
+/* prints what the new server sends until it says whether we resumed */
+static int resumed(int nd) {
+    struct timeval tv = {REDIR_WAIT, 0};
+    char seen[2 * MAXCHR];
+    size_t used = 0;
+    ssize_t n;
+
+    setsockopt(nd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    seen[0] = '\0';
+    sessId[0] = '\0'; // the new server hands out its own
+    lineStart = 1;
+    while ((n = recv(nd, seen + used, sizeof(seen) - 1 - used, 0)) > 0) {
+        seen[used + n] = '\0';
+        printf("%s", seen + used);
+        used += n;
+        if (sessId[0] == '\0') {
+            sessionFollow(seen);
+        }
+        if (serverLine(seen, REDIR_RESUMED) != NULL) {
+            lineStart = seen[used - 1] == '\n';
+            tv.tv_sec = 0;
+            setsockopt(nd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            return 1;
+        } else if (serverLine(seen, REDIR_UNKNOWN) != NULL) {
+            return 0;
+        }
+        // Only the tail can hold the start of an answer cut in two
+        if (used > MAXCHR) {
+            lineStart = seen[used - MAXCHR - 1] == '\n';
+            memmove(seen, seen + used - MAXCHR, MAXCHR + 1);
+            used = MAXCHR;
+        }
+    }
+    return 0;
+}
+
+/* "S: redirect <host> <port> <token> <jitter ms> <id>": resume there,
+ * 1 once we did */
+static int redirFollow(int sd, const char *in) {
+    const char *p = serverLine(in, REDIR_LINE);
+    char host[INET6_ADDRSTRLEN], port[8], token[REDIR_TOKEN], id[REDIR_TOKEN];
+    char line[MAXCHR];
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {line, 1};
+    struct addrinfo hints, *ai;
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    int nd, jitter, n, k;
+
+    if (p == NULL || sscanf(p + strlen(REDIR_LINE), "%45s %7s %16s %d %16s",
+                            host, port, token, &jitter, id) != 5) {
+        return 0;
+    } else if (sessId[0] == '\0' || strcmp(id, sessId) != 0) {
+        printf("C: ignoring a redirect not from our server\n");
+        return 0;
+    }
+    // Spread out, so the clients moved together do not arrive together
+    usleep(jitter > 0 ? (rand() % jitter) * 1000 : 0);
+    memset(&hints, 0, sizeof(hints));
+#ifdef IPV6_CHAT
+    hints.ai_family = AF_INET6;
+    hints.ai_flags = AI_V4MAPPED;
+#else
+    hints.ai_family = AF_INET;
+#endif
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &ai) != 0) {
+        printf("C: cannot move to %s, staying\n", host);
+        return 0;
+    }
+    if ((nd = socket(ai->ai_family, SOCK_STREAM, 0)) < 0 ||
+        connect(nd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        perror("C: redirect connect error");
+        if (nd > -1) {
+            close(nd);
+        }
+        freeaddrinfo(ai);
+        return 0;
+    }
+    freeaddrinfo(ai);
+    snprintf(line, sizeof(line), "%s%s\n", CMD_RESUME, token);
+    if (send(nd, line, strlen(line), 0) < 0 || !resumed(nd)) {
+        printf("C: could not move to %s, staying\n", host);
+        close(nd);
+        return 0;
+    }
+
+    // The writer takes the new socket, the old one stays open until it has
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl;
+    mh.msg_controllen = sizeof(ctl);
+    cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &nd, sizeof(nd));
+    if (sendmsg(pairFd, &mh, 0) < 0 || kill(getppid(), SIGUSR1) < 0 ||
+        read(pairFd, line, 1) != 1 || line[0] != 1) {
+        perror("C: redirect handover error");
+        close(nd);
+        return 0;
+    }
+
+    // A clean goodbye, whatever the old server still had comes first
+    send(sd, MSG_C, strlen(MSG_C), 0);
+    k = sizeof(ACK_S); // the server sends the terminator along
+    while ((n = recv(sd, line, sizeof(line) - 1, 0)) > 0) {
+        // Printed as it comes, a line split over two reads stays whole
+        if (n >= k && memcmp(line + n - k, ACK_S, k) == 0 &&
+            (n == k || line[n - k - 1] == '\n')) {
+            n -= k;
+        }
+        line[n] = '\0';
+        printf("%s", line);
+    }
+    dup2(nd, sd);
+    close(nd);
+    printf("C: moved to %s\n", host);
+    return 1;
+}
+
+/* reliable UDP keeps its state in this process, so no reader child */
+static int rudpChat(int sd) {
+    char bufferIn[MAXCHR];
+    char bufferOut[MAXCHR];
+    struct timeval tv;
+    fd_set rfds;
+    time_t quit = 0;
+    int n, ms;
+
+    // select() must see every pending line, none parked in stdio
+    setvbuf(stdin, NULL, _IONBF, 0);
+    while (quit == 0 || time(NULL) < quit + 5) {
+        FD_ZERO(&rfds);
+        FD_SET(sd, &rfds);
+        if (quit == 0) {
+            FD_SET(0, &rfds);
+        }
+        ms = rudpTimeout();
+        tv.tv_sec = (ms < 0 || ms >= 1000) ? 1 : 0;
+        tv.tv_usec = (ms < 0 || ms >= 1000) ? 0 : ms * 1000;
+        if (select(sd + 1, &rfds, NULL, NULL, &tv) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("C: select error");
+            break;
+        }
+        rudpTick();
+        if (FD_ISSET(sd, &rfds) || rudpDead(sd)) {
+            do {
+                n = rudpRecv(sd, bufferIn, MAXCHR - 1);
+                if (n > 0) {
+                    bufferIn[n] = '\0';
+                    if (strcmp(bufferIn, ACK_S) == 0) {
+                        printf("C: disconnect from server\n");
+                        quit = -1;
+                    } else {
+                        printf("\n%s", bufferIn);
+                    }
+                }
+            } while (n > 0 && rudpPending(sd));
+            if (n == 0) {
+                printf("C: server closed connection\n");
+                break;
+            } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("C: recv error");
+                break;
+            }
+            if (quit < 0) {
+                break;
+            }
+        }
+        if (quit == 0 && FD_ISSET(0, &rfds)) {
+            printf("C: Message: ");
+            if (fgets(bufferOut, sizeof(bufferOut), stdin) == NULL) {
+                strcpy(bufferOut, MSG_C);
+            }
+            if (rudpSend(sd, bufferOut, strlen(bufferOut)) < 0) {
+                perror("C: send error");
+                break;
+            }
+            if (strncmp(bufferOut, MSG_C, strlen(MSG_C)) == 0) {
+                quit = time(NULL); // wait for the acknowledgment
+            }
+        }
+    }
+    rudpClose(sd);
+    close(sd);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     int sd, cont, pid;
+    int tls = getenv("CHAT_TLS") != NULL;
+    int rudp = getenv("CHAT_RUDP") != NULL;
+    int ud = -1;
+    int pair[2] = {-1, -1};
+    int loss = getenv("CHAT_MCAST_LOSS") ? atoi(getenv("CHAT_MCAST_LOSS")) : 0;
+    char mroom[MAXROOM] = "";
+    uint32_t expect = 0, self = 0;
+    struct ip_mreq mreq;
+    fd_set rfds;
+    int port = tls ? TLS_PORT : rudp ? RUDP_PORT : 5900;
 #ifdef IPV6_CHAT
     int errnum;
 #endif
@@ -42,11 +408,16 @@ int main(int argc, char *argv[]) {
         exit(0);
     }
 
+    if (tls && tlsClientInit(getenv("CHAT_TLS_CA")) < 0) {
+        printf("C: TLS not available\n");
+        exit(1);
+    }
+
     memset((char *)&srv, 0, sizeof(srv));
 #ifdef IPV6_CHAT
-    sd = socket(AF_INET6, SOCK_STREAM, 0);
+    sd = socket(AF_INET6, rudp ? SOCK_DGRAM : SOCK_STREAM, 0);
 #else
-    sd = socket(AF_INET, SOCK_STREAM, 0);
+    sd = socket(AF_INET, rudp ? SOCK_DGRAM : SOCK_STREAM, 0);
 #endif
     if (sd < 0) {
         perror("C: socket error");
@@ -65,35 +436,83 @@ int main(int argc, char *argv[]) {
 #ifdef IPV6_CHAT
     memset(&srv, 0, sizeof(srv));
     srv.sin6_family = hp->h_addrtype;
-    srv.sin6_port = htons(5900);
+    srv.sin6_port = htons(port);
     memcpy((void *)&srv.sin6_addr, (void *)hp->h_addr, hp->h_length);
     freehostent(hp);
     hp = NULL;
 #else
     memcpy((char *)&srv.sin_addr, (char *)hp->h_addr, hp->h_length);
-    srv.sin_port = htons(5900);
+    srv.sin_port = htons(port);
 #endif
     if (connect(sd, (struct sockaddr *)&srv, sizeof(srv)) < 0) {
         perror("C: connect error");
         exit(2);
+    } else if (tls && tlsConnect(sd, argv[1]) < 0) {
+        printf("C: TLS handshake failed\n");
+        exit(2);
+    } else if (rudp) {
+        if (rudpConnect(sd) < 0) {
+            perror("C: reliable UDP connect error");
+            exit(2);
+        }
+        printf("connected...\n");
+        printf("\nWelcome to GegeChat\n\n");
+        return rudpChat(sd);
     } else {
         printf("connected...\n");
         printf("\nWelcome to GegeChat\n\n");
+        // Multicast only on plain connections, the datagrams are cleartext
+        if (getenv("CHAT_MCAST") != NULL && !tls &&
+            (ud = mcastSocket()) > -1) {
+            memset(&mreq, 0, sizeof(mreq));
+            tlsSend(sd, CMD_MCAST "\n", strlen(CMD_MCAST "\n"));
+        }
+        // Plain connections may be told to move to another server
+        if (!tls) {
+            struct sigaction sa;
+
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0) {
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = onMoved;
+                sa.sa_flags = SA_RESTART;
+                sigaction(SIGUSR1, &sa, NULL);
+                chatFd = sd;
+                pairFd = pair[0];
+            }
+        }
         cont = 1;
         pid = fork();
         if (pid < 0) {
             perror("C: fork error");
             exit(3);
+        } else if (pid == 0) {
+            srand(getpid()); // a different jitter in each client
+            pairFd = pairFd > -1 ? pair[1] : -1;
         }
 
         do {
             if (pid == 0) {
                 /* child reading task */
+                if (ud > -1) {
+                    FD_ZERO(&rfds);
+                    FD_SET(sd, &rfds);
+                    FD_SET(ud, &rfds);
+                    if (select((sd > ud ? sd : ud) + 1, &rfds, NULL, NULL,
+                               NULL) < 0) {
+                        continue;
+                    }
+                    if (FD_ISSET(ud, &rfds)) {
+                        mcastRecv(sd, ud, mroom, &expect, self, loss);
+                    }
+                    if (!FD_ISSET(sd, &rfds)) {
+                        continue;
+                    }
+                }
                 memset(bufferIn, 0, MAXCHR);
-                int bytes_received = recv(sd, bufferIn, MAXCHR, 0);
+                int bytes_received = tlsRecv(sd, bufferIn, MAXCHR - 1);
                 if (bytes_received < 0) {
-                    if (errno == EINTR) {
-                        // Interrupted by signal, continue
+                    if (errno == EINTR || errno == EAGAIN) {
+                        // Interrupted by signal, or a TLS record without data
                         continue;
                     } else {
                         // Real network error, exit
@@ -110,6 +529,17 @@ int main(int argc, char *argv[]) {
                         exit(4);
                     } else {
                         printf("\n%s", bufferIn);
+                        if (ud > -1) {
+                            mcastFollow(ud, bufferIn, &mreq, mroom, &expect,
+                                        &self);
+                        }
+                        if (pairFd > -1) {
+                            sessionFollow(bufferIn);
+                        }
+                        // A move leaves lineStart as the new server left it
+                        if (pairFd < 0 || !redirFollow(sd, bufferIn)) {
+                            lineStart = bufferIn[bytes_received - 1] == '\n';
+                        }
                     }
                 }
             } else {
@@ -118,7 +548,7 @@ int main(int argc, char *argv[]) {
                 memset(bufferOut, 0, MAXCHR);
                 fgets(bufferOut, sizeof(bufferOut), stdin);
                 
-                int bytes_sent = send(sd, bufferOut, strlen(bufferOut), 0);
+                int bytes_sent = tlsSend(sd, bufferOut, strlen(bufferOut));
                 if (bytes_sent < 0) {
                     if (errno == EINTR) {
                         // Interrupted by signal, try again
@@ -0,0 +1,216 @@
+/* *
+ * Name: co.c                                                       *
+ *                                                                  *
+ * Description: coroutines on pooled stacks                         *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "co.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifndef __x86_64__
+#include <ucontext.h>
+#endif
+
+/*
+ * A coroutine runs on its own small stack until it calls coYield(),
+ * which switches straight back to whoever resumed it. Stacks come from
+ * a free list fed by mmap() in chunks of CO_CHUNK, each with a guard
+ * page below it so an overflow faults instead of corrupting the next
+ * stack; released stacks are reused as they are, already faulted in.
+ * On x86-64 a switch saves only the callee-saved registers and the
+ * stack pointer; elsewhere ucontext does the same, at the price of a
+ * signal mask system call per switch.
+ */
+
+struct co {
+    struct co *next;    /* free list */
+    char *stack;        /* lowest usable byte, above the guard page */
+    coFunc fn;
+    void *arg;
+    int done;
+#ifdef __x86_64__
+    void *sp;           /* saved while suspended */
+    void *back;         /* resumer's, while running */
+#else
+    ucontext_t ctx;
+    ucontext_t backCtx;
+#endif
+};
+
+static struct co *freeCo;
+static struct co *cur;
+static size_t stackSize;
+static size_t page;
+
+/* statistics */
+static unsigned long nLive, nMapped, nSwitch;
+
+#ifdef __x86_64__
+/* saves callee-saved registers and the stack pointer in *from, then
+   continues wherever to was saved */
+void coSwap(void **from, void *to);
+__asm__(".text\n"
+        ".globl coSwap\n"
+        ".hidden coSwap\n"
+        ".type coSwap, @function\n"
+        "coSwap:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size coSwap, .-coSwap\n");
+#endif
+
+static void start(void) {
+    struct co *c = cur;
+
+    c->fn(c->arg);
+    c->done = 1;
+    // Never returns: the stack is only released once the resumer is back
+#ifdef __x86_64__
+    coSwap(&c->sp, c->back);
+#else
+    swapcontext(&c->ctx, &c->backCtx);
+#endif
+}
+
+int coInit(size_t stack) {
+    page = (size_t)sysconf(_SC_PAGESIZE);
+    stackSize = (stack + page - 1) / page * page;
+    return stackSize > 0 ? 0 : -1;
+}
+
+int coOn(void) { return stackSize > 0; }
+
+static int grow(void) {
+    size_t span = page + stackSize;
+    char *area;
+    struct co *c;
+    int k;
+
+    area = mmap(NULL, span * CO_CHUNK, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) {
+        perror("S: co mmap error");
+        return -1;
+    }
+    for (k = 0; k < CO_CHUNK; k++) {
+        if (mprotect(area + k * span, page, PROT_NONE) < 0 ||
+            (c = calloc(1, sizeof(*c))) == NULL) {
+            perror("S: co stack error");
+            return -1;
+        }
+        c->stack = area + k * span + page;
+        c->next = freeCo;
+        freeCo = c;
+        nMapped++;
+    }
+    return 0;
+}
+
+struct co *coNew(coFunc fn, void *arg) {
+    struct co *c;
+#ifdef __x86_64__
+    void **sp;
+#endif
+
+    if (stackSize == 0 || (freeCo == NULL && grow() < 0)) {
+        return NULL;
+    }
+    c = freeCo;
+    freeCo = c->next;
+    c->fn = fn;
+    c->arg = arg;
+    c->done = 0;
+#ifdef __x86_64__
+    // What coSwap() pops: six registers, then start() as return address
+    sp = (void **)(((uintptr_t)(c->stack + stackSize) & ~(uintptr_t)15) - 8);
+    *--sp = (void *)start;
+    sp -= 6;
+    c->sp = sp;
+#else
+    getcontext(&c->ctx);
+    c->ctx.uc_stack.ss_sp = c->stack;
+    c->ctx.uc_stack.ss_size = stackSize;
+    c->ctx.uc_link = NULL;
+    makecontext(&c->ctx, start, 0);
+#endif
+    nLive++;
+    return c;
+}
+
+/* runs c until it yields or returns; 1 while it is suspended */
+int coResume(struct co *c) {
+    struct co *prev = cur;
+
+    if (c == NULL || c->done) {
+        return 0;
+    }
+    cur = c;
+    nSwitch++;
+#ifdef __x86_64__
+    coSwap(&c->back, c->sp);
+#else
+    swapcontext(&c->backCtx, &c->ctx);
+#endif
+    cur = prev;
+    return !c->done;
+}
+
+void coYield(void) {
+    struct co *c = cur;
+
+#ifdef __x86_64__
+    coSwap(&c->sp, c->back);
+#else
+    swapcontext(&c->ctx, &c->backCtx);
+#endif
+}
+
+/* never the running coroutine; a suspended one is simply abandoned */
+void coFree(struct co *c) {
+    if (c == NULL || c == cur) {
+        return;
+    }
+    c->next = freeCo;
+    freeCo = c;
+    nLive--;
+}
+
+void coReport(char *buf, size_t len) {
+    if (stackSize == 0) {
+        snprintf(buf, len, "S: coroutines off\n");
+        return;
+    }
+    snprintf(buf, len,
+             "S: coroutines live %lu stacks %lu x %zu KiB switches %lu\n",
+             nLive, nMapped, stackSize / 1024, nSwitch);
+}
@@ -0,0 +1,40 @@
+/* *
+ * Name: co.h                                                       *
+ *                                                                  *
+ * Description: coroutine include file                              *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __CO_H
+#define __CO_H
+
+#include <stddef.h>
+
+#define CO_STACK (64 * 1024) /* per coroutine, a guard page comes on top */
+#define CO_CHUNK 16          /* stacks mapped at a time */
+
+struct co;
+typedef void (*coFunc)(void *arg);
+
+int coInit(size_t stack);
+int coOn(void);
+struct co *coNew(coFunc fn, void *arg);
+int coResume(struct co *c);
+void coYield(void);
+void coFree(struct co *c);
+void coReport(char *buf, size_t len);
+
+#endif
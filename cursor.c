@@ -0,0 +1,609 @@
+/* *
+ * Name: cursor.c                                                   *
+ *                                                                  *
+ * Description: durable cursors for history log subscribers         *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+#include "cursor.h"
+#include "history.h"
+#include "room.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/*
+ * A history log can only be walked backwards, from each record's
+ * trailer to its start. A cursor remembers record ends at least
+ * CURSOR_STRIDE apart, found by walking back from the end of the log
+ * to where the last walk stopped, so a batch can end on a record
+ * without reading what it covers. Batches go out with sendfile() from
+ * the page cache, no larger than the socket takes at once, and the
+ * rest waits for the next pass: a slow subscriber only delays itself,
+ * and subscribers never appear in a room's fan-out.
+ *
+ * Compaction rewrites a log and moves every offset. A cursor keeps the
+ * id of the record its committed offset ends and the inode of the log
+ * it was in; on a new inode it looks for that id again. Compaction
+ * keeps whatever the cursors of a room have not committed, so nothing
+ * a subscriber still has to read expires under it.
+ */
+
+#define ENDS 8 /* recent batch ends a commit may name */
+
+struct cursor {
+    char name[CURSOR_NAME];
+    char room[MAXROOM];
+    uint64_t off;       /* committed */
+    uint64_t id;        /* of the record ending at off, 0 at the start */
+    uint64_t pos;       /* end of the last batch pulled */
+    uint64_t ends[ENDS];
+    ino_t ino;          /* log that the offsets refer to */
+    int logfd;
+    uint64_t indexed;   /* record ends known up to here */
+    uint64_t *mark;     /* ascending record ends */
+    size_t nMark, capMark;
+};
+
+struct sub {
+    int sd;
+    char in[128];
+    size_t used;
+    int logfd;          /* batch still going out, -1 when none */
+    off_t at, end;
+};
+
+static char curDir[256] = CURSOR_DIR;
+static int listenFd = -1;
+static struct cursor cursor[CURSOR_MAX];
+static int nCursor;
+static struct sub sub[CURSOR_CONNS];
+
+/* statistics */
+static unsigned long nSub, nPull, nEmpty, nPartial, nCommit, nMoved;
+static unsigned long long nBytes;
+
+static void reply(int sd, const char *fmt, ...) {
+    char line[160];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (send(sd, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1,
+             MSG_NOSIGNAL) < 0) {
+        perror("S: cursor reply error");
+    }
+}
+
+static int plain(const char *s, size_t max) {
+    size_t len = strlen(s);
+
+    if (len == 0 || len >= max) {
+        return 0;
+    }
+    for (; *s; s++) {
+        if (!((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') ||
+              (*s >= '0' && *s <= '9') || *s == '_' || *s == '-')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* bytes the socket takes right now without blocking */
+static long space(int sd) {
+    int size, queued;
+    socklen_t len = sizeof(size);
+
+    if (getsockopt(sd, SOL_SOCKET, SO_SNDBUF, &size, &len) < 0 ||
+        ioctl(sd, SIOCOUTQ, &queued) < 0) {
+        return 0;
+    }
+    // The kernel doubles SO_SNDBUF for its own bookkeeping
+    return size / 2 - queued;
+}
+
+/* the end of the last record with an id up to id, 0 if none */
+static uint64_t find(int fd, uint64_t size, uint64_t id) {
+    struct histRec rec;
+    uint64_t e = size;
+    char *p;
+
+    if (id == 0 || size == 0 ||
+        (p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        return 0;
+    }
+    while (e >= sizeof(rec)) {
+        memcpy(&rec, p + e - sizeof(rec), sizeof(rec));
+        if (rec.id <= id || rec.len + sizeof(rec) > e) {
+            break;
+        }
+        e -= rec.len + sizeof(rec);
+    }
+    munmap(p, size);
+    return e < sizeof(rec) ? 0 : e;
+}
+
+/* opens the cursor's log, following it across compactions; its size */
+static long long logSize(struct cursor *c) {
+    char path[512];
+    struct stat st, at;
+
+    histLogPath(c->room, path, sizeof(path));
+    if (stat(path, &st) < 0) {
+        return 0; /* nothing said in the room yet */
+    }
+    if (c->logfd > -1 && fstat(c->logfd, &at) == 0 && at.st_ino == st.st_ino) {
+        return st.st_size;
+    }
+    if (c->logfd > -1) {
+        close(c->logfd);
+    }
+    if ((c->logfd = open(path, O_RDONLY)) < 0 || fstat(c->logfd, &st) < 0) {
+        perror("S: cursor log open error");
+        return -1;
+    }
+    if (st.st_ino != c->ino || (uint64_t)st.st_size < c->off) {
+        // A rewritten log: find the committed record again, and resend
+        // whatever was pulled but not committed
+        if (c->ino != 0) {
+            c->off = find(c->logfd, st.st_size, c->id);
+            nMoved++;
+        }
+        c->ino = st.st_ino;
+        c->pos = c->off;
+        memset(c->ends, 0, sizeof(c->ends));
+    }
+    c->nMark = 0;
+    c->indexed = c->pos;
+    return st.st_size;
+}
+
+static int addMark(struct cursor *c, uint64_t e) {
+    uint64_t *n;
+
+    if (c->nMark == c->capMark) {
+        if ((n = realloc(c->mark, (c->capMark ? c->capMark * 2 : 64) *
+                                      sizeof(*n))) == NULL) {
+            return -1;
+        }
+        c->mark = n;
+        c->capMark = c->capMark ? c->capMark * 2 : 64;
+    }
+    c->mark[c->nMark++] = e;
+    return 0;
+}
+
+/* learns the record ends between indexed and size */
+static int extend(struct cursor *c, uint64_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE), n = 0, cap = 0, k;
+    uint64_t base = c->indexed & ~(uint64_t)(page - 1), e = size, *got = NULL,
+             *g;
+    struct histRec rec;
+    char *p;
+
+    if (size <= c->indexed) {
+        return 0;
+    }
+    p = mmap(NULL, size - base, PROT_READ, MAP_SHARED, c->logfd, base);
+    if (p == MAP_FAILED) {
+        perror("S: cursor mmap error");
+        return -1;
+    }
+    // Walk back, keeping the newest end and then one per stride
+    while (e > c->indexed && e - c->indexed >= sizeof(rec)) {
+        memcpy(&rec, p + (e - base) - sizeof(rec), sizeof(rec));
+        if (rec.len + sizeof(rec) > e - c->indexed) {
+            break;
+        }
+        if (n == 0 || got[n - 1] - e >= CURSOR_STRIDE) {
+            if (n == cap) {
+                if ((g = realloc(got, (cap = cap ? cap * 2 : 64) *
+                                          sizeof(*g))) == NULL) {
+                    break;
+                }
+                got = g;
+            }
+            got[n++] = e;
+        }
+        e -= rec.len + sizeof(rec);
+    }
+    munmap(p, size - base);
+    if (e != c->indexed) {
+        // A torn record at the end: wait until the append completes
+        free(got);
+        return -1;
+    }
+    // The previous end is not needed when the stride passes it
+    if (c->nMark >= 2 &&
+        c->mark[c->nMark - 1] - c->mark[c->nMark - 2] < CURSOR_STRIDE) {
+        c->nMark--;
+    }
+    for (k = n; k-- > 0;) {
+        if (addMark(c, got[k]) < 0) {
+            free(got);
+            return -1;
+        }
+    }
+    free(got);
+    c->indexed = size;
+    return 0;
+}
+
+/* the furthest known record end at most max past pos, else the nearest */
+static uint64_t batchEnd(struct cursor *c, uint64_t max) {
+    size_t lo = 0, hi = c->nMark, mid;
+    uint64_t end;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (c->mark[mid] <= c->pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == c->nMark) {
+        return c->pos;
+    }
+    for (end = c->mark[lo]; lo + 1 < c->nMark &&
+                            c->mark[lo + 1] - c->pos <= max;) {
+        end = c->mark[++lo];
+    }
+    return end;
+}
+
+static int save(struct cursor *c) {
+    char path[512], tmp[520];
+    FILE *f;
+    int ok;
+
+    snprintf(path, sizeof(path), "%s/%s", curDir, c->name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((f = fopen(tmp, "w")) == NULL) {
+        perror("S: cursor save error");
+        return -1;
+    }
+    fprintf(f, "%s %llu %llu %lu\n", c->room, (unsigned long long)c->off,
+            (unsigned long long)c->id, (unsigned long)c->ino);
+    ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0 || !ok || rename(tmp, path) < 0) {
+        perror("S: cursor save error");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static struct cursor *lookup(const char *name) {
+    int k;
+
+    for (k = 0; k < nCursor; k++) {
+        if (strcmp(cursor[k].name, name) == 0) {
+            return &cursor[k];
+        }
+    }
+    return NULL;
+}
+
+/* an existing cursor, from memory or its file, or a new one */
+static struct cursor *attach(const char *name, const char *room) {
+    struct cursor *c = lookup(name);
+    unsigned long long off, id;
+    unsigned long ino;
+    char path[512], was[MAXROOM];
+    FILE *f;
+
+    if (c != NULL || nCursor == CURSOR_MAX) {
+        return c;
+    }
+    c = &cursor[nCursor];
+    memset(c, 0, sizeof(*c));
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    snprintf(c->room, sizeof(c->room), "%s", room);
+    c->logfd = -1;
+    snprintf(path, sizeof(path), "%s/%s", curDir, name);
+    if ((f = fopen(path, "r")) != NULL) {
+        if (fscanf(f, "%31s %llu %llu %lu", was, &off, &id, &ino) == 4) {
+            snprintf(c->room, sizeof(c->room), "%s", was);
+            c->off = off;
+            c->id = id;
+            c->ino = (ino_t)ino;
+        }
+        fclose(f);
+    }
+    nCursor++;
+    return c;
+}
+
+static void drop(struct sub *s) {
+    if (s->logfd > -1) {
+        close(s->logfd);
+        s->logfd = -1;
+    }
+    close(s->sd);
+    s->sd = -1;
+    s->used = 0;
+}
+
+static void push(struct sub *s) {
+    ssize_t n;
+
+    while (s->at < s->end) {
+        if ((n = sendfile(s->sd, s->logfd, &s->at, s->end - s->at)) > 0) {
+            nBytes += n;
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            nPartial++;
+            return;
+        }
+        // The batch line promised bytes that will never come
+        perror("S: cursor sendfile error");
+        drop(s);
+        return;
+    }
+    close(s->logfd);
+    s->logfd = -1;
+}
+
+static void pull(struct sub *s, struct cursor *c, unsigned long max) {
+    long long size = logSize(c);
+    long room = space(s->sd) - 80;
+    uint64_t from = c->pos, end;
+
+    if (size < 0 || (size > 0 && extend(c, size) < 0)) {
+        reply(s->sd, "S: batch %s %llu %llu\n", c->name,
+              (unsigned long long)from, (unsigned long long)from);
+        nEmpty++;
+        return;
+    }
+    // Never more than fits now, unless one stride alone is larger
+    if (room < 1) {
+        room = 1;
+    }
+    if (max > (unsigned long)room) {
+        max = room;
+    }
+    end = batchEnd(c, max);
+    reply(s->sd, "S: batch %s %llu %llu\n", c->name, (unsigned long long)from,
+          (unsigned long long)end);
+    if (end == from) {
+        nEmpty++;
+        return;
+    }
+    // Its own descriptor, in case a compaction reopens the cursor's
+    if ((s->logfd = dup(c->logfd)) < 0) {
+        perror("S: cursor dup error");
+        return;
+    }
+    s->at = from;
+    s->end = end;
+    memmove(c->ends + 1, c->ends, sizeof(c->ends) - sizeof(c->ends[0]));
+    c->ends[0] = c->pos = end;
+    nPull++;
+    push(s);
+}
+
+static void commit(int sd, struct cursor *c, uint64_t off) {
+    struct histRec rec;
+    int k;
+
+    for (k = 0; k < ENDS && c->ends[k] != off; k++) {
+    }
+    if (off != c->off && (k == ENDS || off == 0)) {
+        reply(sd, "S: %llu is not a batch end of %s, pull again\n",
+              (unsigned long long)off, c->name);
+        return;
+    }
+    if (off >= sizeof(rec) &&
+        pread(c->logfd, &rec, sizeof(rec), off - sizeof(rec)) == sizeof(rec)) {
+        c->id = rec.id;
+    } else if (off == 0) {
+        c->id = 0;
+    }
+    c->off = off;
+    if (save(c) < 0) {
+        reply(sd, "S: commit of %s failed\n", c->name);
+        return;
+    }
+    nCommit++;
+    reply(sd, "S: committed %s %llu\n", c->name, (unsigned long long)off);
+}
+
+static void command(struct sub *s, char *line) {
+    char name[CURSOR_NAME], room[MAXROOM];
+    unsigned long long off;
+    unsigned long max = CURSOR_BATCH;
+    struct cursor *c;
+
+    if (sscanf(line, "sub %31s %31s", name, room) == 2) {
+        if (!plain(name, CURSOR_NAME) || !plain(room, MAXROOM)) {
+            reply(s->sd, "S: usage sub <cursor> <room>\n");
+        } else if ((c = attach(name, room)) == NULL) {
+            reply(s->sd, "S: too many cursors\n");
+        } else if (strcmp(c->room, room) != 0) {
+            reply(s->sd, "S: cursor %s follows room %s\n", name, c->room);
+        } else {
+            // Start over from what was committed
+            c->pos = c->off;
+            c->nMark = 0;
+            c->indexed = c->pos;
+            logSize(c);
+            nSub++;
+            reply(s->sd, "S: cursor %s %s at %llu\n", name, c->room,
+                  (unsigned long long)c->pos);
+        }
+    } else if (strncmp(line, "pull ", 5) == 0 &&
+               sscanf(line + 5, "%31s %lu", name, &max) >= 1) {
+        if ((c = lookup(name)) == NULL) {
+            reply(s->sd, "S: no cursor %s, sub first\n", name);
+        } else {
+            pull(s, c, max);
+        }
+    } else if (sscanf(line, "commit %31s %llu", name, &off) == 2) {
+        if ((c = lookup(name)) == NULL) {
+            reply(s->sd, "S: no cursor %s, sub first\n", name);
+        } else {
+            commit(s->sd, c, off);
+        }
+    } else {
+        reply(s->sd, "S: usage sub|pull|commit\n");
+    }
+}
+
+int curInit(const char *dir, int sd) {
+    struct dirent *e;
+    DIR *d;
+    int k;
+
+    for (k = 0; k < CURSOR_CONNS; k++) {
+        sub[k].sd = -1;
+        sub[k].logfd = -1;
+    }
+    snprintf(curDir, sizeof(curDir), "%s", dir);
+    if (mkdir(curDir, 0700) < 0 && errno != EEXIST) {
+        perror("S: curInit mkdir error");
+        return -1;
+    }
+    // Every cursor on disk holds back compaction, attached or not
+    if ((d = opendir(curDir)) != NULL) {
+        while ((e = readdir(d)) != NULL) {
+            if (plain(e->d_name, CURSOR_NAME) && attach(e->d_name, "") == NULL) {
+                break;
+            }
+        }
+        closedir(d);
+    }
+    listenFd = sd;
+    return 0;
+}
+
+/* the listener and subscribers waiting for a command, or to send more */
+void curFds(fd_set *set, fd_set *out) {
+    int k;
+
+    if (listenFd < 0) {
+        return;
+    }
+    FD_SET(listenFd, set);
+    for (k = 0; k < CURSOR_CONNS; k++) {
+        if (sub[k].sd > -1) {
+            FD_SET(sub[k].sd, sub[k].logfd < 0 ? set : out);
+        }
+    }
+}
+
+/* the oldest record the room's cursors have committed, all when none */
+uint64_t curPinned(const char *room) {
+    uint64_t pin = UINT64_MAX;
+    int k;
+
+    for (k = 0; k < nCursor; k++) {
+        if (strcmp(cursor[k].room, room) == 0 && cursor[k].id < pin) {
+            pin = cursor[k].id;
+        }
+    }
+    return pin;
+}
+
+void curRun(fd_set *ready, fd_set *writable) {
+    struct sub *s;
+    char *nl, *p;
+    ssize_t n;
+    int k, sd;
+
+    if (listenFd < 0) {
+        return;
+    }
+    if (FD_ISSET(listenFd, ready) && (sd = accept(listenFd, NULL, NULL)) > -1) {
+        for (k = 0; k < CURSOR_CONNS && sub[k].sd > -1; k++) {
+        }
+        if (k == CURSOR_CONNS || sd >= FD_SETSIZE) {
+            close(sd);
+        } else {
+            fcntl(sd, F_SETFL, O_NONBLOCK);
+            sub[k].sd = sd;
+            sub[k].used = 0;
+        }
+    }
+    for (k = 0; k < CURSOR_CONNS; k++) {
+        s = &sub[k];
+        if (s->sd < 0) {
+            continue;
+        }
+        if (s->logfd > -1 && FD_ISSET(s->sd, writable)) {
+            push(s);
+        }
+        if (s->sd > -1 && s->logfd < 0 && FD_ISSET(s->sd, ready)) {
+            n = recv(s->sd, s->in + s->used, sizeof(s->in) - 1 - s->used, 0);
+            if (n == 0 || (n < 0 && errno != EAGAIN)) {
+                drop(s);
+                continue;
+            }
+            s->used += n > 0 ? n : 0;
+        }
+        // One command at a time, and none while a batch is going out
+        while (s->sd > -1 && s->logfd < 0 &&
+               (nl = memchr(s->in, '\n', s->used)) != NULL &&
+               space(s->sd) > 160) {
+            *nl = '\0';
+            if ((p = strchr(s->in, '\r')) != NULL) {
+                *p = '\0';
+            }
+            command(s, s->in);
+            if (s->sd < 0) {
+                break;
+            }
+            s->used -= nl + 1 - s->in;
+            memmove(s->in, nl + 1, s->used);
+        }
+        if (s->used == sizeof(s->in) - 1 && memchr(s->in, '\n', s->used) == NULL) {
+            drop(s); // a line longer than any command
+        }
+    }
+}
+
+void curReport(char *buf, size_t len) {
+    int k, live = 0;
+
+    if (listenFd < 0) {
+        snprintf(buf, len, "S: log subscribers off\n");
+        return;
+    }
+    for (k = 0; k < CURSOR_CONNS; k++) {
+        live += sub[k].sd > -1;
+    }
+    snprintf(buf, len,
+             "S: cursors %d subscribers %d subs %lu pulls %lu empty %lu "
+             "bytes %llu partial %lu commits %lu relocated %lu\n",
+             nCursor, live, nSub, nPull, nEmpty, nBytes, nPartial, nCommit,
+             nMoved);
+}
@@ -0,0 +1,56 @@
+/* *
+ * Name: cursor.h                                                   *
+ *                                                                  *
+ * Description: log subscriber include file                         *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+#ifndef __CURSOR_H
+#define __CURSOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/select.h>
+
+#define CURSOR_DIR "cursors"
+#define CURSOR_PORT 5904
+#define CURSOR_MAX 64         /* named cursors in memory */
+#define CURSOR_CONNS 16       /* subscriber connections */
+#define CURSOR_NAME 32
+#define CURSOR_BATCH 65536    /* bytes per pull unless asked otherwise */
+#define CURSOR_STRIDE 4096    /* spacing of the record boundary index */
+
+/*
+ * Subscribers connect to CURSOR_PORT, not to the chat port, and send
+ * lines:
+ *
+ *   sub <cursor> <room>      attach, creating the cursor at offset 0
+ *   pull <cursor> [bytes]    next batch after the last one pulled
+ *   commit <cursor> <offset> make a batch end durable
+ *
+ * A pull is answered by "S: batch <cursor> <from> <to>\n" and then the
+ * log bytes in between, whole records as described in history.h. A
+ * new sub or a restart continues from the committed offset.
+ */
+
+int curInit(const char *dir, int sd);
+void curFds(fd_set *set, fd_set *out);
+void curRun(fd_set *ready, fd_set *writable);
+uint64_t curPinned(const char *room);
+void curReport(char *buf, size_t len);
+
+#endif
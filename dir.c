@@ -0,0 +1,834 @@
+/* *
+ * Name: dir.c                                                      *
+ *                                                                  *
+ * Description: distributed user directory                          *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+#include "dir.h"
+#include "chat.h"
+#include "idgen.h"
+#include "mailbox.h"
+#include "node.h"
+#include "timer.h"
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Lines between servers:
+ *
+ *   put <nick> <node> <slot> <gen> <id>  holder to owner, also the refresh
+ *   del <nick> <node> <slot> <gen>       holder to owner
+ *   get <nick>                           anyone to owner
+ *   at <nick> <node> <slot> <gen>        owner's answer, or
+ *   none <nick>
+ *   inv <nick>                           owner to servers that asked
+ *   drop <nick> <slot> <gen>             owner to a holder that lost nick
+ *   dm <seq> <nick> <slot> <gen> <text>  to the holder
+ *   box <seq> <nick> <text>              to the owner, user offline
+ *   ok|kept|full|gone <seq>              how a dm or box ended
+ *
+ * The id of a registration comes from idNext(), so when two servers
+ * claim a nick the later claim wins, also after a lost drop.
+ */
+
+struct entry {
+    struct entry *next;
+    char nick[MAXNICK];
+    int node, slot;
+    unsigned gen;
+    uint64_t id;
+    unsigned told; /* servers that may have it cached, bit per node */
+    struct timer lease;
+};
+
+struct cached {
+    char nick[MAXNICK];
+    int node, slot;
+    unsigned gen;
+    time_t until;
+};
+
+struct reg {
+    char nick[MAXNICK];
+    int slot; /* -1 when free */
+    unsigned gen;
+    uint64_t id;
+};
+
+enum { LOOKUP, SENT, BOXED };
+
+struct msg {
+    struct msg *next;
+    unsigned seq;
+    int state, tries, lookups;
+    char nick[MAXNICK];
+    int node, slot; /* destination, once known */
+    unsigned gen;
+    int from;       /* sender's slot, -1 for forwarded mail */
+    unsigned fromGen;
+    uint64_t due;
+    char text[MAXCHR];
+};
+
+static struct dirOps ops;
+static struct entry *table[DIR_BUCKETS];
+static struct cached cache[DIR_CACHE];
+static struct reg regs[DIR_LOCAL];
+static struct msg *pending;
+static struct timer refresh;
+static unsigned nextSeq;
+static unsigned seen[NODE_MAX][DIR_SEEN];
+static int seenAt[NODE_MAX];
+static int nEntry, nPending, self = -1;
+
+/* statistics */
+static unsigned long nHit, nMiss, nAsk, nMerged, nSent, nDelivered, nStored,
+    nFailed, nInv, nDrop, nStale;
+
+static uint64_t nowMs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned hash(const char *nick) {
+    unsigned h = 2166136261u;
+
+    while (*nick) {
+        h = (h ^ (unsigned char)*nick++) * 16777619u;
+    }
+    return h;
+}
+
+/* rendezvous hashing: adding a server moves only the nicks it wins */
+static int owner(const char *nick) {
+    unsigned h = hash(nick), best = 0, w;
+    int k, out = 0;
+
+    for (k = 0; k < nodeCount(); k++) {
+        w = (h ^ ((unsigned)k * 0x9e3779b9u)) * 0x85ebca6bu;
+        w ^= w >> 13;
+        w *= 0xc2b2ae35u;
+        w ^= w >> 16;
+        if (k == 0 || w > best) {
+            best = w;
+            out = k;
+        }
+    }
+    return out;
+}
+
+static struct entry *find(const char *nick) {
+    struct entry *e;
+
+    for (e = table[hash(nick) % DIR_BUCKETS]; e != NULL; e = e->next) {
+        if (strcmp(e->nick, nick) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* servers that asked for the old place must ask again */
+static void invalidate(struct entry *e) {
+    int k;
+
+    for (k = 0; k < nodeCount(); k++) {
+        if (e->told & (1u << k)) {
+            nodeSend(k, "inv %s", e->nick);
+            nInv++;
+        }
+    }
+    e->told = 0;
+}
+
+static void removeEntry(struct entry *e) {
+    struct entry **p;
+
+    for (p = &table[hash(e->nick) % DIR_BUCKETS]; *p != NULL; p = &(*p)->next) {
+        if (*p == e) {
+            *p = e->next;
+            break;
+        }
+    }
+    timerCancel(&e->lease);
+    nEntry--;
+    free(e);
+}
+
+/* a holder that stopped refreshing is taken to be gone */
+static void expire(void *arg) {
+    struct entry *e = arg;
+
+    invalidate(e);
+    removeEntry(e);
+}
+
+/* our connection lost nick to a later claim: stop refreshing it */
+static void letGo(const char *nick, int slot, unsigned gen) {
+    int k;
+
+    for (k = 0; k < DIR_LOCAL; k++) {
+        if (regs[k].slot == slot && regs[k].gen == gen &&
+            strcmp(regs[k].nick, nick) == 0) {
+            regs[k].slot = -1;
+        }
+    }
+    ops.drop(ops.arg, nick, slot, gen);
+}
+
+static void dropAt(int node, const char *nick, int slot, unsigned gen) {
+    nDrop++;
+    if (node == self) {
+        letGo(nick, slot, gen);
+    } else {
+        nodeSend(node, "drop %s %d %u", nick, slot, gen);
+    }
+}
+
+static void transmit(struct msg *m);
+static void forwardMail(struct entry *e);
+
+/* owner side of put */
+static void place(const char *nick, int node, int slot, unsigned gen,
+                  uint64_t id) {
+    struct entry *e = find(nick);
+    unsigned h;
+
+    if (e != NULL && (e->node != node || e->slot != slot || e->gen != gen)) {
+        if (id < e->id) {
+            dropAt(node, nick, slot, gen); // a stale claim, refused
+            return;
+        }
+        dropAt(e->node, nick, e->slot, e->gen);
+        invalidate(e);
+    }
+    if (e == NULL) {
+        if ((e = calloc(1, sizeof(*e))) == NULL) {
+            perror("S: dir calloc error");
+            return;
+        }
+        snprintf(e->nick, sizeof(e->nick), "%s", nick);
+        e->lease.fire = expire;
+        e->lease.arg = e;
+        h = hash(nick) % DIR_BUCKETS;
+        e->next = table[h];
+        table[h] = e;
+        nEntry++;
+    }
+    e->node = node;
+    e->slot = slot;
+    e->gen = gen;
+    e->id = id;
+    timerArm(&e->lease, time(NULL) + DIR_LEASE);
+    if (node != self) {
+        forwardMail(e);
+    }
+}
+
+/* owner side of del: only the registration itself can be withdrawn */
+static void unplace(const char *nick, int node, int slot, unsigned gen) {
+    struct entry *e = find(nick);
+
+    if (e != NULL && e->node == node && e->slot == slot && e->gen == gen) {
+        invalidate(e);
+        removeEntry(e);
+    }
+}
+
+static struct cached *cacheSlot(const char *nick) {
+    return &cache[hash(nick) % DIR_CACHE];
+}
+
+static void uncache(const char *nick) {
+    struct cached *c = cacheSlot(nick);
+
+    if (strcmp(c->nick, nick) == 0) {
+        c->nick[0] = '\0';
+    }
+}
+
+static struct msg *queue(const char *nick, const char *text, size_t len,
+                         int from, unsigned fromGen) {
+    struct msg *m;
+
+    if (nPending >= DIR_PENDING || (m = calloc(1, sizeof(*m))) == NULL) {
+        return NULL;
+    }
+    // The newline is the line separator between servers, added back on arrival
+    while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) {
+        len--;
+    }
+    if (len >= sizeof(m->text)) {
+        len = sizeof(m->text) - 1;
+    }
+    memcpy(m->text, text, len);
+    snprintf(m->nick, sizeof(m->nick), "%s", nick);
+    if (++nextSeq == UINT_MAX) {
+        nextSeq = 0;
+    }
+    m->seq = nextSeq;
+    m->from = from;
+    m->fromGen = fromGen;
+    m->next = pending;
+    pending = m;
+    nPending++;
+    return m;
+}
+
+static void finish(struct msg *m, int how) {
+    struct msg **p;
+
+    switch (how) {
+    case DIR_DELIVERED:
+        nDelivered++;
+        break;
+    case DIR_STORED:
+        nStored++;
+        break;
+    default:
+        nFailed++;
+    }
+    if (m->from >= 0) {
+        ops.result(ops.arg, m->from, m->fromGen, m->nick, how);
+    }
+    for (p = &pending; *p != NULL; p = &(*p)->next) {
+        if (*p == m) {
+            *p = m->next;
+            break;
+        }
+    }
+    nPending--;
+    free(m);
+}
+
+static int store(struct msg *m) {
+    char line[MAXCHR + 1];
+    int n = snprintf(line, sizeof(line), "%s\n", m->text);
+
+    return mboxAppend(m->nick, line, n);
+}
+
+/* the user is online nowhere: the owner keeps the message */
+static void toBox(struct msg *m) {
+    if (owner(m->nick) == self) {
+        finish(m, store(m) < 0 ? DIR_FULL : DIR_STORED);
+        return;
+    }
+    m->state = BOXED;
+    m->tries = 0;
+    transmit(m);
+}
+
+static void route(struct msg *m, int node, int slot, unsigned gen) {
+    char line[MAXCHR + 1];
+    int n;
+
+    if (node < 0) {
+        toBox(m);
+    } else if (node == self) {
+        n = snprintf(line, sizeof(line), "%s\n", m->text);
+        if (ops.deliver(ops.arg, m->nick, slot, gen, line, n) == 0) {
+            finish(m, DIR_DELIVERED);
+        } else {
+            toBox(m);
+        }
+    } else {
+        m->state = SENT;
+        m->node = node;
+        m->slot = slot;
+        m->gen = gen;
+        m->tries = 0;
+        transmit(m);
+    }
+}
+
+/* one get per nick in flight, the other messages for it wait along */
+static void ask(const char *nick) {
+    uint64_t due = nowMs() + DIR_RETRY;
+    struct msg *m;
+
+    nodeSend(owner(nick), "get %s", nick);
+    nAsk++;
+    for (m = pending; m != NULL; m = m->next) {
+        if (m->state == LOOKUP && strcmp(m->nick, nick) == 0) {
+            m->tries++;
+            m->due = due;
+        }
+    }
+}
+
+static void lookup(struct msg *m) {
+    struct cached *c = cacheSlot(m->nick);
+    struct entry *e;
+    struct msg *o;
+
+    if (owner(m->nick) == self) {
+        e = find(m->nick);
+        route(m, e != NULL ? e->node : -1, e ? e->slot : 0, e ? e->gen : 0);
+        return;
+    }
+    if (strcmp(c->nick, m->nick) == 0 && c->until > time(NULL)) {
+        nHit++;
+        route(m, c->node, c->slot, c->gen);
+        return;
+    }
+    nMiss++;
+    m->state = LOOKUP;
+    for (o = pending; o != NULL; o = o->next) {
+        if (o != m && o->state == LOOKUP && strcmp(o->nick, m->nick) == 0) {
+            m->tries = o->tries;
+            m->due = o->due;
+            nMerged++;
+            return;
+        }
+    }
+    ask(m->nick);
+}
+
+static void transmit(struct msg *m) {
+    m->tries++;
+    m->due = nowMs() + (uint64_t)DIR_RETRY * m->tries;
+    if (m->state == SENT) {
+        nodeSend(m->node, "dm %u %s %d %u %s", m->seq, m->nick, m->slot,
+                 m->gen, m->text);
+        nSent++;
+    } else if (m->state == BOXED) {
+        nodeSend(owner(m->nick), "box %u %s %s", m->seq, m->nick, m->text);
+    }
+}
+
+/* mail kept here for a user who has registered on another server */
+static void forwardMail(struct entry *e) {
+    char box[MBOX_CAP];
+    char *line, *end;
+    struct msg *m;
+    size_t used;
+
+    if (mboxTake(e->nick, box, sizeof(box), &used) <= 0) {
+        return;
+    }
+    for (line = box; line < box + used; line = end + 1) {
+        if ((end = memchr(line, '\n', box + used - line)) == NULL) {
+            end = box + used;
+        }
+        if ((m = queue(e->nick, line, end - line, -1, 0)) != NULL) {
+            route(m, e->node, e->slot, e->gen);
+        }
+    }
+}
+
+static struct msg *bySeq(unsigned seq) {
+    struct msg *m;
+
+    for (m = pending; m != NULL && m->seq != seq; m = m->next) {
+    }
+    return m;
+}
+
+/* retransmitted lines must not be delivered twice */
+static int wasSeen(int from, unsigned seq) {
+    int k;
+
+    for (k = 0; k < DIR_SEEN; k++) {
+        if (seen[from][k] == seq) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void markSeen(int from, unsigned seq) {
+    seen[from][seenAt[from]] = seq;
+    seenAt[from] = (seenAt[from] + 1) % DIR_SEEN;
+}
+
+static void onPut(int from, char *args) {
+    char nick[MAXNICK];
+    unsigned long long id;
+    unsigned gen;
+    int node, slot;
+
+    if (sscanf(args, "%31s %d %d %u %llu", nick, &node, &slot, &gen, &id) ==
+            5 &&
+        node == from) {
+        place(nick, node, slot, gen, id);
+    }
+}
+
+static void onDel(int from, char *args) {
+    char nick[MAXNICK];
+    unsigned gen;
+    int node, slot;
+
+    if (sscanf(args, "%31s %d %d %u", nick, &node, &slot, &gen) == 4 &&
+        node == from) {
+        unplace(nick, node, slot, gen);
+    }
+}
+
+static void onGet(int from, char *args) {
+    char nick[MAXNICK];
+    struct entry *e;
+
+    if (sscanf(args, "%31s", nick) != 1) {
+        return;
+    }
+    if ((e = find(nick)) != NULL) {
+        e->told |= 1u << from;
+        nodeSend(from, "at %s %d %d %u", nick, e->node, e->slot, e->gen);
+    } else {
+        nodeSend(from, "none %s", nick);
+    }
+}
+
+static void onAt(int from, char *args) {
+    char nick[MAXNICK];
+    struct cached *c;
+    struct msg *m, *next;
+    unsigned gen;
+    int node, slot;
+
+    (void)from;
+    if (sscanf(args, "%31s %d %d %u", nick, &node, &slot, &gen) != 4 ||
+        node < 0 || node >= nodeCount()) {
+        return;
+    }
+    c = cacheSlot(nick);
+    snprintf(c->nick, sizeof(c->nick), "%s", nick);
+    c->node = node;
+    c->slot = slot;
+    c->gen = gen;
+    c->until = time(NULL) + DIR_LEASE;
+    for (m = pending; m != NULL; m = next) {
+        next = m->next;
+        if (m->state == LOOKUP && strcmp(m->nick, nick) == 0) {
+            route(m, node, slot, gen);
+        }
+    }
+}
+
+static void onNone(int from, char *args) {
+    char nick[MAXNICK];
+    struct msg *m, *next;
+
+    (void)from;
+    if (sscanf(args, "%31s", nick) != 1) {
+        return;
+    }
+    for (m = pending; m != NULL; m = next) {
+        next = m->next;
+        if (m->state == LOOKUP && strcmp(m->nick, nick) == 0) {
+            toBox(m);
+        }
+    }
+}
+
+static void onInv(int from, char *args) {
+    char nick[MAXNICK];
+
+    (void)from;
+    if (sscanf(args, "%31s", nick) == 1) {
+        uncache(nick);
+    }
+}
+
+static void onDrop(int from, char *args) {
+    char nick[MAXNICK];
+    unsigned gen;
+    int slot;
+
+    (void)from;
+    if (sscanf(args, "%31s %d %u", nick, &slot, &gen) == 3) {
+        letGo(nick, slot, gen);
+    }
+}
+
+static void onDm(int from, char *args) {
+    char nick[MAXNICK];
+    char line[MAXCHR + 1];
+    unsigned seq, gen;
+    int slot, n = 0, len;
+
+    if (sscanf(args, "%u %31s %d %u %n", &seq, nick, &slot, &gen, &n) != 4 ||
+        n == 0) {
+        return;
+    }
+    if (wasSeen(from, seq)) {
+        nodeSend(from, "ok %u", seq);
+        return;
+    }
+    len = snprintf(line, sizeof(line), "%s\n", args + n);
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    if (ops.deliver(ops.arg, nick, slot, gen, line, len) == 0) {
+        markSeen(from, seq);
+        nodeSend(from, "ok %u", seq);
+    } else {
+        nodeSend(from, "gone %u", seq);
+    }
+}
+
+static void onBox(int from, char *args) {
+    char nick[MAXNICK];
+    char line[MAXCHR + 1];
+    unsigned seq;
+    int n = 0, len;
+
+    if (sscanf(args, "%u %31s %n", &seq, nick, &n) != 2 || n == 0) {
+        return;
+    }
+    if (wasSeen(from, seq)) {
+        nodeSend(from, "kept %u", seq);
+        return;
+    }
+    len = snprintf(line, sizeof(line), "%s\n", args + n);
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    if (mboxAppend(nick, line, len) < 0) {
+        nodeSend(from, "full %u", seq);
+        return;
+    }
+    // A registration that crossed the lookup collects it at its next refresh
+    markSeen(from, seq);
+    nodeSend(from, "kept %u", seq);
+}
+
+static void onOk(int from, char *args) {
+    struct msg *m = bySeq(strtoul(args, NULL, 10));
+
+    (void)from;
+    if (m != NULL && m->state == SENT) {
+        finish(m, DIR_DELIVERED);
+    }
+}
+
+static void onKept(int from, char *args) {
+    struct msg *m = bySeq(strtoul(args, NULL, 10));
+
+    (void)from;
+    if (m != NULL && m->state == BOXED) {
+        finish(m, DIR_STORED);
+    }
+}
+
+static void onFull(int from, char *args) {
+    struct msg *m = bySeq(strtoul(args, NULL, 10));
+
+    (void)from;
+    if (m != NULL && m->state == BOXED) {
+        finish(m, DIR_FULL);
+    }
+}
+
+/* the cached place was stale: ask the owner once more, then keep it */
+static void onGone(int from, char *args) {
+    struct msg *m = bySeq(strtoul(args, NULL, 10));
+
+    (void)from;
+    if (m == NULL || m->state != SENT) {
+        return;
+    }
+    nStale++;
+    uncache(m->nick);
+    if (m->lookups++ == 0) {
+        m->tries = 0;
+        lookup(m);
+    } else {
+        toBox(m);
+    }
+}
+
+static void announce(struct reg *r) {
+    int to = owner(r->nick);
+
+    if (to == self) {
+        place(r->nick, self, r->slot, r->gen, r->id);
+    } else {
+        nodeSend(to, "put %s %d %d %u %llu", r->nick, self, r->slot, r->gen,
+                 (unsigned long long)r->id);
+    }
+}
+
+/* registrations are soft state: a lost put or del heals here */
+static void renew(void *arg) {
+    int k;
+
+    (void)arg;
+    for (k = 0; k < DIR_LOCAL; k++) {
+        if (regs[k].slot > -1) {
+            announce(&regs[k]);
+        }
+    }
+    timerArm(&refresh, time(NULL) + DIR_LEASE / 3);
+}
+
+int dirInit(const struct dirOps *o) {
+    int k;
+
+    if (!nodeActive()) {
+        return -1;
+    }
+    ops = *o;
+    self = nodeSelf();
+    for (k = 0; k < DIR_LOCAL; k++) {
+        regs[k].slot = -1;
+    }
+    for (k = 0; k < NODE_MAX; k++) {
+        memset(seen[k], 0xff, sizeof(seen[k]));
+    }
+    /* peers still remember our last incarnation's seqs in seen[], so a
+     * restart must not count from 1 again; UINT_MAX is the empty mark */
+    if (getrandom(&nextSeq, sizeof(nextSeq), 0) != sizeof(nextSeq)) {
+        nextSeq = (unsigned)time(NULL) ^ ((unsigned)getpid() << 16);
+    }
+    nodeHandler("put", onPut);
+    nodeHandler("del", onDel);
+    nodeHandler("get", onGet);
+    nodeHandler("at", onAt);
+    nodeHandler("none", onNone);
+    nodeHandler("inv", onInv);
+    nodeHandler("drop", onDrop);
+    nodeHandler("dm", onDm);
+    nodeHandler("box", onBox);
+    nodeHandler("ok", onOk);
+    nodeHandler("kept", onKept);
+    nodeHandler("full", onFull);
+    nodeHandler("gone", onGone);
+    refresh.fire = renew;
+    timerArm(&refresh, time(NULL) + DIR_LEASE / 3);
+    return 0;
+}
+
+void dirPut(const char *nick, int slot, unsigned gen) {
+    int k;
+
+    if (self < 0) {
+        return;
+    }
+    for (k = 0; k < DIR_LOCAL && regs[k].slot > -1; k++) {
+    }
+    if (k == DIR_LOCAL) {
+        printf("S: dirPut no room for %s\n", nick);
+        return;
+    }
+    snprintf(regs[k].nick, sizeof(regs[k].nick), "%s", nick);
+    regs[k].slot = slot;
+    regs[k].gen = gen;
+    regs[k].id = idNext();
+    announce(&regs[k]);
+}
+
+void dirDel(const char *nick, int slot, unsigned gen) {
+    int k, to;
+
+    if (self < 0) {
+        return;
+    }
+    for (k = 0; k < DIR_LOCAL; k++) {
+        if (regs[k].slot == slot && regs[k].gen == gen &&
+            strcmp(regs[k].nick, nick) == 0) {
+            regs[k].slot = -1;
+            if ((to = owner(nick)) == self) {
+                unplace(nick, self, slot, gen);
+            } else {
+                nodeSend(to, "del %s %d %d %u", nick, self, slot, gen);
+            }
+        }
+    }
+}
+
+/* 0: the outcome comes later through ops.result, -1: not clustered */
+int dirSend(const char *nick, const char *msg, size_t len, int slot,
+            unsigned gen) {
+    struct msg *m;
+
+    if (self < 0) {
+        return -1;
+    }
+    if ((m = queue(nick, msg, len, slot, gen)) == NULL) {
+        ops.result(ops.arg, slot, gen, nick, DIR_FAILED);
+        nFailed++;
+        return 0;
+    }
+    lookup(m);
+    return 0;
+}
+
+/* ms until the earliest retry, -1 when nothing waits */
+int dirTimeout(void) {
+    uint64_t now = nowMs(), due = 0;
+    struct msg *m;
+
+    for (m = pending; m != NULL; m = m->next) {
+        if (due == 0 || m->due < due) {
+            due = m->due;
+        }
+    }
+    return due == 0 ? -1 : due <= now ? 0 : (int)(due - now);
+}
+
+void dirTick(void) {
+    uint64_t now = nowMs();
+    struct msg *m, *next;
+
+    for (m = pending; m != NULL; m = next) {
+        next = m->next;
+        if (m->due > now) {
+            continue;
+        }
+        if (m->tries < DIR_TRIES) {
+            if (m->state == LOOKUP) {
+                ask(m->nick);
+                next = pending; // ask() moved every sibling's due time
+            } else {
+                transmit(m);
+            }
+        } else if (m->state == SENT) {
+            uncache(m->nick); // holder unreachable, treat the user as away
+            toBox(m);
+            next = pending;
+        } else {
+            finish(m, DIR_FAILED);
+        }
+    }
+}
+
+void dirReport(char *buf, size_t len) {
+    if (self < 0) {
+        snprintf(buf, len, "S: directory off\n");
+        return;
+    }
+    snprintf(buf, len,
+             "S: directory owned %d pending %d hits %lu misses %lu asked %lu "
+             "merged %lu sent %lu delivered %lu stored %lu failed %lu "
+             "stale %lu invalidated %lu dropped %lu\n",
+             nEntry, nPending, nHit, nMiss, nAsk, nMerged, nSent, nDelivered,
+             nStored, nFailed, nStale, nInv, nDrop);
+}
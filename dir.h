@@ -0,0 +1,72 @@
+/* *
+ * Name: dir.h                                                      *
+ *                                                                  *
+ * Description: distributed user directory include file             *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+
+#ifndef __DIR_H
+#define __DIR_H
+
+#include <stddef.h>
+
+#define DIR_BUCKETS 1024  /* owned entries hash */
+#define DIR_CACHE 256     /* remote entries cached, direct mapped */
+#define DIR_LOCAL 64      /* users registered from this server */
+#define DIR_PENDING 1024  /* private messages waiting for an answer */
+#define DIR_LEASE 30      /* seconds an entry lives without a refresh */
+#define DIR_RETRY 250     /* ms before asking again */
+#define DIR_TRIES 4       /* attempts before giving up on a server */
+#define DIR_SEEN 64       /* message numbers remembered per server */
+
+/*
+ * Which server holds a nick is known by one server, its owner, chosen
+ * by rendezvous hashing of the nick over CHAT_NODES. Servers register
+ * their users with the owner and refresh them every DIR_LEASE / 3
+ * seconds. A private message for a user elsewhere asks the owner once
+ * (lookups for one nick in flight are merged) and then goes straight to
+ * the holding server. Answers are cached until the owner invalidates
+ * them, because the user left or moved, or the lease runs out. Messages
+ * for users online nowhere are kept in the owner's mailbox and handed
+ * on when the user next registers.
+ */
+
+enum { DIR_DELIVERED, DIR_STORED, DIR_FULL, DIR_FAILED };
+
+struct dirOps {
+    /* a message for one of our connections, -1 if it no longer has nick */
+    int (*deliver)(void *arg, const char *nick, int slot, unsigned gen,
+                   const char *msg, size_t len);
+    /* another server now holds nick, the connection must let go of it */
+    void (*drop)(void *arg, const char *nick, int slot, unsigned gen);
+    /* how a message sent with dirSend() ended */
+    void (*result)(void *arg, int slot, unsigned gen, const char *nick,
+                   int how);
+    void *arg;
+};
+
+int dirInit(const struct dirOps *ops);
+void dirPut(const char *nick, int slot, unsigned gen);
+void dirDel(const char *nick, int slot, unsigned gen);
+int dirSend(const char *nick, const char *msg, size_t len, int slot,
+            unsigned gen);
+int dirTimeout(void);
+void dirTick(void);
+void dirReport(char *buf, size_t len);
+
+#endif
@@ -0,0 +1,628 @@
+/* *
+ * Name: history.c                                                  *
+ *                                                                  *
+ * Description: room history, on-disk logs with a hot cache         *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "chat.h"
+#include "cursor.h"
+#include "history.h"
+#include "ws.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/*
+ * Every room message is appended to history/<xx>/<room>.log. The last
+ * HIST_LINES lines of recently used rooms are kept in memory; the whole
+ * cache is charged against one global byte budget and rooms are evicted
+ * with a CLOCK sweep, so a room nobody looks at goes cold and is served
+ * from its log the next time somebody joins it.
+ *
+ * Lines may carry an expiry time. Expired lines are dropped lazily when
+ * a room's cache is read, and the room's expiry timer rewrites the log
+ * without them once the earliest expiry has passed. The rewrite runs a
+ * slice per loop pass: the trailers are walked backwards to find what
+ * stays, then those stretches are copied forwards to a new file. Bytes
+ * in front of a trailer that does not parse are kept as they are.
+ */
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define HIST_TAIL (HIST_LINES * (MAXCHR + sizeof(struct histRec)))
+#define HIST_SLICE 65536 /* log bytes a compaction reads per pass */
+#define HIST_PINNED 60  /* seconds until uncommitted expired lines retry */
+
+struct histStats histStat;
+
+static char histDir[256] = HIST_DIR;
+static struct histCache *hand; /* CLOCK hand, NULL when nothing is hot */
+static time_t histStart;
+
+static unsigned histHash(const char *name) {
+    unsigned h = 2166136261u;
+
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h & 0xff;
+}
+
+int histInit(const char *dir, size_t budget) {
+    snprintf(histDir, sizeof(histDir), "%s", dir);
+    memset(&histStat, 0, sizeof(histStat));
+    histStat.budget = budget;
+    histStart = time(NULL);
+    if (mkdir(histDir, 0700) < 0 && errno != EEXIST) {
+        perror("S: histInit mkdir error");
+        return -1;
+    }
+    return 0;
+}
+
+static void histPath(char *path, size_t len, struct room *r,
+                     const char *suffix) {
+    snprintf(path, len, "%s/%02x/%s%s", histDir, histHash(roomName(r)),
+             roomName(r), suffix);
+}
+
+/* the log of a room by name, for readers that do not hold the room */
+void histLogPath(const char *room, char *path, size_t len) {
+    snprintf(path, len, "%s/%02x/%s.log", histDir, histHash(room), room);
+}
+
+static int histOpen(struct room *r) {
+    char path[512];
+
+    if (r->logfd >= 0) {
+        return r->logfd;
+    }
+    snprintf(path, sizeof(path), "%s/%02x", histDir, histHash(roomName(r)));
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        perror("S: histOpen mkdir error");
+        return -1;
+    }
+    histPath(path, sizeof(path), r, ".log");
+    if ((r->logfd = open(path, O_RDWR | O_APPEND | O_CREAT, 0600)) < 0) {
+        perror("S: histOpen open error");
+    }
+    return r->logfd;
+}
+
+static void expireAt(struct room *r, uint32_t expires) {
+    if (!r->expiry.armed || (time_t)expires < r->expiry.when) {
+        timerArm(&r->expiry, expires);
+    }
+}
+
+static void cachePush(struct histCache *c, const char *line, size_t len,
+                      uint32_t expires) {
+    int slot;
+    char *copy;
+
+    if ((copy = malloc(len)) == NULL) {
+        return;
+    }
+    memcpy(copy, line, len);
+    if (c->count == HIST_LINES) {
+        // Ring full - forget the oldest line
+        free(c->line[c->head]);
+        histStat.bytes -= c->len[c->head];
+        c->head = (c->head + 1) % HIST_LINES;
+        c->count--;
+    }
+    slot = (c->head + c->count) % HIST_LINES;
+    c->line[slot] = copy;
+    c->len[slot] = len;
+    c->expires[slot] = expires;
+    c->count++;
+    histStat.bytes += len;
+}
+
+/* lazy deletion: squeeze expired lines out of the ring */
+static void cacheExpire(struct histCache *c, uint32_t now) {
+    int k, slot, keep = 0;
+
+    for (k = 0; k < c->count; k++) {
+        slot = (c->head + k) % HIST_LINES;
+        if (c->expires[slot] != 0 && c->expires[slot] <= now) {
+            free(c->line[slot]);
+            histStat.bytes -= c->len[slot];
+            histStat.expired++;
+        } else {
+            int to = (c->head + keep++) % HIST_LINES;
+            c->line[to] = c->line[slot];
+            c->len[to] = c->len[slot];
+            c->expires[to] = c->expires[slot];
+        }
+    }
+    c->count = keep;
+}
+
+static void cacheEvict(struct histCache *c) {
+    int k;
+
+    for (k = 0; k < c->count; k++) {
+        int slot = (c->head + k) % HIST_LINES;
+        free(c->line[slot]);
+        histStat.bytes -= c->len[slot];
+    }
+    histStat.bytes -= sizeof(*c);
+    if (c->next == c) {
+        hand = NULL;
+    } else {
+        c->prev->next = c->next;
+        c->next->prev = c->prev;
+        if (hand == c) {
+            hand = c->next;
+        }
+    }
+    c->room->hist = NULL;
+    if (c->room->members == 0) {
+        histRelease(c->room);
+    }
+    histStat.hot--;
+    free(c);
+}
+
+/* CLOCK sweep until the cache fits its budget; keep is never evicted */
+static void cacheShrink(struct histCache *keep) {
+    struct histCache *c;
+
+    while (histStat.bytes > histStat.budget && hand != NULL) {
+        if (histStat.hot == 1 && hand == keep) {
+            break;
+        }
+        c = hand;
+        hand = c->next;
+        if (c->ref || c == keep) {
+            c->ref = 0;
+        } else {
+            cacheEvict(c);
+            histStat.evictions++;
+        }
+    }
+}
+
+static struct histCache *cacheLoad(struct room *r) {
+    struct histCache *c;
+    struct histRec rec;
+    struct stat st;
+    char *tail;
+    size_t pos, size;
+    const char *lines[HIST_LINES];
+    size_t lens[HIST_LINES];
+    uint32_t expires[HIST_LINES];
+    uint32_t now = (uint32_t)time(NULL);
+    int n = 0;
+
+    if ((c = calloc(1, sizeof(*c))) == NULL) {
+        perror("S: cacheLoad calloc error");
+        return NULL;
+    }
+    c->room = r;
+    c->ref = 1;
+    histStat.bytes += sizeof(*c);
+
+    // Walk the log backwards from its end through the record trailers
+    if (histOpen(r) >= 0 && fstat(r->logfd, &st) == 0 && st.st_size > 0) {
+        size = (size_t)st.st_size < HIST_TAIL ? (size_t)st.st_size : HIST_TAIL;
+        if ((tail = malloc(size)) != NULL) {
+            if (pread(r->logfd, tail, size, st.st_size - size) ==
+                (ssize_t)size) {
+                pos = size;
+                while (n < HIST_LINES && pos >= sizeof(rec)) {
+                    memcpy(&rec, tail + pos - sizeof(rec), sizeof(rec));
+                    if (rec.len > pos - sizeof(rec)) {
+                        break;
+                    }
+                    pos -= sizeof(rec) + rec.len;
+                    if (rec.expires != 0) {
+                        if (rec.expires <= now) {
+                            continue;
+                        }
+                        expireAt(r, rec.expires);
+                    }
+                    lines[n] = tail + pos;
+                    lens[n] = rec.len;
+                    expires[n] = rec.expires;
+                    n++;
+                }
+                while (n-- > 0) {
+                    cachePush(c, lines[n], lens[n], expires[n]);
+                }
+            }
+            free(tail);
+        }
+    }
+
+    // Link just behind the hand so it is the last one swept
+    if (hand == NULL) {
+        c->prev = c->next = c;
+        hand = c;
+    } else {
+        c->next = hand;
+        c->prev = hand->prev;
+        hand->prev->next = c;
+        hand->prev = c;
+    }
+    r->hist = c;
+    histStat.hot++;
+    return c;
+}
+
+int histAppend(struct room *r, uint64_t id, const char *line, size_t len,
+               int ttl) {
+    struct histRec rec;
+    struct iovec iov[2];
+
+    if (histOpen(r) < 0) {
+        return -1;
+    }
+    if (ttl <= 0) {
+        ttl = r->ttl;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.id = id;
+    rec.time = (uint32_t)time(NULL);
+    rec.expires = ttl > 0 ? rec.time + ttl : 0;
+    rec.len = (uint32_t)len;
+    iov[0].iov_base = (void *)line;
+    iov[0].iov_len = len;
+    iov[1].iov_base = &rec;
+    iov[1].iov_len = sizeof(rec);
+    if (writev(r->logfd, iov, 2) < 0) {
+        perror("S: histAppend writev error");
+        return -1;
+    }
+    if (rec.expires != 0) {
+        expireAt(r, rec.expires);
+    }
+    if (r->hist != NULL) {
+        cachePush(r->hist, line, len, rec.expires);
+        r->hist->ref = 1;
+        cacheShrink(r->hist);
+    }
+    return 0;
+}
+
+int histReplay(struct room *r, int sd) {
+    struct histCache *c = r->hist;
+    char out[HIST_LINES * MAXCHR];
+    size_t used = 0, off;
+    ssize_t n = 0;
+    int k;
+
+    if (c != NULL) {
+        histStat.hits++;
+        c->ref = 1;
+    } else {
+        histStat.misses++;
+        if ((c = cacheLoad(r)) == NULL) {
+            return -1;
+        }
+        cacheShrink(c);
+    }
+    cacheExpire(c, (uint32_t)time(NULL));
+
+    // One send for the whole backlog
+    for (k = 0; k < c->count; k++) {
+        int slot = (c->head + k) % HIST_LINES;
+        if (used + c->len[slot] <= sizeof(out)) {
+            memcpy(out + used, c->line[slot], c->len[slot]);
+            used += c->len[slot];
+        }
+    }
+    for (off = 0; off < used; off += n) {
+        n = wsSend(sd, out + off, used - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            perror("S: histReplay send error");
+            return -1;
+        }
+    }
+    return c->count;
+}
+
+void histRelease(struct room *r) {
+    // Cold and empty rooms keep no descriptor open
+    if (r->hist == NULL && r->logfd >= 0) {
+        close(r->logfd);
+        r->logfd = -1;
+    }
+}
+
+/* one stretch of the old log that goes to the new one as it is */
+struct histSpan {
+    off_t off;
+    size_t len;
+};
+
+/* the compaction in progress, one room at a time */
+static struct histJob {
+    struct room *room;      /* NULL when idle */
+    int in, out;            /* the old log, and its .tmp once copying */
+    off_t end;              /* old log size when the job started */
+    off_t pos;              /* scan: bytes not walked yet */
+    struct histSpan *keep;  /* newest first, the unparsed prefix last */
+    size_t n, cap, k, done; /* copy: keep[k] has done bytes out */
+    size_t kept;
+    uint64_t pin;           /* records after this id are not committed */
+    uint32_t now, next;
+} job = {NULL, -1, -1, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 0};
+
+static int jobKeep(off_t off, size_t len) {
+    struct histSpan *grown;
+
+    // Runs of live records merge into one span
+    if (job.n > 0 && job.keep[job.n - 1].off == off + (off_t)len) {
+        job.keep[job.n - 1].off = off;
+        job.keep[job.n - 1].len += len;
+    } else {
+        if (job.n == job.cap) {
+            job.cap = job.cap ? job.cap * 2 : 64;
+            if ((grown = realloc(job.keep, job.cap * sizeof(*grown))) ==
+                NULL) {
+                perror("S: histCompact realloc error");
+                return -1;
+            }
+            job.keep = grown;
+        }
+        job.keep[job.n].off = off;
+        job.keep[job.n++].len = len;
+    }
+    job.kept += len;
+    return 0;
+}
+
+static void jobEnd(void) {
+    char tmp[512];
+
+    if (job.out > -1) {
+        close(job.out);
+        histPath(tmp, sizeof(tmp), job.room, ".tmp");
+        unlink(tmp);
+    }
+    close(job.in);
+    free(job.keep);
+    memset(&job, 0, sizeof(job));
+    job.in = job.out = -1;
+}
+
+/* walk one slice of trailers backwards from pos */
+static int jobScan(void) {
+    char buf[HIST_SLICE];
+    struct histRec rec;
+    size_t size, at;
+
+    size = job.pos < (off_t)sizeof(buf) ? (size_t)job.pos : sizeof(buf);
+    if (pread(job.in, buf, size, job.pos - size) != (ssize_t)size) {
+        perror("S: histCompact read error");
+        return -1;
+    }
+    for (at = size; at >= sizeof(rec); at -= sizeof(rec) + rec.len) {
+        memcpy(&rec, buf + at - sizeof(rec), sizeof(rec));
+        if (rec.len > at - sizeof(rec)) {
+            break;
+        }
+        if (rec.expires != 0 && rec.expires <= job.now) {
+            if (rec.id <= job.pin) {
+                continue;
+            }
+            // A subscriber still has to read it: look again later
+            rec.expires = job.now + HIST_PINNED;
+        }
+        if (rec.expires != 0 && (job.next == 0 || rec.expires < job.next)) {
+            job.next = rec.expires;
+        }
+        if (jobKeep(job.pos - (off_t)size + (off_t)(at - sizeof(rec) -
+                                                        rec.len),
+                    sizeof(rec) + rec.len) < 0) {
+            return -1;
+        }
+    }
+    if (at == size) {
+        // Not even one record parses here: keep the rest as it is
+        if (job.pos > 0 && jobKeep(0, (size_t)job.pos) < 0) {
+            return -1;
+        }
+        job.pos = 0;
+    } else {
+        job.pos -= (off_t)(size - at);
+    }
+    return 0;
+}
+
+/* copy one slice of the kept spans, oldest first */
+static int jobCopy(void) {
+    char buf[HIST_SLICE], tmp[512];
+    struct histSpan *sp;
+    size_t size;
+
+    if (job.out < 0) {
+        histPath(tmp, sizeof(tmp), job.room, ".tmp");
+        if ((job.out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+            perror("S: histCompact open error");
+            return -1;
+        }
+        job.k = job.n;
+    }
+    if (job.k == 0) {
+        return 0;
+    }
+    sp = &job.keep[job.k - 1];
+    size = sp->len - job.done < sizeof(buf) ? sp->len - job.done
+                                            : sizeof(buf);
+    if (pread(job.in, buf, size, sp->off + job.done) != (ssize_t)size ||
+        write(job.out, buf, size) != (ssize_t)size) {
+        perror("S: histCompact copy error");
+        return -1;
+    }
+    if ((job.done += size) == sp->len) {
+        job.k--;
+        job.done = 0;
+    }
+    return 0;
+}
+
+/* lines appended since the start follow, then the new log replaces the old */
+static int jobFinish(void) {
+    char buf[HIST_SLICE], path[512], tmp[512];
+    struct room *r = job.room;
+    struct stat st;
+    off_t at;
+    ssize_t n;
+
+    if (fstat(job.in, &st) < 0) {
+        return -1;
+    }
+    for (at = job.end; at < st.st_size; at += n) {
+        if ((n = pread(job.in, buf, sizeof(buf), at)) <= 0 ||
+            write(job.out, buf, n) != n) {
+            perror("S: histCompact copy error");
+            return -1;
+        }
+    }
+    histPath(path, sizeof(path), r, ".log");
+    histPath(tmp, sizeof(tmp), r, ".tmp");
+    if (rename(tmp, path) < 0) {
+        perror("S: histCompact rename error");
+        return -1;
+    }
+    close(job.out);
+    job.out = -1;
+    // Appends go to the new file from now on
+    histStat.compacted += job.end - job.kept;
+    if (r->logfd >= 0) {
+        close(r->logfd);
+        r->logfd = -1;
+    }
+    return 0;
+}
+
+/* expiry timer: start rewriting the log without its expired records */
+void histCompact(void *arg) {
+    struct room *r = arg;
+    char path[512];
+    struct stat st;
+    uint32_t now = (uint32_t)time(NULL);
+
+    if (r->hist != NULL) {
+        cacheExpire(r->hist, now);
+    }
+    if (job.room != NULL) {
+        // Busy with another room (or this one): try again in a second
+        timerArm(&r->expiry, now + 1);
+        return;
+    }
+    histPath(path, sizeof(path), r, ".log");
+    if ((job.in = open(path, O_RDONLY)) < 0) {
+        return;
+    }
+    if (fstat(job.in, &st) < 0 || st.st_size == 0) {
+        close(job.in);
+        job.in = -1;
+        return;
+    }
+    job.room = r;
+    job.end = job.pos = st.st_size;
+    job.now = now;
+    job.pin = curPinned(roomName(r));
+}
+
+/* the main loop calls this every pass, 0 when a slice is waiting */
+int histTimeout(void) { return job.room != NULL ? 0 : -1; }
+
+/* one slice of the compaction in progress */
+void histTick(void) {
+    struct room *r = job.room;
+    uint32_t next;
+
+    if (r == NULL) {
+        return;
+    }
+    if (job.pos > 0) {
+        if (jobScan() < 0) {
+            jobEnd();
+        }
+        return;
+    }
+    if (job.kept == (size_t)job.end) {
+        // Nothing expired after all
+        next = job.next;
+        jobEnd();
+    } else if (job.out < 0 || job.k > 0) {
+        if (jobCopy() < 0) {
+            jobEnd();
+        }
+        return;
+    } else {
+        next = jobFinish() < 0 ? 0 : job.next;
+        jobEnd();
+    }
+    if (r->members == 0 && r->hist == NULL) {
+        histRelease(r);
+    }
+    if (next != 0) {
+        expireAt(r, next);
+    }
+}
+
+/* the room is going away: forget its cache and its log */
+void histDrop(struct room *r) {
+    char path[512];
+
+    if (r->hist != NULL) {
+        cacheEvict(r->hist);
+    }
+    if (job.room == r) {
+        jobEnd();
+    }
+    timerCancel(&r->expiry);
+    if (r->logfd >= 0) {
+        close(r->logfd);
+        r->logfd = -1;
+    }
+    histPath(path, sizeof(path), r, ".log");
+    unlink(path);
+}
+
+void histReport(char *buf, size_t len) {
+    unsigned long lookups = histStat.hits + histStat.misses;
+    long up = (long)(time(NULL) - histStart);
+
+    snprintf(buf, len,
+             "S: history hits %lu misses %lu hit-rate %.1f%% evictions %lu "
+             "(%.2f/s) bytes %zu/%zu hot rooms %d expired %lu "
+             "compacted %lu\n",
+             histStat.hits, histStat.misses,
+             lookups ? 100.0 * histStat.hits / lookups : 0.0,
+             histStat.evictions,
+             up > 0 ? (double)histStat.evictions / up : 0.0, histStat.bytes,
+             histStat.budget, histStat.hot, histStat.expired,
+             histStat.compacted);
+}
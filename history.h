@@ -0,0 +1,80 @@
+/* *
+ * Name: history.h                                                  *
+ *                                                                  *
+ * Description: room history include file                           *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __HISTORY_H
+#define __HISTORY_H
+
+#include "room.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define HIST_DIR "history"
+#define HIST_LINES 20           /* lines replayed when joining a room */
+#define HIST_BUDGET (4u << 20)  /* default global cache budget in bytes */
+
+/* on-disk record: the line followed by this trailer, so the log can be
+ * walked backwards from its end */
+struct histRec {
+    uint64_t id;      /* message id, see idgen.h */
+    uint32_t time;
+    uint32_t expires; /* 0 when the line never expires */
+    uint32_t len;
+    uint32_t pad;
+};
+
+/* hot history of one room, a ring of its last HIST_LINES lines */
+struct histCache {
+    struct room *room;
+    struct histCache *prev; /* CLOCK ring */
+    struct histCache *next;
+    int ref;                /* CLOCK reference bit */
+    int head;               /* oldest line */
+    int count;
+    char *line[HIST_LINES];
+    size_t len[HIST_LINES];
+    uint32_t expires[HIST_LINES];
+};
+
+struct histStats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long expired;   /* lines dropped lazily from the cache */
+    unsigned long compacted; /* bytes reclaimed from the logs */
+    size_t bytes;
+    size_t budget;
+    int hot;
+};
+
+extern struct histStats histStat;
+
+int histInit(const char *dir, size_t budget);
+int histAppend(struct room *r, uint64_t id, const char *line, size_t len,
+               int ttl);
+int histReplay(struct room *r, int sd);
+void histRelease(struct room *r);
+void histCompact(void *arg);
+int histTimeout(void);
+void histTick(void);
+void histDrop(struct room *r);
+void histLogPath(const char *room, char *path, size_t len);
+void histReport(char *buf, size_t len);
+
+#endif
@@ -0,0 +1,201 @@
+/* *
+ * Name: idgen.c                                                    *
+ *                                                                  *
+ * Description: snowflake style message id generator                *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "idgen.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * All state is thread local; the only shared write is the thread slot
+ * handed out once per thread. The millisecond used in an id never goes
+ * backwards: when the wall clock steps back, or a thread uses up its
+ * sequence within one millisecond, ids keep counting from the last
+ * millisecond issued until the wall clock catches up. Ids therefore
+ * stay unique and increasing per thread, and only lead wall time while
+ * a thread sustains more than 4096 ids per millisecond.
+ *
+ * Across restarts the same holds through ID_FILE. Its first word is a
+ * lease: a millisecond ID_LEASE ahead of the last one issued, rewritten
+ * each time ids reach it. Its second word is the last millisecond
+ * actually issued, written by idStop() on a clean shutdown and zeroed
+ * while a process runs. A new process counts on from that word when it
+ * is set, so a quick restart does not jump ahead of the clock, and from
+ * the lease only after a crash. A clock that was stepped back while the
+ * server was down therefore cannot hand out ids the previous run already
+ * used.
+ */
+
+#define ID_SEQ_MASK ((1u << ID_SEQ_BITS) - 1)
+#define ID_TIME_SHIFT (ID_NODE_BITS + ID_THREAD_BITS + ID_SEQ_BITS)
+
+#ifdef CLOCK_REALTIME_COARSE
+#define ID_CLOCK CLOCK_REALTIME_COARSE
+#else
+#define ID_CLOCK CLOCK_REALTIME
+#endif
+
+struct idState {
+    uint64_t last;   /* millisecond of the last id issued */
+    uint64_t wall;   /* wall clock millisecond last observed */
+    uint64_t prefix; /* node and thread bits */
+    uint32_t seq;
+    int thread;      /* -1 until the thread has a slot */
+    unsigned long regressions;
+};
+
+static int idNode = 0;
+static int idThreads = 0;
+static int idFd = -1;
+static uint64_t idFloor;    /* the previous run's reservation */
+static uint64_t idReserved; /* ids up to this ms are covered by ID_FILE */
+static uint64_t idLastOf[ID_MAX_THREAD + 1]; /* each thread's last ms */
+static __thread struct idState idState = {0, 0, 0, 0, -1, 0};
+
+static uint64_t wallMs(void) {
+    struct timespec ts;
+
+    clock_gettime(ID_CLOCK, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* move the mark past ms before any id beyond it goes out */
+static void reserve(uint64_t ms) {
+    uint64_t old = __atomic_load_n(&idReserved, __ATOMIC_RELAXED);
+
+    while (ms > old && !__atomic_compare_exchange_n(&idReserved, &old, ms, 0,
+                                                    __ATOMIC_RELAXED,
+                                                    __ATOMIC_RELAXED)) {
+    }
+    if (ms > old && idFd >= 0 &&
+        pwrite(idFd, &ms, sizeof(ms), 0) != sizeof(ms)) {
+        perror("S: idgen reserve error");
+    }
+}
+
+int idInit(int node, const char *path) {
+    uint64_t now = wallMs(), mark[2];
+
+    if (node < 0 || node > ID_MAX_NODE) {
+        fprintf(stderr, "S: idInit node %d out of range 0-%d\n", node,
+                ID_MAX_NODE);
+        return -1;
+    }
+    idNode = node;
+    if (path == NULL) {
+        return 0;
+    }
+    if ((idFd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+        perror("S: idInit open error");
+        return -1;
+    }
+    if (pread(idFd, mark, sizeof(mark), 0) != sizeof(mark)) {
+        mark[1] = 0; // a file from before the second word: treat as a crash
+        if (pread(idFd, mark, sizeof(mark[0]), 0) != sizeof(mark[0])) {
+            mark[0] = 0;
+        }
+    }
+    // Stopped cleanly: the last id issued; otherwise all the lease covered
+    idFloor = mark[1] ? mark[1] : mark[0];
+    mark[1] = 0;
+    if (pwrite(idFd, &mark[1], sizeof(mark[1]), sizeof(mark[0])) !=
+        sizeof(mark[1])) {
+        perror("S: idInit write error");
+        return -1;
+    }
+    if (idFloor > now) {
+        printf("S: clock %llu ms behind the last ids, counting on from there\n",
+               (unsigned long long)(idFloor - now));
+    }
+    reserve((idFloor > now ? idFloor : now) + ID_LEASE);
+    return 0;
+}
+
+int idThreadInit(void) {
+    int slot;
+
+    if (idState.thread >= 0) {
+        return idState.thread;
+    }
+    slot = __atomic_fetch_add(&idThreads, 1, __ATOMIC_RELAXED);
+    if (slot > ID_MAX_THREAD) {
+        fprintf(stderr, "S: idThreadInit more than %d threads\n",
+                ID_MAX_THREAD + 1);
+        return -1;
+    }
+    idState.thread = slot;
+    idState.prefix = ((uint64_t)idNode << (ID_THREAD_BITS + ID_SEQ_BITS)) |
+                     ((uint64_t)slot << ID_SEQ_BITS);
+    // The previous run may have used every id up to idFloor
+    idState.last = idFloor;
+    idState.seq = ID_SEQ_MASK;
+    return slot;
+}
+
+uint64_t idNext(void) {
+    struct idState *s = &idState;
+    uint64_t now;
+
+    if (s->thread < 0 && idThreadInit() < 0) {
+        return 0;
+    }
+    now = wallMs();
+    if (now < s->wall) {
+        s->regressions++;
+    }
+    s->wall = now;
+    if (now > s->last) {
+        s->last = now;
+        s->seq = 0;
+        __atomic_store_n(&idLastOf[s->thread], s->last, __ATOMIC_RELAXED);
+    } else if (++s->seq > ID_SEQ_MASK) {
+        // Sequence exhausted (or clock behind): borrow the next millisecond
+        s->last++;
+        s->seq = 0;
+        __atomic_store_n(&idLastOf[s->thread], s->last, __ATOMIC_RELAXED);
+    }
+    if (s->last >= __atomic_load_n(&idReserved, __ATOMIC_RELAXED)) {
+        reserve(s->last + ID_LEASE);
+    }
+    return ((s->last - ID_EPOCH) << ID_TIME_SHIFT) | s->prefix | s->seq;
+}
+
+/* record the last millisecond issued; safe to call from a signal handler */
+void idStop(void) {
+    uint64_t last = idFloor, ms;
+    int k;
+
+    if (idFd < 0) {
+        return;
+    }
+    for (k = 0; k <= ID_MAX_THREAD; k++) {
+        ms = __atomic_load_n(&idLastOf[k], __ATOMIC_RELAXED);
+        last = ms > last ? ms : last;
+    }
+    if (last == 0) {
+        last = 1; // nothing issued ever, but zero would read as a crash
+    }
+    if (pwrite(idFd, &last, sizeof(last), sizeof(last)) != sizeof(last)) {
+        perror("S: idStop write error");
+    }
+}
+
+unsigned long idRegressions(void) { return idState.regressions; }
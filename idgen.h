@@ -0,0 +1,51 @@
+/* *
+ * Name: idgen.h                                                    *
+ *                                                                  *
+ * Description: message id generator include file                   *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __IDGEN_H
+#define __IDGEN_H
+
+#include <stdint.h>
+
+/*
+ * 63 bit ids, most significant first:
+ *   41 bits  milliseconds since ID_EPOCH (about 69 years)
+ *    7 bits  node
+ *    3 bits  thread within the node
+ *   12 bits  sequence within the millisecond
+ */
+#define ID_EPOCH 1577836800000ULL /* 2020-01-01T00:00:00Z in ms */
+#define ID_NODE_BITS 7
+#define ID_THREAD_BITS 3
+#define ID_SEQ_BITS 12
+#define ID_MAX_NODE ((1 << ID_NODE_BITS) - 1)
+#define ID_MAX_THREAD ((1 << ID_THREAD_BITS) - 1)
+#define ID_FILE "ids.hwm" /* lease, then last millisecond on a clean stop */
+#define ID_LEASE 10000    /* ms reserved in ID_FILE ahead of use */
+
+#define ID_TIME(id) (((id) >> (ID_NODE_BITS + ID_THREAD_BITS + ID_SEQ_BITS)) + ID_EPOCH)
+#define ID_NODE(id) (((id) >> (ID_THREAD_BITS + ID_SEQ_BITS)) & ID_MAX_NODE)
+
+int idInit(int node, const char *path);
+int idThreadInit(void);
+uint64_t idNext(void);
+void idStop(void);
+unsigned long idRegressions(void);
+
+#endif
@@ -0,0 +1,213 @@
+/* *
+ * Name: intern.c                                                   *
+ *                                                                  *
+ * Description: string interning with arena storage                 *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "intern.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Each distinct string is stored once, in fixed size arena chunks that
+ * never move, so internStr() pointers stay valid while the handle is
+ * referenced. When the last reference goes the handle and its arena
+ * span are parked together on a free list for that length and reused
+ * by the next string of the same length.
+ */
+
+struct internEntry {
+    char *str;
+    uint32_t hash;
+    uint32_t refs;
+    uint32_t next; /* hash chain, or free list when refs is 0 */
+    uint16_t len;
+};
+
+static struct internEntry *entry; /* indexed by handle, entry[0] unused */
+static uint32_t nEntry = 1, capEntry;
+static uint32_t *bucket;           /* hash heads, power of two */
+static uint32_t nBucket;
+static uint32_t freeByLen[INTERN_MAXLEN + 1];
+static char *chunk;                /* current arena chunk */
+static size_t chunkUsed = INTERN_CHUNK;
+
+/* statistics */
+static unsigned long nLive, nRefs, nChunks;
+static size_t liveBytes, refBytes;
+
+static uint32_t internHash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+
+    while (len-- > 0) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+static int internGrow(void) {
+    uint32_t *nb;
+    uint32_t k, h, n = nBucket ? nBucket * 2 : 256;
+
+    if ((nb = calloc(n, sizeof(*nb))) == NULL) {
+        return -1;
+    }
+    // Rehash the live entries into the larger table
+    for (h = 1; h < nEntry; h++) {
+        if (entry[h].refs > 0) {
+            k = entry[h].hash & (n - 1);
+            entry[h].next = nb[k];
+            nb[k] = h;
+        }
+    }
+    free(bucket);
+    bucket = nb;
+    nBucket = n;
+    return 0;
+}
+
+static uint32_t internLookup(const char *s, size_t len, uint32_t hash) {
+    uint32_t h;
+
+    if (nBucket == 0) {
+        return 0;
+    }
+    for (h = bucket[hash & (nBucket - 1)]; h != 0; h = entry[h].next) {
+        if (entry[h].hash == hash && entry[h].len == len &&
+            memcmp(entry[h].str, s, len) == 0) {
+            return h;
+        }
+    }
+    return 0;
+}
+
+intern_t internFind(const char *s) {
+    size_t len = strlen(s);
+
+    return len > INTERN_MAXLEN ? 0 : internLookup(s, len, internHash(s, len));
+}
+
+intern_t internGet(const char *s) {
+    size_t len = strlen(s);
+    uint32_t hash, h;
+
+    if (len == 0 || len > INTERN_MAXLEN) {
+        return 0;
+    }
+    hash = internHash(s, len);
+    if ((h = internLookup(s, len, hash)) == 0) {
+        if (nLive >= nBucket && internGrow() < 0) {
+            return 0;
+        }
+        if ((h = freeByLen[len]) != 0) {
+            // Reuse a released handle together with its arena span
+            freeByLen[len] = entry[h].next;
+        } else {
+            if (nEntry >= capEntry) {
+                struct internEntry *ne;
+                uint32_t n = capEntry ? capEntry * 2 : 256;
+                if ((ne = realloc(entry, n * sizeof(*ne))) == NULL) {
+                    return 0;
+                }
+                entry = ne;
+                capEntry = n;
+            }
+            if (chunkUsed + len + 1 > INTERN_CHUNK) {
+                if ((chunk = malloc(INTERN_CHUNK)) == NULL) {
+                    return 0;
+                }
+                chunkUsed = 0;
+                nChunks++;
+            }
+            h = nEntry++;
+            entry[h].str = chunk + chunkUsed;
+            entry[h].len = (uint16_t)len;
+            chunkUsed += len + 1;
+        }
+        memcpy(entry[h].str, s, len + 1);
+        entry[h].hash = hash;
+        entry[h].refs = 0;
+        entry[h].next = bucket[hash & (nBucket - 1)];
+        bucket[hash & (nBucket - 1)] = h;
+        nLive++;
+        liveBytes += len + 1;
+    }
+    entry[h].refs++;
+    nRefs++;
+    refBytes += len + 1;
+    return h;
+}
+
+void internPut(intern_t h) {
+    struct internEntry *e;
+    uint32_t *p;
+
+    if (h == 0 || h >= nEntry || entry[h].refs == 0) {
+        return;
+    }
+    e = &entry[h];
+    nRefs--;
+    refBytes -= e->len + 1;
+    if (--e->refs > 0) {
+        return;
+    }
+    for (p = &bucket[e->hash & (nBucket - 1)]; *p != 0; p = &entry[*p].next) {
+        if (*p == h) {
+            *p = e->next;
+            break;
+        }
+    }
+    e->next = freeByLen[e->len];
+    freeByLen[e->len] = h;
+    nLive--;
+    liveBytes -= e->len + 1;
+}
+
+/* sizes the table and handle array for n strings up front */
+int internReserve(uint32_t n) {
+    struct internEntry *ne;
+
+    while (nBucket < n) {
+        if (internGrow() < 0) {
+            return -1;
+        }
+    }
+    if (capEntry < n) {
+        if ((ne = realloc(entry, n * sizeof(*ne))) == NULL) {
+            return -1;
+        }
+        entry = ne;
+        capEntry = n;
+    }
+    return 0;
+}
+
+const char *internStr(intern_t h) {
+    return (h != 0 && h < nEntry) ? entry[h].str : "";
+}
+
+void internReport(char *buf, size_t len) {
+    size_t with = liveBytes + nLive * sizeof(struct internEntry) +
+                  nRefs * sizeof(intern_t);
+
+    snprintf(buf, len,
+             "S: intern strings %lu refs %lu bytes %zu interned vs %zu "
+             "copied (saved %ld) arena %lu KiB\n",
+             nLive, nRefs, with, refBytes, (long)refBytes - (long)with,
+             nChunks * INTERN_CHUNK / 1024);
+}
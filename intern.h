@@ -0,0 +1,40 @@
+/* *
+ * Name: intern.h                                                   *
+ *                                                                  *
+ * Description: string interning include file                       *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __INTERN_H
+#define __INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define INTERN_MAXLEN 63     /* longest string that can be interned */
+#define INTERN_CHUNK 65536   /* arena chunk size in bytes */
+
+/* handles are small integers, 0 is never a valid handle */
+typedef uint32_t intern_t;
+
+intern_t internGet(const char *s);
+intern_t internFind(const char *s);
+void internPut(intern_t h);
+int internReserve(uint32_t n);
+const char *internStr(intern_t h);
+void internReport(char *buf, size_t len);
+
+#endif
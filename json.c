@@ -0,0 +1,267 @@
+/* *
+ * Name: json.c                                                     *
+ *                                                                  *
+ * Description: JSON protocol mode, parser and serializer           *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "json.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+
+/*
+ * JSON clients speak one object per line. The schema is fixed, so the
+ * parser makes a single pass over the line, decodes strings in place
+ * (an escape never decodes to more bytes than it takes) and turns the
+ * object into the same command line a native client would have sent;
+ * from there the message follows the normal path and fan-out. On the
+ * way out every line becomes {"type":"line","text":"..."}, encoded by
+ * a streaming serializer that never needs the whole output at once.
+ */
+
+#define PREFIX "{\"type\":\"line\",\"text\":\""
+#define SUFFIX "\"}\n"
+
+static unsigned char mode[FD_SETSIZE];
+
+void jsonSet(int sd, int on) {
+    if (sd >= 0 && sd < FD_SETSIZE) {
+        mode[sd] = (unsigned char)on;
+    }
+}
+
+int jsonIs(int sd) { return sd >= 0 && sd < FD_SETSIZE && mode[sd]; }
+
+static char *space(char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+    return p;
+}
+
+static int hex4(const char *p) {
+    int v = 0, k;
+
+    for (k = 0; k < 4; k++) {
+        v <<= 4;
+        if (p[k] >= '0' && p[k] <= '9') {
+            v |= p[k] - '0';
+        } else if ((p[k] | 0x20) >= 'a' && (p[k] | 0x20) <= 'f') {
+            v |= (p[k] | 0x20) - 'a' + 10;
+        } else {
+            return -1;
+        }
+    }
+    return v;
+}
+
+/* decode the string at p (after the quote) in place, NULL if malformed */
+static char *string(char *p, char **str) {
+    char *dst = p;
+    int c, lo;
+
+    *str = p;
+    while (*p != '"') {
+        if (*p == '\0') {
+            return NULL;
+        } else if (*p != '\\') {
+            *dst++ = *p++;
+            continue;
+        }
+        switch (p[1]) {
+        case '"': case '\\': case '/':
+            c = p[1];
+            p += 2;
+            break;
+        case 'b': case 'f': case 'n': case 'r': case 't':
+            c = p[1] == 't' ? '\t' : ' '; // no line breaks inside a message
+            p += 2;
+            break;
+        case 'u':
+            if ((c = hex4(p + 2)) < 0) {
+                return NULL;
+            }
+            p += 6;
+            if (c >= 0xd800 && c <= 0xdbff) {
+                if (p[0] != '\\' || p[1] != 'u' || (lo = hex4(p + 2)) < 0xdc00 ||
+                    lo > 0xdfff) {
+                    return NULL;
+                }
+                c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                p += 6;
+            } else if (c >= 0xdc00 && c <= 0xdfff) {
+                return NULL;
+            }
+            break;
+        default:
+            return NULL;
+        }
+        if (c < 0x20 && c != '\t') {
+            c = ' ';
+        }
+        if (c < 0x80) {
+            *dst++ = (char)c;
+        } else if (c < 0x800) {
+            *dst++ = (char)(0xc0 | c >> 6);
+            *dst++ = (char)(0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            *dst++ = (char)(0xe0 | c >> 12);
+            *dst++ = (char)(0x80 | ((c >> 6) & 0x3f));
+            *dst++ = (char)(0x80 | (c & 0x3f));
+        } else {
+            *dst++ = (char)(0xf0 | c >> 18);
+            *dst++ = (char)(0x80 | ((c >> 12) & 0x3f));
+            *dst++ = (char)(0x80 | ((c >> 6) & 0x3f));
+            *dst++ = (char)(0x80 | (c & 0x3f));
+        }
+    }
+    *dst = '\0';
+    return p + 1;
+}
+
+int jsonToLine(char *in, char *line, size_t cap, const char **err) {
+    char *p = space(in), *key, *str;
+    char *type = "msg", *text = NULL, *to = NULL, *room = NULL, *name = NULL;
+    long ttl = 0, num;
+    int n;
+
+    *err = "S: expected a JSON object\n";
+    if (*p++ != '{') {
+        return -1;
+    }
+    *err = "S: malformed JSON, or a value outside the schema\n";
+    for (p = space(p); *p != '}'; p = space(p)) {
+        if (*p != '"' || (p = string(p + 1, &key)) == NULL ||
+            *(p = space(p)) != ':') {
+            return -1;
+        }
+        p = space(p + 1);
+        if (*p == '"') {
+            if ((p = string(p + 1, &str)) == NULL) {
+                return -1;
+            }
+            if (strcmp(key, "type") == 0) {
+                type = str;
+            } else if (strcmp(key, "text") == 0) {
+                text = str;
+            } else if (strcmp(key, "to") == 0) {
+                to = str;
+            } else if (strcmp(key, "room") == 0) {
+                room = str;
+            } else if (strcmp(key, "name") == 0) {
+                name = str;
+            }
+        } else if (*p == '-' || (*p >= '0' && *p <= '9')) {
+            num = strtol(p, &str, 10);
+            if (str == p) {
+                return -1;
+            }
+            if (strcmp(key, "ttl") == 0) {
+                ttl = num;
+            }
+            p = str;
+        } else if (strncmp(p, "true", 4) == 0 || strncmp(p, "null", 4) == 0) {
+            p += 4;
+        } else if (strncmp(p, "false", 5) == 0) {
+            p += 5;
+        } else {
+            return -1; // nested values are not part of the schema
+        }
+        p = space(p);
+        if (*p == ',') {
+            p++;
+        } else if (*p != '}') {
+            return -1;
+        }
+    }
+
+    *err = "S: missing or unknown JSON field\n";
+    if (strcmp(type, "msg") == 0 && text != NULL) {
+        n = ttl > 0 ? snprintf(line, cap, "/ttl %ld %s\n", ttl, text)
+                    : snprintf(line, cap, "%s\n", text);
+    } else if (strcmp(type, "cmd") == 0 && text != NULL && text[0] == '/') {
+        n = snprintf(line, cap, "%s\n", text);
+    } else if (strcmp(type, "privmsg") == 0 && to != NULL && text != NULL) {
+        n = snprintf(line, cap, "/msg %s %s\n", to, text);
+    } else if (strcmp(type, "join") == 0 && room != NULL) {
+        n = ttl > 0 ? snprintf(line, cap, "/join %s %ld\n", room, ttl)
+                    : snprintf(line, cap, "/join %s\n", room);
+    } else if (strcmp(type, "nick") == 0 && name != NULL) {
+        n = snprintf(line, cap, "/nick %s\n", name);
+    } else {
+        return -1;
+    }
+    if ((size_t)n >= cap) {
+        line[cap - 2] = '\n'; // cut like an overlong native line
+        n = cap - 1;
+    }
+    return n;
+}
+
+size_t jsonEncode(char *out, size_t cap, const char **msg, size_t *len,
+                  int *open) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *s = (const unsigned char *)*msg;
+    size_t used = 0, k = 0;
+
+    while (k < *len && cap - used >= JSON_ESCMAX) {
+        if (!*open) {
+            memcpy(out + used, PREFIX, sizeof(PREFIX) - 1);
+            used += sizeof(PREFIX) - 1;
+            *open = 1;
+        }
+        if (s[k] == '\n') {
+            memcpy(out + used, SUFFIX, sizeof(SUFFIX) - 1);
+            used += sizeof(SUFFIX) - 1;
+            *open = 0;
+        } else if (s[k] == '"' || s[k] == '\\') {
+            out[used++] = '\\';
+            out[used++] = (char)s[k];
+        } else if (s[k] == '\t') {
+            out[used++] = '\\';
+            out[used++] = 't';
+        } else if (s[k] < 0x20) {
+            memcpy(out + used, "\\u00", 4);
+            out[used + 4] = hex[s[k] >> 4];
+            out[used + 5] = hex[s[k] & 15];
+            used += 6;
+        } else {
+            out[used++] = (char)s[k];
+        }
+        k++;
+    }
+    *msg += k;
+    *len -= k;
+    return used;
+}
+
+size_t jsonLines(char *out, size_t cap, const char *msg, size_t len) {
+    size_t used;
+    int open = 0;
+
+    used = jsonEncode(out, cap, &msg, &len, &open);
+    if (len > 0 || cap - used < JSON_ESCMAX) {
+        return 0; // does not fit
+    }
+    if (open) {
+        memcpy(out + used, SUFFIX, sizeof(SUFFIX) - 1);
+        used += sizeof(SUFFIX) - 1;
+    }
+    return used;
+}
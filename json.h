@@ -0,0 +1,37 @@
+/* *
+ * Name: json.h                                                     *
+ *                                                                  *
+ * Description: JSON protocol mode include file                     *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __JSON_H
+#define __JSON_H
+
+#include <stddef.h>
+
+#define CMD_JSON "/json"
+#define JSON_ESCMAX 32 /* room to keep free for one encoded byte */
+#define JSON_WIRE 2048  /* encoded fan-out message */
+
+void jsonSet(int sd, int on);
+int jsonIs(int sd);
+int jsonToLine(char *in, char *line, size_t cap, const char **err);
+size_t jsonEncode(char *out, size_t cap, const char **msg, size_t *len,
+                  int *open);
+size_t jsonLines(char *out, size_t cap, const char *msg, size_t len);
+
+#endif
@@ -0,0 +1,172 @@
+/* *
+ * Name: kfan.c                                                     *
+ *                                                                  *
+ * Description: fan-out through pipes with tee() and splice()       *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#define _GNU_SOURCE
+#include "kfan.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+/*
+ * A fan-out payload is written once into a source pipe. For each
+ * recipient tee() duplicates the source pipe's page references into
+ * that connection's own pipe and splice() moves them on into the
+ * socket, so the bytes are never copied again in user space. The
+ * source is emptied into /dev/null afterwards; a connection pipe is
+ * always empty between messages, which keeps ordinary sends on the
+ * same socket in order.
+ */
+
+static int src[2] = {-1, -1};
+static int devNull = -1;
+static int out[FD_SETSIZE][2]; /* per connection pipe, 0 when unused */
+static size_t minLen;
+
+/* statistics */
+static unsigned long nLoad, nSend, nTee, nSplice, nFallback;
+static unsigned long long nBytes;
+
+static int pipeOpen(int *p) {
+    if (pipe2(p, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return -1;
+    }
+    // Room for one whole payload, so a single tee() takes it
+    if (fcntl(p[0], F_SETPIPE_SZ, KFAN_PIPE) < 0) {
+        close(p[0]);
+        close(p[1]);
+        return -1;
+    }
+    return 0;
+}
+
+int kfanInit(size_t min) {
+    if (min == 0) {
+        return 0;
+    }
+    if (pipeOpen(src) < 0 ||
+        (devNull = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0) {
+        perror("S: kfanInit error");
+        return -1;
+    }
+    minLen = min;
+    return 0;
+}
+
+size_t kfanMin(void) { return minLen; }
+
+int kfanEnable(int sd) {
+    if (minLen == 0 || sd < 0 || sd >= FD_SETSIZE) {
+        return -1;
+    }
+    if (pipeOpen(out[sd]) < 0) {
+        perror("S: kfanEnable pipe error");
+        out[sd][0] = out[sd][1] = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int kfanIs(int sd) { return sd >= 0 && sd < FD_SETSIZE && out[sd][1] > 0; }
+
+int kfanLoad(const void *data, size_t len) {
+    if (minLen == 0 || len > KFAN_PIPE ||
+        write(src[1], data, len) != (ssize_t)len) {
+        nFallback++;
+        return -1;
+    }
+    nLoad++;
+    return 0;
+}
+
+/* drains a connection pipe, so a failed send leaves nothing behind */
+static void flush(int fd) {
+    while (splice(fd, NULL, devNull, NULL, KFAN_PIPE, SPLICE_F_NONBLOCK) > 0) {
+    }
+}
+
+ssize_t kfanSend(int sd, size_t len) {
+    size_t left = len;
+    ssize_t n;
+
+    if (!kfanIs(sd)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    // tee() leaves the source intact for the next recipient
+    if ((n = tee(src[0], out[sd][1], len, SPLICE_F_NONBLOCK)) !=
+        (ssize_t)len) {
+        flush(out[sd][0]);
+        nFallback++;
+        errno = ENOBUFS;
+        return -1;
+    }
+    nTee++;
+    while (left > 0) {
+        n = splice(out[sd][0], NULL, sd, NULL, left, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // The caller sends the rest itself, from what did go out
+            flush(out[sd][0]);
+            nFallback++;
+            if (left == len) {
+                errno = ENOBUFS;
+                return -1;
+            }
+            return (ssize_t)(len - left);
+        }
+        nSplice++;
+        left -= (size_t)n;
+    }
+    nSend++;
+    nBytes += len;
+    return (ssize_t)len;
+}
+
+void kfanUnload(size_t len) {
+    if (splice(src[0], NULL, devNull, NULL, len, SPLICE_F_NONBLOCK) !=
+        (ssize_t)len) {
+        perror("S: kfanUnload splice error");
+        flush(src[0]);
+    }
+}
+
+void kfanClose(int sd) {
+    if (kfanIs(sd)) {
+        close(out[sd][0]);
+        close(out[sd][1]);
+        out[sd][0] = out[sd][1] = 0;
+    }
+}
+
+void kfanReport(char *buf, size_t len) {
+    if (minLen == 0) {
+        snprintf(buf, len, "S: pipe fan-out off\n");
+        return;
+    }
+    snprintf(buf, len,
+             "S: pipe fan-out from %zu bytes messages %lu sends %lu (%llu "
+             "bytes) tee %lu splice %lu fallbacks %lu\n",
+             minLen, nLoad, nSend, nBytes, nTee, nSplice, nFallback);
+}
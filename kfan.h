@@ -0,0 +1,39 @@
+/* *
+ * Name: kfan.h                                                     *
+ *                                                                  *
+ * Description: pipe fan-out include file                           *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __KFAN_H
+#define __KFAN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define KFAN_PIPE 65536  /* pipe capacity, the largest payload it takes */
+
+int kfanInit(size_t min);
+size_t kfanMin(void);
+int kfanEnable(int sd);
+int kfanIs(int sd);
+int kfanLoad(const void *data, size_t len);
+ssize_t kfanSend(int sd, size_t len);
+void kfanUnload(size_t len);
+void kfanClose(int sd);
+void kfanReport(char *buf, size_t len);
+
+#endif
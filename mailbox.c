@@ -0,0 +1,219 @@
+/* *
+ * Name: mailbox.c                                                  *
+ *                                                                  *
+ * Description: offline mailbox, one mmap'd queue file per user     *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "mailbox.h"
+#include "ws.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/*
+ * Nothing is kept in memory for offline users: each mailbox is a
+ * fixed size sparse file that is mapped only for the duration of an
+ * append or a drain. Files are spread over 256 subdirectories so a
+ * large user base does not end up in a single directory.
+ */
+
+#define MBOX_SIZE (sizeof(struct mboxHeader) + MBOX_CAP)
+
+static char mboxDir[256] = MBOX_DIR;
+
+static unsigned mboxHash(const char *nick) {
+    unsigned h = 2166136261u;
+
+    while (*nick) {
+        h = (h ^ (unsigned char)*nick++) * 16777619u;
+    }
+    return h & 0xff;
+}
+
+static void mboxPath(char *path, size_t len, const char *nick, int withFile) {
+    if (withFile) {
+        snprintf(path, len, "%s/%02x/%s", mboxDir, mboxHash(nick), nick);
+    } else {
+        snprintf(path, len, "%s/%02x", mboxDir, mboxHash(nick));
+    }
+}
+
+int mboxInit(const char *dir) {
+    snprintf(mboxDir, sizeof(mboxDir), "%s", dir);
+    if (mkdir(mboxDir, 0700) < 0 && errno != EEXIST) {
+        perror("S: mboxInit mkdir error");
+        return -1;
+    }
+    return 0;
+}
+
+int mboxAppend(const char *nick, const char *msg, size_t len) {
+    char path[512];
+    struct stat st;
+    struct mboxHeader *h;
+    char *p;
+    int fd;
+    int out = 0;
+
+    mboxPath(path, sizeof(path), nick, 0);
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        perror("S: mboxAppend mkdir error");
+        return -1;
+    }
+    mboxPath(path, sizeof(path), nick, 1);
+    if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+        perror("S: mboxAppend open error");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 ||
+        ((size_t)st.st_size < MBOX_SIZE && ftruncate(fd, MBOX_SIZE) < 0)) {
+        perror("S: mboxAppend size error");
+        close(fd);
+        return -1;
+    }
+    p = mmap(NULL, MBOX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("S: mboxAppend mmap error");
+        return -1;
+    }
+    h = (struct mboxHeader *)p;
+    if (h->magic != MBOX_MAGIC) {
+        memset(h, 0, sizeof(*h));
+        h->magic = MBOX_MAGIC;
+    }
+    if (h->used + len > MBOX_CAP) {
+        // Bounded per user: refuse rather than grow
+        h->dropped++;
+        out = -1;
+    } else {
+        memcpy(p + sizeof(*h) + h->used, msg, len);
+        h->used += len;
+        h->count++;
+    }
+    munmap(p, MBOX_SIZE);
+    return out;
+}
+
+int mboxDrain(const char *nick, int sd) {
+    char path[512];
+    char notice[128];
+    struct iovec iov[2];
+    struct mboxHeader *h;
+    char *p;
+    int fd;
+    int out;
+    ssize_t n;
+
+    mboxPath(path, sizeof(path), nick, 1);
+    if ((fd = open(path, O_RDWR)) < 0) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    p = mmap(NULL, MBOX_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("S: mboxDrain mmap error");
+        return -1;
+    }
+    h = (struct mboxHeader *)p;
+    if (h->magic != MBOX_MAGIC || h->count == 0) {
+        munmap(p, MBOX_SIZE);
+        unlink(path);
+        return 0;
+    }
+
+    /* one batched write: notice line plus the whole queued region */
+    if (h->dropped > 0) {
+        snprintf(notice, sizeof(notice),
+                 "S: %u offline messages (%u dropped, mailbox full)\n",
+                 h->count, h->dropped);
+    } else {
+        snprintf(notice, sizeof(notice), "S: %u offline messages\n", h->count);
+    }
+    iov[0].iov_base = notice;
+    iov[0].iov_len = strlen(notice);
+    iov[1].iov_base = p + sizeof(*h);
+    iov[1].iov_len = h->used;
+    out = h->count;
+    while (iov[1].iov_len > 0) {
+        n = wsWritev(sd, iov, 2);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("S: mboxDrain writev error");
+            out = -1;
+            break;
+        }
+        // Partial write - advance past what the kernel took
+        if ((size_t)n >= iov[0].iov_len) {
+            n -= iov[0].iov_len;
+            iov[0].iov_len = 0;
+            iov[1].iov_base = (char *)iov[1].iov_base + n;
+            iov[1].iov_len -= n;
+        } else {
+            iov[0].iov_base = (char *)iov[0].iov_base + n;
+            iov[0].iov_len -= n;
+        }
+    }
+    munmap(p, MBOX_SIZE);
+    if (out > 0) {
+        unlink(path);
+    }
+    return out;
+}
+
+/* empties the mailbox into buf, for a user who is online on another server */
+int mboxTake(const char *nick, char *buf, size_t len, size_t *used) {
+    char path[512];
+    struct mboxHeader *h;
+    char *p;
+    int fd;
+    int out;
+
+    *used = 0;
+    mboxPath(path, sizeof(path), nick, 1);
+    if ((fd = open(path, O_RDWR)) < 0) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    p = mmap(NULL, MBOX_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("S: mboxTake mmap error");
+        return -1;
+    }
+    h = (struct mboxHeader *)p;
+    if (h->magic != MBOX_MAGIC || h->count == 0) {
+        out = 0;
+    } else if (h->used > len) {
+        out = -1;
+    } else {
+        memcpy(buf, p + sizeof(*h), h->used);
+        *used = h->used;
+        out = h->count;
+    }
+    munmap(p, MBOX_SIZE);
+    if (out >= 0) {
+        unlink(path);
+    }
+    return out;
+}
@@ -0,0 +1,44 @@
+/* *
+ * Name: mailbox.h                                                  *
+ *                                                                  *
+ * Description: offline mailbox include file                        *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __MAILBOX_H
+#define __MAILBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MBOX_DIR "mailbox"
+#define MBOX_CAP 16384 /* bytes of queued messages per user */
+#define MBOX_MAGIC 0x424d4347 /* "GCMB" */
+
+/* on-disk layout: header followed by MBOX_CAP bytes of queued lines */
+struct mboxHeader {
+    uint32_t magic;
+    uint32_t count;   /* messages queued */
+    uint32_t used;    /* bytes queued */
+    uint32_t dropped; /* messages refused because the mailbox was full */
+};
+
+int mboxInit(const char *dir);
+int mboxAppend(const char *nick, const char *msg, size_t len);
+int mboxDrain(const char *nick, int sd);
+int mboxTake(const char *nick, char *buf, size_t len, size_t *used);
+
+#endif
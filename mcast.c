@@ -0,0 +1,211 @@
+/* *
+ * Name: mcast.c                                                    *
+ *                                                                  *
+ * Description: UDP multicast delivery, NACK repair                 *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "mcast.h"
+#include "ws.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/*
+ * A room message goes out once, as one datagram to the room's group,
+ * instead of once per member over TCP. Each room numbers its datagrams
+ * and keeps the last MCAST_RING of them; a subscriber that sees a gap
+ * asks for the missing range with /nack over its TCP connection and the
+ * lines come back on that connection. Rooms hash onto the 256 groups of
+ * MCAST_GROUP, the name in the header tells rooms on one group apart.
+ * The header also carries the sender's tag, which its subscription
+ * notice told the client, so a sender skips its own line as it does
+ * over TCP.
+ */
+
+static int ud = -1;
+static struct sockaddr_in base;
+static char ifName[INET_ADDRSTRLEN];
+
+/* statistics */
+static unsigned long nSent, nSaved, nFailed, nNack, nResent, nLost;
+
+int mcastInit(const char *group, const char *ifaddr, int port) {
+    struct in_addr ifa;
+    unsigned char ttl = 1, loop = 1;
+
+    memset(&base, 0, sizeof(base));
+    base.sin_family = AF_INET;
+    base.sin_port = htons(port);
+    if (inet_pton(AF_INET, group, &base.sin_addr) != 1 ||
+        !IN_MULTICAST(ntohl(base.sin_addr.s_addr)) ||
+        inet_pton(AF_INET, ifaddr, &ifa) != 1) {
+        printf("S: bad multicast group %s or interface %s\n", group, ifaddr);
+        return -1;
+    }
+    base.sin_addr.s_addr &= htonl(0xffffff00);
+    if ((ud = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("S: mcast socket error");
+        return -1;
+    }
+    // Loop on so members on this host, the loopback tests included, hear it
+    if (setsockopt(ud, IPPROTO_IP, IP_MULTICAST_IF, &ifa, sizeof(ifa)) < 0 ||
+        setsockopt(ud, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+        setsockopt(ud, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) <
+            0 ||
+        fcntl(ud, F_SETFL, O_NONBLOCK) < 0) {
+        perror("S: mcast setsockopt error");
+        close(ud);
+        ud = -1;
+        return -1;
+    }
+    snprintf(ifName, sizeof(ifName), "%s", ifaddr);
+    printf("S: multicast on %s/24 port %d via %s\n", group, port, ifaddr);
+    return 0;
+}
+
+int mcastOn(void) { return ud >= 0; }
+
+/* the name, not the intern handle, so every server agrees on the group */
+static struct sockaddr_in groupOf(const struct room *r) {
+    struct sockaddr_in g = base;
+    const char *s = roomName(r);
+    uint32_t h = 2166136261u;
+
+    while (*s != '\0') {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    g.sin_addr.s_addr = htonl(ntohl(base.sin_addr.s_addr) | (h & 0xff));
+    return g;
+}
+
+static struct mcastRing *ringOf(struct room *r) {
+    if (r->mcast == NULL && (r->mcast = calloc(1, sizeof(*r->mcast))) != NULL) {
+        r->mcast->next = 1;
+    }
+    return r->mcast;
+}
+
+int mcastSend(struct room *r, const char *msg, size_t len, int saved,
+              uint32_t tag) {
+    struct mcastRing *m;
+    struct mcastHdr h;
+    struct sockaddr_in g = groupOf(r);
+    struct msghdr mh;
+    struct iovec iov[2];
+    unsigned slot;
+
+    if (ud < 0 || (m = ringOf(r)) == NULL || len >= MAXCHR) {
+        return -1;
+    }
+    // Kept before sending: a datagram the kernel drops is still repairable
+    slot = m->next % MCAST_RING;
+    m->seq[slot] = m->next;
+    m->from[slot] = tag;
+    m->len[slot] = (uint16_t)len;
+    memcpy(m->line[slot], msg, len);
+    memset(&h, 0, sizeof(h));
+    h.magic = htonl(MCAST_MAGIC);
+    h.seq = htonl(m->next++);
+    h.from = htonl(tag);
+    snprintf(h.room, sizeof(h.room), "%s", roomName(r));
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    iov[1].iov_base = (void *)msg;
+    iov[1].iov_len = len;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = &g;
+    mh.msg_namelen = sizeof(g);
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+    if (sendmsg(ud, &mh, 0) < 0) {
+        nFailed++;
+        return -1;
+    }
+    nSent++;
+    nSaved += saved;
+    return 0;
+}
+
+/* resend [from, to] over TCP, returns how many fell out of the ring */
+int mcastResend(struct room *r, uint32_t from, uint32_t to, int sd,
+                uint32_t tag) {
+    struct mcastRing *m = r->mcast;
+    unsigned slot;
+    int lost = 0;
+    uint32_t s;
+
+    nNack++;
+    if (from == 0) {
+        from = 1;
+    }
+    if (m == NULL || to >= m->next) {
+        to = m ? m->next - 1 : 0;
+    }
+    if (to >= from && to - from >= MCAST_RING) {
+        // Older than anything retained, no point walking the whole range
+        lost += (int)(to - from + 1 - MCAST_RING);
+        from = to - MCAST_RING + 1;
+    }
+    for (s = from; s != 0 && s <= to; s++) {
+        slot = s % MCAST_RING;
+        if (m->seq[slot] != s) {
+            lost++;
+        } else if (m->from[slot] == tag) {
+            continue; // its own line, never echoed
+        } else if (wsSend(sd, m->line[slot], m->len[slot]) < 0) {
+            break;
+        } else {
+            nResent++;
+        }
+    }
+    nLost += lost;
+    return lost;
+}
+
+void mcastNotice(struct room *r, char *buf, size_t len, uint32_t tag) {
+    struct sockaddr_in g = groupOf(r);
+    struct mcastRing *m = ringOf(r);
+    char addr[INET_ADDRSTRLEN];
+
+    inet_ntop(AF_INET, &g.sin_addr, addr, sizeof(addr));
+    snprintf(buf, len, "S: mcast %s %s %d %lu %lu\n", roomName(r), addr,
+             ntohs(g.sin_port), m ? (unsigned long)m->next : 1ul,
+             (unsigned long)tag);
+}
+
+void mcastDrop(struct room *r) {
+    free(r->mcast);
+    r->mcast = NULL;
+}
+
+void mcastReport(char *buf, size_t len) {
+    if (ud < 0) {
+        snprintf(buf, len, "S: multicast off\n");
+        return;
+    }
+    snprintf(buf, len,
+             "S: multicast via %s datagrams %lu (failed %lu) unicast saved "
+             "%lu nacks %lu resent %lu lost %lu\n",
+             ifName, nSent, nFailed, nSaved, nNack, nResent, nLost);
+}
@@ -0,0 +1,64 @@
+/* *
+ * Name: mcast.h                                                    *
+ *                                                                  *
+ * Description: UDP multicast delivery include file                 *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __MCAST_H
+#define __MCAST_H
+
+#include "chat.h"
+#include "room.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define MCAST_GROUP "239.192.0.0" /* rooms hash into this /24 */
+#define MCAST_PORT 5910
+#define MCAST_IF "127.0.0.1"      /* outgoing interface */
+#define MCAST_RING 256            /* recent messages kept for NACKs */
+#define MCAST_MAGIC 0x4d434832u   /* "MCH2" */
+#define CMD_MCAST "/mcast"
+#define CMD_NACK "/nack "
+
+/* datagram header, followed by the message line; integers big endian */
+struct mcastHdr {
+    uint32_t magic;
+    uint32_t seq;      /* per room, starting at 1 */
+    uint32_t from;     /* the sending client's tag, 0 for none */
+    char room[MAXROOM];
+};
+
+/* retained datagrams of one room, allocated on its first multicast */
+struct mcastRing {
+    uint32_t next;     /* sequence of the next message */
+    uint32_t seq[MCAST_RING];
+    uint32_t from[MCAST_RING];
+    uint16_t len[MCAST_RING];
+    char line[MCAST_RING][MAXCHR];
+};
+
+int mcastInit(const char *group, const char *ifaddr, int port);
+int mcastOn(void);
+int mcastSend(struct room *r, const char *msg, size_t len, int saved,
+              uint32_t tag);
+int mcastResend(struct room *r, uint32_t from, uint32_t to, int sd,
+                uint32_t tag);
+void mcastNotice(struct room *r, char *buf, size_t len, uint32_t tag);
+void mcastDrop(struct room *r);
+void mcastReport(char *buf, size_t len);
+
+#endif
@@ -0,0 +1,408 @@
+/* *
+ * Name: node.c                                                     *
+ *                                                                  *
+ * Description: cluster node link                                   *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+#include "node.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#ifdef CHAT_TLS
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#endif
+
+/*
+ * One UDP socket carries everything between servers. Each peer has an
+ * output buffer that starts with a fixed-size header,
+ * "N<from> <to> <time> <seq> <mac>\n"; lines are appended to it and it goes
+ * out when the next line would not fit or at nodeFlush(). A reply
+ * produced while reading a datagram therefore travels with every other
+ * line bound for the same server in that pass.
+ *
+ * The mac is the HMAC-SHA256 of the datagram, with the mac field still
+ * zeros, under the cluster key, cut to 16 bytes. A datagram is taken
+ * only from its sender's listed address, for this server, within
+ * NODE_SKEW seconds of its time, and with a matching mac.
+ *
+ * seq counts the datagrams a server sends to one peer. It starts at
+ * the wall clock in milliseconds times 1024, so a restarted sender
+ * begins above anything its previous run sent. The receiver keeps the
+ * highest seq taken from each peer and a bitmap of the NODE_WINDOW
+ * below it, as IPsec does: a datagram that arrives out of order is
+ * still taken once, and a copy replayed within NODE_SKEW is refused.
+ */
+
+#define NODE_READS 64 /* datagrams read per pass */
+#define NODE_MAC 32   /* hex digits of the mac */
+#define NODE_SKEW 30  /* seconds a datagram may be early or late */
+#define NODE_WINDOW 64 /* seqs below the newest still taken, out of order */
+
+struct peer {
+    struct sockaddr_in addr;
+    char out[NODE_MTU];
+    size_t used;
+    uint64_t seq;  /* last sent to this peer */
+    uint64_t top;  /* newest taken from it */
+    uint64_t seen; /* bit k: top - k was taken */
+};
+
+static struct peer peer[NODE_MAX];
+static int nPeer, self = -1, nd = -1;
+static size_t head; /* bytes of the header */
+static unsigned char key[32];
+
+static struct {
+    char verb[16];
+    void (*fn)(int from, char *args);
+} handler[NODE_HANDLERS];
+static int nHandler;
+
+/* statistics */
+static unsigned long nOut, nIn, nLinesOut, nLinesIn, nUnknown, nErrors;
+static unsigned long nForged, nReplayed;
+
+static int parse(const char *item, struct sockaddr_in *addr) {
+    char host[INET_ADDRSTRLEN];
+    int port;
+
+    if (sscanf(item, "%15[0-9.]:%d", host, &port) != 2 || port <= 0 ||
+        port > 65535) {
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    return inet_pton(AF_INET, host, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+#ifdef CHAT_TLS
+static int keyed(const char *secret) {
+    return EVP_Digest(secret, strlen(secret), key, NULL, EVP_sha256(),
+                      NULL) == 1;
+}
+
+/* the mac of a datagram whose mac field holds zeros, as hex */
+static void mac(const char *pkt, size_t len, char *hex) {
+    unsigned char md[32];
+    unsigned int n = sizeof(md);
+    char text[NODE_MAC + 1];
+    int k;
+
+    HMAC(EVP_sha256(), key, sizeof(key), (const unsigned char *)pkt, len, md,
+         &n);
+    for (k = 0; k < NODE_MAC / 2; k++) {
+        sprintf(text + 2 * k, "%02x", md[k]);
+    }
+    memcpy(hex, text, NODE_MAC); // no terminator, the header goes on
+}
+
+static int same(const char *a, const char *b) {
+    return CRYPTO_memcmp(a, b, NODE_MAC) == 0;
+}
+#else
+static int keyed(const char *secret) {
+    (void)secret;
+    printf("S: the node link needs OpenSSL to sign its datagrams\n");
+    return 0;
+}
+
+static void mac(const char *pkt, size_t len, char *hex) {
+    (void)pkt, (void)len;
+    memset(hex, '0', NODE_MAC);
+}
+
+static int same(const char *a, const char *b) { return (void)a, (void)b, 0; }
+#endif
+
+/* where the mac sits; ids have two digits, times ten and seqs sixteen,
+   so every server's header has the same length */
+static char *macField(char *pkt) { return pkt + head - 1 - NODE_MAC; }
+
+/* writes the header for peer k, mac zeroed, and returns its length */
+static size_t header(char *out, int k, long when, uint64_t seq) {
+    char h[80];
+    int n = snprintf(h, sizeof(h), "N%02d %02d %010ld %016llx %0*d\n", self,
+                     k, when, (unsigned long long)seq, NODE_MAC, 0);
+
+    memcpy(out, h, n);
+    return n;
+}
+
+int nodeInit(const char *list, int id, const char *secret) {
+    struct sockaddr_in local;
+    struct timespec ts;
+    const char *p;
+    int k, on = 1, size = 1 << 20;
+
+    if (secret == NULL || *secret == '\0') {
+        printf("S: CHAT_NODES needs the shared CHAT_NODE_KEY\n");
+        return -1;
+    }
+    if (!keyed(secret)) {
+        return -1;
+    }
+
+    for (p = list, nPeer = 0; *p && nPeer < NODE_MAX; nPeer++) {
+        if (parse(p, &peer[nPeer].addr) < 0) {
+            printf("S: bad node %d in CHAT_NODES\n", nPeer);
+            return -1;
+        }
+        if ((p = strchr(p, ',')) == NULL) {
+            nPeer++;
+            break;
+        }
+        p++;
+    }
+    if (id < 0 || id >= nPeer) {
+        printf("S: node id %d not in CHAT_NODES (%d nodes)\n", id, nPeer);
+        return -1;
+    }
+    self = id;
+    // Only the listed address, the peers check our replies come from it
+    local = peer[self].addr;
+    if ((nd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("S: node socket error");
+        return -1;
+    }
+    if (setsockopt(nd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(nd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        perror("S: node bind error");
+        close(nd);
+        nd = -1;
+        return -1;
+    }
+    // A burst from many peers in one pass must not overflow the queue
+    setsockopt(nd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    fcntl(nd, F_SETFL, O_NONBLOCK);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    for (k = 0; k < nPeer; k++) {
+        peer[k].used = head = header(peer[k].out, k, 0, 0);
+        peer[k].seq = ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) << 10;
+    }
+    printf("S: node %d of %d\n", self, nPeer);
+    return nd;
+}
+
+int nodeActive(void) { return nd > -1; }
+
+int nodeSelf(void) { return self; }
+
+int nodeCount(void) { return nPeer; }
+
+/* a server's address as listed, for clients sent over to it */
+const char *nodeHost(int k) {
+    static char host[INET_ADDRSTRLEN];
+
+    if (k < 0 || k >= nPeer ||
+        inet_ntop(AF_INET, &peer[k].addr.sin_addr, host, sizeof(host)) == NULL) {
+        return "";
+    }
+    return host;
+}
+
+int nodeHandler(const char *verb, void (*fn)(int from, char *args)) {
+    if (nHandler == NODE_HANDLERS || strlen(verb) >= sizeof(handler[0].verb)) {
+        return -1;
+    }
+    snprintf(handler[nHandler].verb, sizeof(handler[0].verb), "%s", verb);
+    handler[nHandler++].fn = fn;
+    return 0;
+}
+
+static void flushPeer(int k) {
+    struct peer *p = &peer[k];
+
+    if (p->used == head) {
+        return;
+    }
+    header(p->out, k, (long)time(NULL), ++p->seq);
+    mac(p->out, p->used, macField(p->out));
+    if (sendto(nd, p->out, p->used, 0, (struct sockaddr *)&p->addr,
+               sizeof(p->addr)) < 0) {
+        nErrors++;
+    } else {
+        nOut++;
+    }
+    p->used = head;
+}
+
+/* queues one line for a peer, never for this server itself */
+int nodeSend(int to, const char *fmt, ...) {
+    char line[NODE_LINE];
+    va_list ap;
+    int n;
+
+    if (nd < 0 || to < 0 || to >= nPeer || to == self) {
+        return -1;
+    }
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= (int)sizeof(line) - 1) {
+        return -1;
+    }
+    line[n++] = '\n';
+    if (peer[to].used + n > NODE_MTU) {
+        flushPeer(to);
+    }
+    memcpy(peer[to].out + peer[to].used, line, n);
+    peer[to].used += n;
+    nLinesOut++;
+    return 0;
+}
+
+void nodeFlush(void) {
+    int k;
+
+    for (k = 0; nd > -1 && k < nPeer; k++) {
+        flushPeer(k);
+    }
+}
+
+void nodeFds(fd_set *set) {
+    if (nd > -1) {
+        FD_SET(nd, set);
+    }
+}
+
+static void dispatch(int from, char *line) {
+    char *args = strchr(line, ' ');
+    int k;
+
+    if (args != NULL) {
+        *args++ = '\0';
+    } else {
+        args = line + strlen(line);
+    }
+    for (k = 0; k < nHandler; k++) {
+        if (strcmp(handler[k].verb, line) == 0) {
+            handler[k].fn(from, args);
+            return;
+        }
+    }
+    nUnknown++;
+}
+
+/* takes seq from peer p once: newer than any yet, or inside the window
+   and not seen */
+static int fresh(struct peer *p, uint64_t seq) {
+    uint64_t d;
+
+    if (seq > p->top) {
+        d = seq - p->top;
+        p->seen = d >= NODE_WINDOW ? 1 : (p->seen << d) | 1;
+        p->top = seq;
+        return 1;
+    }
+    d = p->top - seq;
+    if (d >= NODE_WINDOW || (p->seen >> d) & 1) {
+        return 0;
+    }
+    p->seen |= (uint64_t)1 << d;
+    return 1;
+}
+
+/* the sender's id when the datagram is genuine, new and for us, else -1 */
+static int check(char *pkt, size_t n, const struct sockaddr_in *src) {
+    char got[NODE_MAC], want[NODE_MAC];
+    unsigned long long seq;
+    long when;
+    int from, to;
+
+    if (n < head || pkt[0] != 'N' || pkt[head - 1] != '\n' ||
+        sscanf(pkt + 1, "%d %d %ld %16llx", &from, &to, &when, &seq) != 4 ||
+        from < 0 ||
+        from >= nPeer || from == self || to != self ||
+        src->sin_addr.s_addr != peer[from].addr.sin_addr.s_addr ||
+        src->sin_port != peer[from].addr.sin_port) {
+        return -1;
+    }
+    memcpy(got, macField(pkt), NODE_MAC);
+    memset(macField(pkt), '0', NODE_MAC);
+    mac(pkt, n, want);
+    if (!same(got, want) || when < (long)time(NULL) - NODE_SKEW ||
+        when > (long)time(NULL) + NODE_SKEW) {
+        nForged++;
+        return -1;
+    }
+    // Only a genuine datagram may move the window
+    if (!fresh(&peer[from], seq)) {
+        nReplayed++;
+        return -1;
+    }
+    return from;
+}
+
+void nodeRun(fd_set *ready) {
+    char pkt[NODE_MTU + 1];
+    char *line, *end;
+    struct sockaddr_in src;
+    socklen_t sl;
+    ssize_t n;
+    int k, from;
+
+    if (nd < 0 || !FD_ISSET(nd, ready)) {
+        return;
+    }
+    for (k = 0; k < NODE_READS; k++) {
+        sl = sizeof(src);
+        if ((n = recvfrom(nd, pkt, NODE_MTU, 0, (struct sockaddr *)&src,
+                          &sl)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                nErrors++;
+            }
+            break;
+        }
+        pkt[n] = '\0';
+        if ((from = check(pkt, n, &src)) < 0) {
+            nUnknown++;
+            continue;
+        }
+        nIn++;
+        for (line = pkt + head; (end = strchr(line, '\n')) != NULL;
+             line = end + 1) {
+            *end = '\0';
+            nLinesIn++;
+            dispatch(from, line);
+        }
+    }
+}
+
+void nodeReport(char *buf, size_t len) {
+    if (nd < 0) {
+        snprintf(buf, len, "S: single node\n");
+        return;
+    }
+    snprintf(buf, len,
+             "S: node %d of %d datagrams out %lu in %lu lines out %lu in %lu "
+             "unknown %lu forged %lu replayed %lu errors %lu\n",
+             self, nPeer, nOut, nIn, nLinesOut, nLinesIn, nUnknown, nForged,
+             nReplayed, nErrors);
+}
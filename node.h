@@ -0,0 +1,58 @@
+/* *
+ * Name: node.h                                                     *
+ *                                                                  *
+ * Description: cluster node link include file                      *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+
+#ifndef __NODE_H
+#define __NODE_H
+
+#include <stddef.h>
+#include <sys/select.h>
+
+#define NODE_MAX 16       /* servers in CHAT_NODES */
+#define NODE_MTU 1400     /* bytes per datagram */
+#define NODE_LINE 512     /* longest line */
+#define NODE_HANDLERS 16
+
+/*
+ * Servers that make up one chat service are listed, in the same order
+ * on every server, as CHAT_NODES="10.0.0.1:5905,10.0.0.2:5905,...";
+ * CHAT_NODE_ID is this server's position in the list. Servers talk in
+ * text lines over UDP, "<verb> <args>". Lines for one server are
+ * gathered during a pass and leave together, as few datagrams as fit,
+ * when nodeFlush() runs at the end of the pass. Each datagram starts
+ * with the sender's id and is signed with the key every server shares,
+ * CHAT_NODE_KEY. Delivery is not guaranteed: users of the link retry
+ * what has to arrive.
+ */
+
+int nodeInit(const char *list, int self, const char *key);
+int nodeActive(void);
+int nodeSelf(void);
+int nodeCount(void);
+const char *nodeHost(int k);
+int nodeHandler(const char *verb, void (*fn)(int from, char *args));
+int nodeSend(int to, const char *fmt, ...);
+void nodeFlush(void);
+void nodeFds(fd_set *set);
+void nodeRun(fd_set *ready);
+void nodeReport(char *buf, size_t len);
+
+#endif
@@ -0,0 +1,313 @@
+/* *
+ * Name: quota.c                                                    *
+ *                                                                  *
+ * Description: cluster rate limits                                 *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+#include "quota.h"
+#include "node.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Keys are "u:<nick>" and "a:<address>". Each holds, per server, how
+ * many messages it let through in the current and previous window;
+ * windows are numbered from the epoch, so every server agrees on them
+ * as far as their clocks do. A report is "use <window> <key> <current>
+ * <previous>" with this server's totals, not increments, so a lost or
+ * repeated report does no harm. A key idle for two windows is freed.
+ */
+
+struct key {
+    struct key *next;
+    char name[QUOTA_KEY];
+    int limit;
+    long win;                /* window the counts are for */
+    unsigned cur[NODE_MAX];  /* let through per server, this window */
+    unsigned prev[NODE_MAX]; /* and in the one before */
+    unsigned taken;          /* let through here since the last report */
+    unsigned share;          /* and how many may be until the next */
+    int resend;              /* reports still owed for the last change */
+};
+
+static struct key *table[QUOTA_BUCKETS];
+static int limitUser, limitAddr, window, on, self, servers;
+static uint64_t nextSync, nextShare;
+static int nKey;
+
+/* statistics */
+static unsigned long nTaken, nUserLimited, nAddrLimited, nReports, nHeard;
+
+/* wall clock, so that servers number their windows alike */
+static uint64_t nowMs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned hash(const char *name) {
+    unsigned h = 2166136261u;
+
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h % QUOTA_BUCKETS;
+}
+
+static double estimate(const struct key *k, uint64_t now) {
+    uint64_t start = (uint64_t)k->win * window * 1000;
+    double past = 1.0 - (double)(now - start) / (window * 1000.0);
+    unsigned p = 0, c = 0;
+    int n;
+
+    for (n = 0; n < servers; n++) {
+        p += k->prev[n];
+        c += k->cur[n];
+    }
+    return p * past + c;
+}
+
+/*
+ * This server's part of what is left. The remainder of the division
+ * goes to servers in turn, so that together they never get more than
+ * the whole and a nearly spent key still lets its last messages pass.
+ */
+static void reshare(struct key *k, uint64_t now) {
+    double left = k->limit - estimate(k, now);
+    unsigned whole = left < 1 ? 0 : (unsigned)left;
+    unsigned turn = (unsigned)((now / QUOTA_SYNC + self) % servers);
+
+    k->share = whole / servers + (turn < whole % servers);
+}
+
+static void roll(struct key *k, uint64_t now) {
+    long w = (long)(now / 1000 / window);
+
+    if (k->win == w) {
+        return;
+    }
+    if (k->win == w - 1) {
+        memcpy(k->prev, k->cur, sizeof(k->prev));
+    } else {
+        memset(k->prev, 0, sizeof(k->prev));
+    }
+    memset(k->cur, 0, sizeof(k->cur));
+    k->win = w;
+    k->taken = 0;
+    reshare(k, now);
+}
+
+static struct key *get(const char *name, uint64_t now) {
+    struct key *k;
+    unsigned h = hash(name);
+
+    for (k = table[h]; k != NULL; k = k->next) {
+        if (strcmp(k->name, name) == 0) {
+            roll(k, now);
+            return k;
+        }
+    }
+    if ((k = calloc(1, sizeof(*k))) == NULL) {
+        perror("S: quota calloc error");
+        return NULL;
+    }
+    snprintf(k->name, sizeof(k->name), "%s", name);
+    k->limit = name[0] == 'u' ? limitUser : limitAddr;
+    k->win = -1;
+    roll(k, now);
+    k->next = table[h];
+    table[h] = k;
+    nKey++;
+    return k;
+}
+
+static void take(struct key *k) {
+    if (k != NULL) {
+        k->cur[self]++;
+        k->taken++;
+        k->resend = QUOTA_RESEND;
+    }
+}
+
+static void onUse(int from, char *args) {
+    char name[QUOTA_KEY];
+    unsigned c, p;
+    struct key *k;
+    long win;
+
+    if (sscanf(args, "%ld %47s %u %u", &win, name, &c, &p) != 4 ||
+        (name[0] != 'u' && name[0] != 'a') || name[1] != ':' ||
+        (k = get(name, nowMs())) == NULL) {
+        return;
+    }
+    nHeard++;
+    if (win == k->win) {
+        k->cur[from] = c > k->cur[from] ? c : k->cur[from];
+        k->prev[from] = p > k->prev[from] ? p : k->prev[from];
+    } else if (win == k->win - 1) {
+        k->prev[from] = c > k->prev[from] ? c : k->prev[from];
+    }
+}
+
+void quotaInit(int user, int addr, int win) {
+    if (user <= 0 || addr <= 0 || win <= 0) {
+        printf("S: bad rate limits %d,%d,%d\n", user, addr, win);
+        return;
+    }
+    limitUser = user;
+    limitAddr = addr;
+    window = win;
+    self = nodeActive() ? nodeSelf() : 0;
+    servers = nodeActive() ? nodeCount() : 1;
+    if (nodeActive()) {
+        nodeHandler("use", onUse);
+    }
+    // Every server reports on the same ticks and reshares half a tick later,
+    // when the reports of the others have arrived
+    nextSync = (nowMs() / QUOTA_SYNC + 1) * QUOTA_SYNC;
+    nextShare = nextSync + QUOTA_SYNC / 2;
+    on = 1;
+}
+
+int quotaOn(void) { return on; }
+
+/* counts a message against both keys, unless either is spent */
+int quotaTake(const char *nick, const char *addr) {
+    char name[QUOTA_KEY];
+    struct key *u = NULL, *a = NULL;
+    uint64_t now;
+
+    if (!on) {
+        return QUOTA_OK;
+    }
+    now = nowMs();
+    // Fail open: a full heap is no reason to silence everyone
+    if (nick != NULL) {
+        snprintf(name, sizeof(name), "u:%s", nick);
+        u = get(name, now);
+    }
+    if (addr != NULL && *addr) {
+        snprintf(name, sizeof(name), "a:%s", addr);
+        a = get(name, now);
+    }
+    if (u != NULL && u->taken >= u->share) {
+        nUserLimited++;
+        return QUOTA_USER_LIMIT;
+    }
+    if (a != NULL && a->taken >= a->share) {
+        nAddrLimited++;
+        return QUOTA_ADDR_LIMIT;
+    }
+    take(u);
+    take(a);
+    nTaken++;
+    return QUOTA_OK;
+}
+
+/* ms until the next report, -1 when there is nothing to report */
+int quotaTimeout(void) {
+    uint64_t now, next;
+
+    if (!on || nKey == 0) {
+        return -1;
+    }
+    now = nowMs();
+    next = nextSync < nextShare ? nextSync : nextShare;
+    return next <= now ? 0 : (int)(next - now);
+}
+
+static void report(uint64_t now) {
+    struct key *k;
+    int h, n;
+
+    for (h = 0; h < QUOTA_BUCKETS; h++) {
+        for (k = table[h]; k != NULL; k = k->next) {
+            roll(k, now);
+            if (k->resend == 0) {
+                continue;
+            }
+            for (n = 0; n < servers; n++) {
+                if (n != self) {
+                    nodeSend(n, "use %ld %s %u %u", k->win, k->name,
+                             k->cur[self], k->prev[self]);
+                }
+            }
+            k->resend--;
+            nReports++;
+        }
+    }
+}
+
+static void share(uint64_t now) {
+    struct key **p, *k;
+    unsigned used;
+    int h, n;
+
+    for (h = 0; h < QUOTA_BUCKETS; h++) {
+        for (p = &table[h]; (k = *p) != NULL;) {
+            roll(k, now);
+            for (n = 0, used = 0; n < servers; n++) {
+                used += k->cur[n] + k->prev[n];
+            }
+            if (used == 0 && k->resend == 0) {
+                *p = k->next;
+                nKey--;
+                free(k);
+                continue;
+            }
+            k->taken = 0;
+            reshare(k, now);
+            p = &k->next;
+        }
+    }
+}
+
+void quotaTick(void) {
+    uint64_t now;
+
+    if (!on) {
+        return;
+    }
+    now = nowMs();
+    if (now >= nextSync) {
+        nextSync = (now / QUOTA_SYNC + 1) * QUOTA_SYNC;
+        if (servers > 1) {
+            report(now);
+        }
+    }
+    if (now >= nextShare) {
+        nextShare = nextSync + QUOTA_SYNC / 2;
+        share(now);
+    }
+}
+
+void quotaReport(char *buf, size_t len) {
+    if (!on) {
+        snprintf(buf, len, "S: rate limits off\n");
+        return;
+    }
+    snprintf(buf, len,
+             "S: rate limits user %d address %d per %d s keys %d allowed %lu "
+             "limited user %lu address %lu reports %lu heard %lu\n",
+             limitUser, limitAddr, window, nKey, nTaken, nUserLimited,
+             nAddrLimited, nReports, nHeard);
+}
@@ -0,0 +1,56 @@
+/* *
+ * Name: quota.h                                                    *
+ *                                                                  *
+ * Description: cluster rate limit include file                     *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+
+#ifndef __QUOTA_H
+#define __QUOTA_H
+
+#include <stddef.h>
+
+#define QUOTA_USER 30     /* messages per window per nick */
+#define QUOTA_ADDR 100    /* messages per window per client address */
+#define QUOTA_WINDOW 10   /* seconds */
+#define QUOTA_SYNC 250    /* ms between consumption reports */
+#define QUOTA_RESEND 3    /* reports sent for a key after each change */
+#define QUOTA_BUCKETS 4096
+#define QUOTA_KEY 48
+
+enum { QUOTA_OK, QUOTA_USER_LIMIT, QUOTA_ADDR_LIMIT };
+
+/*
+ * Limits hold for the whole cluster: every server counts what it let
+ * through for each key and reports its count to the others every
+ * QUOTA_SYNC ms, so a check only ever reads local memory. Between two
+ * reports a server lets through at most its share, 1 / servers, of
+ * what was left of the limit at the last one. That bounds how far the
+ * servers together can overshoot while their counts are in flight.
+ * Windows slide: the previous one counts in proportion to how much of
+ * it still overlaps.
+ */
+
+void quotaInit(int user, int addr, int window);
+int quotaOn(void);
+int quotaTake(const char *nick, const char *addr);
+int quotaTimeout(void);
+void quotaTick(void);
+void quotaReport(char *buf, size_t len);
+
+#endif
@@ -0,0 +1,297 @@
+/* *
+ * Name: redir.c                                                    *
+ *                                                                  *
+ * Description: load-aware redirection between servers              *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+#include "redir.h"
+#include "node.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/random.h>
+
+struct load {
+    int percent;
+    int capacity;
+    time_t at;       /* when it was reported, 0 never */
+    int promised;    /* clients sent there since */
+    time_t promisedAt;
+};
+
+static struct load load[NODE_MAX];
+static struct {
+    char token[REDIR_TOKEN];
+    struct redirSession s;
+    time_t until;
+    int used; /* a token works once, a repeated sess is only answered */
+} held[REDIR_SESSIONS];
+
+/* sessions sent ahead, until the target says it took them */
+static struct {
+    char token[REDIR_TOKEN]; /* empty when free */
+    char line[NODE_LINE];
+    int to, slot, tries;
+    unsigned gen;
+    uint64_t due;
+} sent[REDIR_SESSIONS];
+
+static struct redirOps ops;
+static int capacity, high, on, self, myLoad, nextHeld;
+static long busyUs; /* busy time since the last report */
+static struct timespec since;
+
+/* statistics */
+static unsigned long nHanded, nResumed, nUnknown, nReports, nLost;
+
+static uint64_t nowMs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void onLoad(int from, char *args) {
+    struct load *l = &load[from];
+    int percent, cap;
+
+    if (sscanf(args, "%d %d", &percent, &cap) != 2 || cap <= 0) {
+        return;
+    }
+    l->percent = percent;
+    l->capacity = cap;
+    l->at = time(NULL);
+    // Clients told to go there may still be waiting out their jitter
+    if (l->at > l->promisedAt + REDIR_JITTER / 1000 + REDIR_EVERY) {
+        l->promised = 0;
+    }
+}
+
+/* the node link drops datagrams not signed with the cluster key */
+static void onSess(int from, char *args) {
+    char token[REDIR_TOKEN];
+    struct redirSession s;
+    int k;
+
+    if (sscanf(args, "%16s %31s %31s %d", token, s.nick, s.room, &s.flags) !=
+        4) {
+        return;
+    }
+    if (strcmp(s.nick, "-") == 0) {
+        s.nick[0] = '\0';
+    }
+    if (strcmp(s.room, "-") == 0) {
+        s.room[0] = '\0';
+    }
+    // A resend after a lost answer is answered again, but kept once
+    for (k = 0; k < REDIR_SESSIONS; k++) {
+        if (strcmp(held[k].token, token) == 0) {
+            break;
+        }
+    }
+    if (k == REDIR_SESSIONS) {
+        k = nextHeld++ % REDIR_SESSIONS;
+        memcpy(held[k].token, token, sizeof(token));
+        held[k].s = s;
+        held[k].until = time(NULL) + REDIR_HOLD;
+        held[k].used = 0;
+    }
+    nodeSend(from, "took %s", token);
+}
+
+/* the target has the session: now the client may be told to go */
+static void onTook(int from, char *args) {
+    int k;
+
+    for (k = 0; k < REDIR_SESSIONS; k++) {
+        if (sent[k].token[0] != '\0' && sent[k].to == from &&
+            strcmp(sent[k].token, args) == 0) {
+            ops.ready(ops.arg, sent[k].slot, sent[k].gen, from, sent[k].token);
+            sent[k].token[0] = '\0';
+            return;
+        }
+    }
+}
+
+void redirInit(int cap, int hi, const struct redirOps *o) {
+    if (!nodeActive()) {
+        printf("S: redirection needs CHAT_NODES\n");
+        return;
+    }
+    ops = *o;
+    capacity = cap;
+    high = hi > 0 ? hi : REDIR_HIGH;
+    self = nodeSelf();
+    nodeHandler("load", onLoad);
+    nodeHandler("sess", onSess);
+    nodeHandler("took", onTook);
+    clock_gettime(CLOCK_MONOTONIC, &since);
+    on = 1;
+}
+
+int redirOn(void) { return on; }
+
+void redirBusy(long us) { busyUs += us; }
+
+/*
+ * Every REDIR_EVERY seconds: tell the others our load, and if we are
+ * the hot one, the server to move clients to and how many, else -1.
+ */
+int redirPlan(int clients, int *count) {
+    struct timespec now;
+    long ms;
+    int k, best = -1, eff = 0, e, n, busy;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (now.tv_sec - since.tv_sec) * 1000 +
+         (now.tv_nsec - since.tv_nsec) / 1000000;
+    busy = ms > 0 ? (int)(busyUs / 10 / ms) : 0;
+    myLoad = clients * 100 / capacity;
+    myLoad = busy > myLoad ? busy : myLoad;
+    busyUs = 0;
+    since = now;
+    for (k = 0; k < nodeCount(); k++) {
+        if (k != self) {
+            nodeSend(k, "load %d %d", myLoad, capacity);
+        }
+    }
+    nReports++;
+    for (k = 0; k < nodeCount(); k++) {
+        if (k == self || load[k].at < time(NULL) - REDIR_STALE) {
+            continue;
+        }
+        e = load[k].percent + load[k].promised * 100 / load[k].capacity;
+        if (best < 0 || e < eff) {
+            best = k;
+            eff = e;
+        }
+    }
+    if (best < 0 || myLoad < high || eff + REDIR_GAP > myLoad) {
+        return -1;
+    }
+    // Half the gap, in whole clients, and never the target past the mark
+    n = (myLoad - eff) / 2 * capacity / 100;
+    if (n > (high - eff) * load[best].capacity / 100) {
+        n = (high - eff) * load[best].capacity / 100;
+    }
+    if (n < 1) {
+        n = 1;
+    }
+    load[best].promised += n;
+    load[best].promisedAt = time(NULL);
+    *count = n;
+    return best;
+}
+
+/*
+ * Sends the session of the connection in slot ahead to the target, again
+ * until it answers; ready() is called then, or with no token if it
+ * never does.
+ */
+int redirHandoff(int to, const struct redirSession *s, int slot,
+                 unsigned gen) {
+    char token[REDIR_TOKEN];
+    unsigned char raw[8];
+    int j, k = 0;
+
+    while (k < REDIR_SESSIONS && sent[k].token[0] != '\0') {
+        k++;
+    }
+    if (k == REDIR_SESSIONS || getrandom(raw, sizeof(raw), 0) != sizeof(raw)) {
+        return -1;
+    }
+    for (j = 0; j < 8; j++) {
+        snprintf(token + 2 * j, 3, "%02x", raw[j]);
+    }
+    snprintf(sent[k].line, sizeof(sent[k].line), "sess %s %s %s %d", token,
+             s->nick[0] ? s->nick : "-", s->room[0] ? s->room : "-",
+             s->flags);
+    if (nodeSend(to, "%s", sent[k].line) < 0) {
+        return -1;
+    }
+    memcpy(sent[k].token, token, sizeof(token));
+    sent[k].to = to;
+    sent[k].slot = slot;
+    sent[k].gen = gen;
+    sent[k].tries = 1;
+    sent[k].due = nowMs() + REDIR_RETRY;
+    nHanded++;
+    return 0;
+}
+
+int redirTimeout(void) {
+    uint64_t now = nowMs(), due = 0;
+    int k;
+
+    for (k = 0; k < REDIR_SESSIONS; k++) {
+        if (sent[k].token[0] != '\0' && (due == 0 || sent[k].due < due)) {
+            due = sent[k].due;
+        }
+    }
+    return due == 0 ? -1 : due <= now ? 0 : (int)(due - now);
+}
+
+/* sends again what was not answered in time, gives up after REDIR_TRIES */
+void redirTick(void) {
+    uint64_t now = nowMs();
+    int k;
+
+    for (k = 0; k < REDIR_SESSIONS; k++) {
+        if (sent[k].token[0] == '\0' || sent[k].due > now) {
+            continue;
+        }
+        if (sent[k].tries < REDIR_TRIES) {
+            nodeSend(sent[k].to, "%s", sent[k].line);
+            sent[k].tries++;
+            sent[k].due = now + (uint64_t)REDIR_RETRY * sent[k].tries;
+        } else {
+            ops.ready(ops.arg, sent[k].slot, sent[k].gen, sent[k].to, NULL);
+            sent[k].token[0] = '\0';
+            nLost++;
+        }
+    }
+}
+
+int redirResume(const char *token, struct redirSession *s) {
+    int k;
+
+    for (k = 0; k < REDIR_SESSIONS; k++) {
+        if (held[k].until >= time(NULL) && !held[k].used &&
+            strcmp(held[k].token, token) == 0) {
+            *s = held[k].s;
+            held[k].used = 1;
+            nResumed++;
+            return 0;
+        }
+    }
+    nUnknown++;
+    return -1;
+}
+
+void redirReport(char *buf, size_t len) {
+    if (!on) {
+        snprintf(buf, len, "S: redirection off\n");
+        return;
+    }
+    snprintf(buf, len,
+             "S: redirection load %d%% high %d%% reports %lu handed %lu "
+             "unanswered %lu resumed %lu unknown %lu\n",
+             myLoad, high, nReports, nHanded, nLost, nResumed, nUnknown);
+}
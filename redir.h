@@ -0,0 +1,87 @@
+/* *
+ * Name: redir.h                                                    *
+ *                                                                  *
+ * Description: load-aware redirection include file                 *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+
+#ifndef __REDIR_H
+#define __REDIR_H
+
+#include <stddef.h>
+
+#define CMD_RESUME "/resume "
+#define REDIR_SESSION "S: session " /* <id>, sent once when a client joins */
+#define REDIR_LINE "S: redirect " /* <host> <port> <token> <jitter ms> <id> */
+#define REDIR_RESUMED "S: resumed as "
+#define REDIR_UNKNOWN "S: no such session"
+#define REDIR_EVERY 1       /* seconds between load reports */
+#define REDIR_HIGH 80       /* percent load from which clients are moved */
+#define REDIR_GAP 30        /* points a target must be below this server */
+#define REDIR_JITTER 2000   /* ms clients spread their reconnects over */
+#define REDIR_STALE 3       /* seconds a load report is believed */
+#define REDIR_HOLD 30       /* seconds a handed over session waits */
+#define REDIR_SESSIONS 64
+#define REDIR_TOKEN 17      /* 16 hex digits */
+#define REDIR_RETRY 250     /* ms before sending a session again */
+#define REDIR_TRIES 4       /* sends of a session before giving up */
+#define REDIR_WAIT 5        /* seconds a client waits to be resumed */
+
+/*
+ * Servers report their load, the larger of connected clients and busy
+ * time as a percentage, to each other every REDIR_EVERY seconds. A
+ * server at REDIR_HIGH or more moves clients to the least loaded server
+ * at least REDIR_GAP below it, enough to close half the gap and then
+ * counting them against that server until it reports again. A moved
+ * client's nick, room and flags go ahead to the target under a random
+ * token, sent again until the target answers. Only then is the client
+ * told REDIR_LINE; it waits a random part of the jitter, connects there,
+ * sends CMD_RESUME with the token and, once REDIR_RESUMED comes back,
+ * leaves the old server, reading its connection to the end. The client
+ * follows only a redirect at the start of a server line that quotes the
+ * REDIR_SESSION id it was given privately when it joined. Rooms are not
+ * shared between servers, so only clients alone in their room move.
+ */
+
+enum { REDIR_QUIET = 1, REDIR_AUTHED = 2, REDIR_MCAST = 4 };
+
+struct redirSession {
+    char nick[32];
+    char room[32];
+    int flags;
+};
+
+struct redirOps {
+    /* the target holds the session of slot, or never answered: no token */
+    void (*ready)(void *arg, int slot, unsigned gen, int to,
+                  const char *token);
+    void *arg;
+};
+
+void redirInit(int capacity, int high, const struct redirOps *ops);
+int redirOn(void);
+void redirBusy(long us);
+int redirPlan(int clients, int *count);
+int redirHandoff(int to, const struct redirSession *s, int slot,
+                 unsigned gen);
+int redirTimeout(void);
+void redirTick(void);
+int redirResume(const char *token, struct redirSession *s);
+void redirReport(char *buf, size_t len);
+
+#endif
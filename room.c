@@ -0,0 +1,129 @@
+/* *
+ * Name: room.c                                                     *
+ *                                                                  *
+ * Description: chat rooms table                                    *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "room.h"
+#include "history.h"
+#include "mcast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int nRoom = 0;
+static struct room *roomTable[ROOM_BUCKETS];
+
+/* rooms are keyed by their interned name, so lookups compare integers */
+static unsigned roomHash(intern_t name) {
+    return (name * 2654435761u) % ROOM_BUCKETS;
+}
+
+/* an ephemeral room still empty when its grace period ends goes away */
+static void roomGc(void *arg) {
+    struct room *r = arg;
+    struct room **p;
+
+    if (r->members > 0) {
+        return;
+    }
+    for (p = &roomTable[roomHash(r->name)]; *p != NULL; p = &(*p)->next) {
+        if (*p == r) {
+            *p = r->next;
+            break;
+        }
+    }
+    printf("S: ephemeral room %s expired\n", roomName(r));
+    histDrop(r);
+    mcastDrop(r);
+    timerCancel(&r->gc);
+    internPut(r->name);
+    bitmapFree(&r->member);
+    nRoom--;
+    free(r);
+}
+
+struct room *roomGet(const char *name, int create, int ttl) {
+    intern_t id = internFind(name);
+    unsigned h = roomHash(id);
+    struct room *r;
+
+    for (r = roomTable[h]; id != 0 && r != NULL; r = r->next) {
+        if (r->name == id) {
+            return r;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    if ((r = calloc(1, sizeof(*r))) == NULL) {
+        perror("S: roomGet calloc error");
+        return NULL;
+    }
+    if ((r->name = internGet(name)) == 0) {
+        free(r);
+        return NULL;
+    }
+    h = roomHash(r->name);
+    r->ttl = ttl;
+    r->logfd = -1;
+    r->gc.fire = roomGc;
+    r->gc.arg = r;
+    r->expiry.fire = histCompact;
+    r->expiry.arg = r;
+    r->next = roomTable[h];
+    roomTable[h] = r;
+    nRoom++;
+    return r;
+}
+
+/* walks every room in table order, starting from NULL */
+struct room *roomNext(struct room *r) {
+    unsigned h = 0;
+
+    if (r != NULL) {
+        if (r->next != NULL) {
+            return r->next;
+        }
+        h = roomHash(r->name) + 1;
+    }
+    for (; h < ROOM_BUCKETS; h++) {
+        if (roomTable[h] != NULL) {
+            return roomTable[h];
+        }
+    }
+    return NULL;
+}
+
+const char *roomName(const struct room *r) { return internStr(r->name); }
+
+void roomEnter(struct room *r, int id) {
+    bitmapAdd(&r->member, id);
+    r->members++;
+    timerCancel(&r->gc);
+}
+
+void roomLeave(struct room *r, int id) {
+    bitmapRemove(&r->member, id);
+    if (--r->members == 0) {
+        histRelease(r);
+        if (r->ttl > 0) {
+            timerArm(&r->gc, time(NULL) + r->ttl);
+        }
+    }
+}
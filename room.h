@@ -0,0 +1,56 @@
+/* *
+ * Name: room.h                                                     *
+ *                                                                  *
+ * Description: chat rooms include file                             *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __ROOM_H
+#define __ROOM_H
+
+#include "timer.h"
+#include "intern.h"
+#include "bitmap.h"
+
+#define MAXROOM 32
+#define ROOM_DEFAULT "lobby"
+#define ROOM_BUCKETS 4096
+
+struct histCache;
+struct mcastRing;
+
+struct room {
+    intern_t name;
+    struct room *next;       /* hash chain */
+    int members;             /* connected clients in the room */
+    struct bitmap member;    /* their connection ids */
+    int ttl;                 /* seconds, 0 for a permanent room */
+    int logfd;               /* on-disk history, -1 when closed */
+    struct histCache *hist;  /* hot history, NULL when cold */
+    struct mcastRing *mcast; /* multicast sequence and repair ring */
+    struct timer gc;         /* reclaims an empty ephemeral room */
+    struct timer expiry;     /* next expiring message, drives compaction */
+};
+
+extern int nRoom;
+
+struct room *roomGet(const char *name, int create, int ttl);
+void roomEnter(struct room *r, int id);
+void roomLeave(struct room *r, int id);
+const char *roomName(const struct room *r);
+struct room *roomNext(struct room *r);
+
+#endif
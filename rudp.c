@@ -0,0 +1,579 @@
+/* *
+ * Name: rudp.c                                                     *
+ *                                                                  *
+ * Description: reliable UDP transport, selective acks              *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "rudp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Each chat line travels in a numbered segment that the receiver hands
+ * up as soon as it arrives, even when earlier ones are still missing, so
+ * one lost datagram delays only its own lines instead of everything
+ * behind it as with TCP. Segments are cut at line boundaries to keep
+ * that safe. The receiver acks every data segment with the cumulative
+ * point plus a bitmap of the 32 segments after it; the sender resends a
+ * segment once three later ones are acked, or when its timer expires,
+ * and paces new segments with a Reno style congestion window.
+ *
+ * A connection is a connected UDP socket sharing the listening port,
+ * which the kernel prefers for that peer's datagrams, so every client
+ * keeps a descriptor of its own for select() and the per-fd tables.
+ */
+
+struct rudpSeg {
+    uint32_t seq;
+    uint16_t len;
+    uint8_t tries;  /* transmissions so far */
+    uint8_t sacked; /* arrived, out of order */
+    uint64_t sent;  /* ms, last transmission */
+    char data[RUDP_MSS];
+};
+
+struct rudpConn {
+    int sd;
+    int dead;             /* gave up on the peer */
+    struct rudpConn *next;
+    // send side
+    uint32_t una;         /* oldest unacknowledged segment */
+    uint32_t nxt;         /* next segment to transmit */
+    uint32_t end;         /* next segment to queue */
+    uint32_t recover;     /* end of the current loss episode */
+    double cwnd;          /* segments */
+    double ssthresh;
+    int srtt, rttvar, rto; /* ms */
+    uint64_t rtoAt;       /* retransmission deadline, 0 when idle */
+    uint64_t synAt;       /* accepted: deadline for the peer's first reply */
+    struct rudpSeg q[RUDP_QUEUE];
+    // receive side
+    uint32_t rcvNxt;      /* every segment below this was delivered */
+    uint64_t rcvMask;     /* bit k: rcvNxt + k delivered */
+    size_t pendOff, pendLen;
+    char pend[RUDP_MSS];  /* rest of a segment larger than the reader */
+};
+
+static struct rudpConn *conn[FD_SETSIZE];
+static struct rudpConn *active; /* every connection, for the timers */
+
+/* statistics */
+static unsigned long nSegs, nRto, nFast, nDup, nEarly, nDead, nHalf;
+
+static uint64_t nowMs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct rudpConn *get(int sd) {
+    return (sd >= 0 && sd < FD_SETSIZE) ? conn[sd] : NULL;
+}
+
+static int attach(int sd) {
+    struct rudpConn *c;
+
+    if (sd >= FD_SETSIZE || (c = calloc(1, sizeof(*c))) == NULL) {
+        return -1;
+    }
+    c->sd = sd;
+    c->una = c->nxt = c->end = c->rcvNxt = 1;
+    c->cwnd = 4;
+    c->ssthresh = RUDP_WND;
+    c->rto = RUDP_RTO_INIT;
+    c->next = active;
+    active = c;
+    conn[sd] = c;
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+static void control(int sd, int type, const struct rudpConn *c) {
+    struct rudpHdr h;
+
+    memset(&h, 0, sizeof(h));
+    h.type = (uint8_t)type;
+    if (c != NULL) {
+        h.ack = htonl(c->rcvNxt);
+        h.sack = htonl((uint32_t)(c->rcvMask >> 1));
+    }
+    send(sd, &h, sizeof(h), 0);
+}
+
+static void transmit(struct rudpConn *c, struct rudpSeg *s, uint64_t now) {
+    struct rudpHdr h;
+    struct iovec iov[2];
+
+    memset(&h, 0, sizeof(h));
+    h.type = RUDP_DATA;
+    h.len = htons(s->len);
+    h.seq = htonl(s->seq);
+    h.ack = htonl(c->rcvNxt);
+    h.sack = htonl((uint32_t)(c->rcvMask >> 1));
+    iov[0].iov_base = &h;
+    iov[0].iov_len = sizeof(h);
+    iov[1].iov_base = s->data;
+    iov[1].iov_len = s->len;
+    // A datagram the kernel refuses is just a loss, the timer covers it
+    writev(c->sd, iov, 2);
+    s->tries++;
+    s->sent = now;
+    nSegs++;
+    if (c->rtoAt == 0) {
+        c->rtoAt = now + c->rto;
+    }
+}
+
+/* new segments, as far as the congestion window allows */
+static void pump(struct rudpConn *c) {
+    uint64_t now = nowMs();
+    uint32_t wnd = c->cwnd < RUDP_WND ? (uint32_t)c->cwnd : RUDP_WND;
+
+    while (c->nxt != c->end && c->nxt - c->una < wnd) {
+        transmit(c, &c->q[c->nxt % RUDP_QUEUE], now);
+        c->nxt++;
+    }
+}
+
+/* a loss ends the slow start and halves the window, once per episode */
+static void congestion(struct rudpConn *c, int timeout) {
+    if (timeout || c->una >= c->recover) {
+        c->ssthresh = (c->nxt - c->una) / 2.0;
+        if (c->ssthresh < 2) {
+            c->ssthresh = 2;
+        }
+        c->cwnd = timeout ? 1 : c->ssthresh;
+        c->recover = c->nxt;
+    }
+}
+
+/* Karn: only a segment sent once, on its first ack, times the path */
+static void sample(struct rudpConn *c, const struct rudpSeg *s, uint64_t now) {
+    int rtt = (int)(now - s->sent);
+
+    if (s->tries != 1 || s->sacked) {
+        return;
+    }
+    if (c->srtt == 0) {
+        c->srtt = rtt;
+        c->rttvar = rtt / 2;
+    } else {
+        c->rttvar += (abs(c->srtt - rtt) - c->rttvar) / 4;
+        c->srtt += (rtt - c->srtt) / 8;
+    }
+    c->rto = c->srtt + 4 * c->rttvar;
+    c->rto = c->rto < RUDP_RTO_MIN ? RUDP_RTO_MIN
+             : c->rto > RUDP_RTO_MAX ? RUDP_RTO_MAX : c->rto;
+}
+
+static void acked(struct rudpConn *c, uint32_t ack, uint32_t sack) {
+    uint64_t now = nowMs();
+    struct rudpSeg *s;
+    uint32_t seq, above, thresh, una = c->una;
+    int k;
+
+    if (ack > c->nxt || ack < c->una) {
+        return; // stale, or not something we sent
+    }
+    for (; c->una < ack; c->una++) {
+        sample(c, &c->q[c->una % RUDP_QUEUE], now);
+        c->cwnd += c->cwnd < c->ssthresh ? 1 : 1 / c->cwnd;
+    }
+    for (k = 0; k < 32; k++) {
+        seq = ack + 1 + k;
+        if ((sack >> k & 1) && seq < c->nxt) {
+            s = &c->q[seq % RUDP_QUEUE];
+            sample(c, s, now);
+            s->sacked = 1;
+        }
+    }
+    // Anything with RUDP_DUPTHRESH acked segments above it is lost, or
+    // fewer when fewer are in flight (early retransmit, RFC 5827)
+    thresh = c->nxt - c->una - 1;
+    thresh = thresh > RUDP_DUPTHRESH ? RUDP_DUPTHRESH : thresh < 1 ? 1 : thresh;
+    above = 0;
+    for (seq = c->nxt; seq-- > c->una;) {
+        s = &c->q[seq % RUDP_QUEUE];
+        if (s->sacked) {
+            above++;
+        } else if (above >= thresh && s->tries == 1) {
+            congestion(c, 0);
+            transmit(c, s, now);
+            nFast++;
+        }
+    }
+    // The timer restarts on progress only, so a lost head still times out
+    if (c->una == c->nxt) {
+        c->rtoAt = 0;
+    } else if (c->una != una) {
+        c->rtoAt = now + c->rto;
+    }
+    pump(c);
+}
+
+/* one datagram in; fills buf and returns its length when it was data */
+static ssize_t input(struct rudpConn *c, const char *pkt, ssize_t n,
+                     void *buf, size_t len) {
+    const struct rudpHdr *h = (const struct rudpHdr *)pkt;
+    uint32_t seq, bit;
+    size_t dlen;
+
+    if (n < (ssize_t)sizeof(*h)) {
+        return -1;
+    }
+    if (h->type != RUDP_SYN) {
+        c->synAt = 0; // the peer heard our SYN, it is no spoofed address
+    }
+    switch (h->type) {
+    case RUDP_SYN:
+        control(c->sd, RUDP_SYN, c); // our answer was lost, say it again
+        return -1;
+    case RUDP_FIN:
+        return 0;
+    case RUDP_ACK:
+        acked(c, ntohl(h->ack), ntohl(h->sack));
+        return -1;
+    case RUDP_DATA:
+        break;
+    default:
+        return -1;
+    }
+    acked(c, ntohl(h->ack), ntohl(h->sack));
+    seq = ntohl(h->seq);
+    dlen = ntohs(h->len);
+    if (dlen > (size_t)n - sizeof(*h) || dlen > RUDP_MSS ||
+        seq - c->rcvNxt >= 64) {
+        control(c->sd, RUDP_ACK, c); // duplicate or beyond the window
+        nDup += seq < c->rcvNxt;
+        return -1;
+    }
+    bit = seq - c->rcvNxt;
+    if (c->rcvMask >> bit & 1) {
+        control(c->sd, RUDP_ACK, c);
+        nDup++;
+        return -1;
+    }
+    nEarly += bit > 0;
+    c->rcvMask |= 1ull << bit;
+    while (c->rcvMask & 1) {
+        c->rcvMask >>= 1;
+        c->rcvNxt++;
+    }
+    control(c->sd, RUDP_ACK, c);
+    // Delivered at once, whatever is still missing before it
+    if (dlen > len) {
+        memcpy(c->pend, pkt + sizeof(*h) + len, dlen - len);
+        c->pendOff = 0;
+        c->pendLen = dlen - len;
+        dlen = len;
+    }
+    memcpy(buf, pkt + sizeof(*h), dlen);
+    return (ssize_t)dlen;
+}
+
+int rudpListen(int port) {
+    struct sockaddr_in addr;
+    int sd, on = 1;
+
+    if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("S: rudp socket error");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("S: rudp bind error");
+        close(sd);
+        return -1;
+    }
+    fcntl(sd, F_SETFL, O_NONBLOCK);
+    return sd;
+}
+
+/* a SYN on the listening socket: a connected socket for that peer */
+int rudpAccept(int sd) {
+    struct sockaddr_in local, peer;
+    socklen_t llen = sizeof(local), plen = sizeof(peer);
+    struct rudpHdr h;
+    int nd, on = 1;
+
+    if (recvfrom(sd, &h, sizeof(h), 0, (struct sockaddr *)&peer, &plen) <
+        (ssize_t)sizeof(h)) {
+        return -1;
+    }
+    if (h.type != RUDP_SYN) {
+        errno = EAGAIN; // left over from a connection already gone
+        return -1;
+    }
+    if ((nd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        getsockname(sd, (struct sockaddr *)&local, &llen) < 0 ||
+        setsockopt(nd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(nd, (struct sockaddr *)&local, llen) < 0 ||
+        connect(nd, (struct sockaddr *)&peer, plen) < 0 || attach(nd) < 0) {
+        if (nd >= 0) {
+            close(nd);
+        }
+        return -1;
+    }
+    // Until the peer answers, the slot only lasts RUDP_HANDSHAKE
+    conn[nd]->synAt = nowMs() + RUDP_HANDSHAKE;
+    control(nd, RUDP_SYN, conn[nd]);
+    return nd;
+}
+
+/* client side, on a connected UDP socket: SYN until the server answers */
+int rudpConnect(int sd) {
+    struct pollfd p;
+    struct rudpHdr h;
+    int tries, wait = RUDP_RTO_INIT;
+
+    if (attach(sd) < 0) {
+        return -1;
+    }
+    p.fd = sd;
+    p.events = POLLIN;
+    for (tries = 0; tries < RUDP_TRIES; tries++, wait *= 2) {
+        control(sd, RUDP_SYN, NULL);
+        if (poll(&p, 1, wait) > 0 && recv(sd, &h, sizeof(h), 0) > 0 &&
+            h.type == RUDP_SYN) {
+            return 0;
+        }
+    }
+    rudpClose(sd);
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+void rudpClose(int sd) {
+    struct rudpConn *c = get(sd), **p;
+
+    if (c == NULL) {
+        return;
+    }
+    if (!c->dead) {
+        control(sd, RUDP_FIN, c); // best effort, the peer times out anyway
+    }
+    for (p = &active; *p != NULL; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    conn[sd] = NULL;
+    free(c);
+}
+
+int rudpIs(int sd) { return get(sd) != NULL; }
+
+int rudpPending(int sd) {
+    struct rudpConn *c = get(sd);
+
+    return c != NULL && c->pendLen > 0;
+}
+
+int rudpDead(int sd) {
+    struct rudpConn *c = get(sd);
+
+    return c != NULL && c->dead;
+}
+
+ssize_t rudpRecv(int sd, void *buf, size_t len) {
+    struct rudpConn *c = get(sd);
+    char pkt[sizeof(struct rudpHdr) + RUDP_MSS];
+    ssize_t n, got;
+
+    if (c == NULL) {
+        return recv(sd, buf, len, 0);
+    }
+    if (c->dead) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (c->pendLen > 0) {
+        n = c->pendLen < len ? c->pendLen : len;
+        memcpy(buf, c->pend + c->pendOff, n);
+        c->pendOff += n;
+        c->pendLen -= n;
+        return n;
+    }
+    // Acks and duplicates are consumed here, up to the first new data
+    while ((n = recv(sd, pkt, sizeof(pkt), MSG_DONTWAIT)) >= 0) {
+        if ((got = input(c, pkt, n, buf, len)) >= 0) {
+            return got;
+        }
+    }
+    if (errno == ECONNREFUSED) {
+        return 0; // the peer's port is closed
+    }
+    return -1;
+}
+
+ssize_t rudpWritev(int sd, const struct iovec *iov, int n) {
+    struct rudpConn *c = get(sd);
+    struct rudpSeg *s, *t;
+    size_t total = 0, off, take, keep;
+    int k, reopen;
+
+    if (c == NULL) {
+        return writev(sd, iov, n);
+    }
+    if (c->dead) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    for (k = 0; k < n; k++) {
+        total += iov[k].iov_len;
+    }
+    // Lines still waiting for the window ride in the last queued segment
+    reopen = c->end != c->nxt;
+    s = &c->q[(c->end - reopen) % RUDP_QUEUE];
+    if (!reopen) {
+        s->len = 0;
+    }
+    // Segments are at least half full, which bounds how many it takes
+    if (RUDP_QUEUE - (c->end - reopen - c->una) <
+        2 * (total + s->len) / RUDP_MSS + 1) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    c->end -= reopen;
+    for (k = 0; k < n; k++) {
+        for (off = 0; off < iov[k].iov_len; off += take) {
+            take = iov[k].iov_len - off;
+            if (take > (size_t)(RUDP_MSS - s->len)) {
+                take = RUDP_MSS - s->len;
+            }
+            memcpy(s->data + s->len, (const char *)iov[k].iov_base + off,
+                   take);
+            s->len += take;
+            if (s->len < RUDP_MSS) {
+                continue;
+            }
+            // Full: close it after its last complete line
+            for (keep = RUDP_MSS; keep > RUDP_MSS / 2; keep--) {
+                if (s->data[keep - 1] == '\n') {
+                    break;
+                }
+            }
+            if (keep == RUDP_MSS / 2) {
+                keep = RUDP_MSS; // one long line, split it
+            }
+            s->seq = c->end++;
+            s->tries = s->sacked = 0;
+            t = &c->q[c->end % RUDP_QUEUE];
+            t->len = RUDP_MSS - keep;
+            memcpy(t->data, s->data + keep, t->len);
+            s->len = keep;
+            s = t;
+        }
+    }
+    if (s->len > 0) {
+        s->seq = c->end++;
+        s->tries = s->sacked = 0;
+    }
+    pump(c);
+    return (ssize_t)total;
+}
+
+ssize_t rudpSend(int sd, const void *buf, size_t len) {
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    return rudpWritev(sd, &iov, 1);
+}
+
+/* ms until the next retransmission or handshake deadline, -1 for none */
+int rudpTimeout(void) {
+    uint64_t now = nowMs(), first = 0;
+    struct rudpConn *c;
+
+    for (c = active; c != NULL; c = c->next) {
+        if (c->rtoAt != 0 && (first == 0 || c->rtoAt < first)) {
+            first = c->rtoAt;
+        }
+        if (c->synAt != 0 && !c->dead && (first == 0 || c->synAt < first)) {
+            first = c->synAt;
+        }
+    }
+    return first == 0 ? -1 : first <= now ? 0 : (int)(first - now);
+}
+
+/* expired timers: resend the oldest missing segment, back off */
+void rudpTick(void) {
+    uint64_t now = nowMs();
+    struct rudpConn *c;
+    struct rudpSeg *s;
+    uint32_t seq;
+
+    for (c = active; c != NULL; c = c->next) {
+        if (!c->dead && c->synAt != 0 && c->synAt <= now) {
+            // Half open: a SYN from an address that never replied
+            c->dead = 1;
+            c->rtoAt = 0;
+            nHalf++;
+        }
+        if (c->dead || c->rtoAt == 0 || c->rtoAt > now) {
+            continue;
+        }
+        for (seq = c->una; seq != c->nxt; seq++) {
+            if (!(s = &c->q[seq % RUDP_QUEUE])->sacked) {
+                break;
+            }
+        }
+        if (seq == c->nxt || s->tries >= RUDP_TRIES) {
+            c->dead = seq != c->nxt;
+            nDead += c->dead;
+            c->rtoAt = 0;
+            continue;
+        }
+        congestion(c, 1);
+        c->rto = c->rto * 2 > RUDP_RTO_MAX ? RUDP_RTO_MAX : c->rto * 2;
+        c->rtoAt = 0;
+        transmit(c, s, now);
+        nRto++;
+    }
+}
+
+void rudpReport(char *buf, size_t len) {
+    struct rudpConn *c;
+    int n = 0, srtt = 0;
+
+    for (c = active; c != NULL; c = c->next, n++) {
+        srtt += c->srtt;
+    }
+    snprintf(buf, len,
+             "S: rudp connections %d avg srtt %d ms segments %lu resent "
+             "%lu timeout %lu fast, duplicates %lu early %lu dead %lu "
+             "half open %lu\n",
+             n, n ? srtt / n : 0, nSegs, nRto, nFast, nDup, nEarly, nDead,
+             nHalf);
+}
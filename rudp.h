@@ -0,0 +1,66 @@
+/* *
+ * Name: rudp.h                                                     *
+ *                                                                  *
+ * Description: reliable UDP transport include file                 *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __RUDP_H
+#define __RUDP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define RUDP_PORT 5903
+#define RUDP_MSS 1200      /* payload bytes per datagram */
+#define RUDP_WND 64        /* segments in flight, and the receive window */
+#define RUDP_QUEUE 256     /* segments buffered per connection */
+#define RUDP_RTO_INIT 500  /* ms, before the first RTT sample */
+#define RUDP_RTO_MIN 50    /* ms */
+#define RUDP_RTO_MAX 8000  /* ms */
+#define RUDP_TRIES 10      /* transmissions of a segment before giving up */
+#define RUDP_DUPTHRESH 3   /* later segments acked before a loss is assumed */
+#define RUDP_HANDSHAKE 5000 /* ms an accepted peer has to send anything */
+
+enum { RUDP_SYN = 1, RUDP_DATA, RUDP_ACK, RUDP_FIN };
+
+/* datagram header, integers big endian */
+struct rudpHdr {
+    uint8_t type;
+    uint8_t pad;
+    uint16_t len;  /* payload bytes */
+    uint32_t seq;  /* DATA: segment number, from 1 */
+    uint32_t ack;  /* every segment below this has arrived */
+    uint32_t sack; /* bit k: segment ack + 1 + k has arrived too */
+};
+
+int rudpListen(int port);
+int rudpAccept(int sd);
+int rudpConnect(int sd);
+void rudpClose(int sd);
+int rudpIs(int sd);
+int rudpPending(int sd);
+int rudpDead(int sd);
+ssize_t rudpRecv(int sd, void *buf, size_t len);
+ssize_t rudpWritev(int sd, const struct iovec *iov, int n);
+ssize_t rudpSend(int sd, const void *buf, size_t len);
+int rudpTimeout(void);
+void rudpTick(void);
+void rudpReport(char *buf, size_t len);
+
+#endif
@@ -0,0 +1,165 @@
+/* *
+ * Name: scan.c                                                     *
+ *                                                                  *
+ * Description: receive path scanner, UTF-8 and line framing        *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "scan.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * One pass over freshly received bytes does three jobs: it checks the
+ * UTF-8 encoding, drops control bytes other than tab and newline, and
+ * remembers where the last newline is so the caller can cut complete
+ * lines. Chat text is overwhelmingly ASCII, so 16 bytes are examined
+ * at a time and a block with no high bit and no control byte other
+ * than newline is taken whole; anything else goes through the scalar
+ * decoder one character at a time. Output is compacted in place, it
+ * never grows: every byte of an invalid sequence becomes SCAN_BAD.
+ */
+
+struct scanStats scanStat;
+
+/* length of the valid sequence at s, 0 if invalid, -1 if cut short */
+static int utf8Len(const unsigned char *s, size_t avail) {
+    unsigned char lo = 0x80, hi = 0xbf;
+    int n, k;
+
+    if (s[0] < 0x80) {
+        return 1;
+    } else if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        n = 2;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        n = 3;
+        if (s[0] == 0xe0) {
+            lo = 0xa0; // overlong
+        } else if (s[0] == 0xed) {
+            hi = 0x9f; // surrogates
+        }
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        n = 4;
+        if (s[0] == 0xf0) {
+            lo = 0x90; // overlong
+        } else if (s[0] == 0xf4) {
+            hi = 0x8f; // above U+10FFFF
+        }
+    } else {
+        return 0;
+    }
+    for (k = 1; k < n; k++) {
+        if ((size_t)k >= avail) {
+            return -1;
+        }
+        if (s[k] < lo || s[k] > hi) {
+            return 0;
+        }
+        lo = 0x80;
+        hi = 0xbf;
+    }
+    return n;
+}
+
+static int allowed(unsigned char c) {
+    return (c >= 0x20 && c != 0x7f) || c == '\n' || c == '\t';
+}
+
+size_t scanClean(char *buf, size_t from, size_t *len, int final,
+                 size_t *lastNl) {
+    unsigned char *p = (unsigned char *)buf;
+    size_t src = from, dst = from, end = *len;
+    size_t slow = from; // no block attempts before this offset
+    struct timespec t0, t1;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (src < end) {
+#if defined(__SSE2__)
+        if (src >= slow && end - src >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + src));
+            // High bit bytes compare as negative, so they count as < 0x20
+            int ctl = _mm_movemask_epi8(
+                _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f))));
+            int nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+
+            if ((ctl & ~nl) == 0) {
+                if (dst != src) {
+                    _mm_storeu_si128((__m128i *)(p + dst), v);
+                }
+                if (nl != 0) {
+                    *lastNl = dst + 31 - __builtin_clz(nl);
+                }
+                src += 16;
+                dst += 16;
+                continue;
+            }
+            slow = src + 16; // finish this block one character at a time
+        }
+#endif
+        if (p[src] < 0x80) {
+            if (allowed(p[src])) {
+                if (p[src] == '\n') {
+                    *lastNl = dst;
+                }
+                p[dst++] = p[src];
+            } else {
+                scanStat.stripped++;
+            }
+            src++;
+        } else if ((n = utf8Len(p + src, end - src)) > 0) {
+            if (dst == src) {
+                src += n;
+                dst += n;
+            } else {
+                while (n-- > 0) {
+                    p[dst++] = p[src++];
+                }
+            }
+        } else if (n < 0 && !final) {
+            break; // rest of the character is still in flight
+        } else {
+            p[dst++] = SCAN_BAD;
+            src++;
+            scanStat.invalid++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    scanStat.bytes += src - from;
+    scanStat.ns += (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec -
+                   t0.tv_nsec;
+
+    // Keep the incomplete tail right after the checked bytes
+    if (src < end) {
+        memmove(p + dst, p + src, end - src);
+    }
+    *len = dst + (end - src);
+    return dst;
+}
+
+void scanReport(char *buf, size_t len) {
+    snprintf(buf, len,
+             "S: scan %llu bytes %.2f GB/s invalid %lu stripped %lu\n",
+             scanStat.bytes,
+             scanStat.ns ? (double)scanStat.bytes / scanStat.ns : 0.0,
+             scanStat.invalid, scanStat.stripped);
+}
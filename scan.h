@@ -0,0 +1,41 @@
+/* *
+ * Name: scan.h                                                     *
+ *                                                                  *
+ * Description: receive path scanner include file                   *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __SCAN_H
+#define __SCAN_H
+
+#include <stddef.h>
+
+#define SCAN_BAD '?' /* replaces each byte of an invalid UTF-8 sequence */
+
+struct scanStats {
+    unsigned long long bytes; /* bytes scanned */
+    unsigned long long ns;    /* time spent scanning */
+    unsigned long invalid;    /* bytes replaced by SCAN_BAD */
+    unsigned long stripped;   /* control bytes removed */
+};
+
+extern struct scanStats scanStat;
+
+size_t scanClean(char *buf, size_t from, size_t *len, int final,
+                 size_t *lastNl);
+void scanReport(char *buf, size_t len);
+
+#endif
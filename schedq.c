@@ -0,0 +1,434 @@
+/* *
+ * Name: schedq.c                                                   *
+ *                                                                  *
+ * Description: scheduled messages, persistent min-heap             *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "schedq.h"
+#include "chat.h"
+#include "room.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/*
+ * The heap array itself is a shared mapping of SCHED_HEAP, so pending
+ * messages survive a restart without any serialization step. Entries
+ * are 16 bytes (due time and body offset) which keeps sifting cheap
+ * with millions of them; ties are broken by offset so messages due in
+ * the same second keep their submission order.
+ *
+ * Fired bodies stay in SCHED_DATA as dead bytes, flagged in their
+ * length word. Once they pass SCHED_COMPACT and outweigh the live ones
+ * the live bodies are copied, a slice per loop pass, to the other body
+ * file of the pair (SCHED_DATA or SCHED_DATA.1). Copying in offset
+ * order keeps that order, and so the heap, intact. When the copy has
+ * caught up, a heap image with the new offsets and the other file's
+ * generation is written and renamed over SCHED_HEAP; a crash on either
+ * side of the rename leaves a heap and a body file that agree.
+ */
+
+#define SCHED_MINCAP 1024
+#define SCHED_SLICE 65536       /* body bytes looked at per copy pass */
+#define SCHED_FIRED 0x80000000u /* length flag of a delivered body */
+
+struct schedRec {
+    uint32_t len;
+    char room[MAXROOM];
+};
+
+unsigned long schedFired = 0, schedCompacted = 0;
+
+static int heapFd = -1;
+static int dataFd = -1;
+static struct schedHeader *hdr;
+static struct schedEntry *heap;
+static char heapName[256], dataName[256];
+static uint64_t dataEnd; /* size of the current body file */
+static uint64_t dead;    /* bytes of fired records in it */
+
+/* where an old body went in the copy, kept in old offset order */
+struct move {
+    uint64_t off;
+    uint64_t to;
+};
+
+static struct {
+    int fd; /* the other body file, -1 when no copy runs */
+    uint64_t pos, at, dead;
+    struct move *m;
+    size_t n, cap;
+} job = {-1, 0, 0, 0, NULL, 0, 0};
+
+static size_t heapSize(uint64_t cap) {
+    return sizeof(struct schedHeader) + cap * sizeof(struct schedEntry);
+}
+
+static int heapMap(uint64_t cap) {
+    void *p;
+
+    if (ftruncate(heapFd, heapSize(cap)) < 0) {
+        perror("S: sched ftruncate error");
+        return -1;
+    }
+    p = mmap(NULL, heapSize(cap), PROT_READ | PROT_WRITE, MAP_SHARED,
+             heapFd, 0);
+    if (p == MAP_FAILED) {
+        perror("S: sched mmap error");
+        return -1;
+    }
+    if (hdr != NULL) {
+        munmap(hdr, heapSize(hdr->cap));
+    }
+    hdr = p;
+    heap = (struct schedEntry *)(hdr + 1);
+    hdr->cap = cap;
+    return 0;
+}
+
+/* body file of a generation: the two alternate */
+static const char *bodyPath(uint32_t gen) {
+    static char name[sizeof(dataName) + 2];
+
+    snprintf(name, sizeof(name), "%s%s", dataName, gen & 1 ? ".1" : "");
+    return name;
+}
+
+/* header plus body, 0 when the record cannot be read */
+static uint64_t recSize(uint64_t off) {
+    uint32_t len;
+
+    if (pread(dataFd, &len, sizeof(len), off) != sizeof(len)) {
+        return 0;
+    }
+    return sizeof(struct schedRec) + (len & ~SCHED_FIRED);
+}
+
+int schedInit(const char *heapPath, const char *dataPath) {
+    struct schedHeader h;
+    struct stat st;
+    uint64_t k, live = 0;
+    int fresh;
+
+    snprintf(heapName, sizeof(heapName), "%s", heapPath);
+    snprintf(dataName, sizeof(dataName), "%s", dataPath);
+    heapFd = open(heapPath, O_RDWR | O_CREAT, 0600);
+    if (heapFd < 0 || fstat(heapFd, &st) < 0) {
+        perror("S: schedInit open error");
+        return -1;
+    }
+    fresh = !((size_t)st.st_size >= sizeof(h) &&
+              pread(heapFd, &h, sizeof(h), 0) == sizeof(h) &&
+              h.magic == SCHED_MAGIC && h.count <= h.cap &&
+              (size_t)st.st_size >= heapSize(h.cap));
+    if (fresh) {
+        h.gen = 0;
+    }
+    // A copy cut short by a crash leaves the other file behind
+    unlink(bodyPath(h.gen + 1));
+    dataFd = open(bodyPath(h.gen), O_RDWR | O_CREAT, 0600);
+    if (dataFd < 0 || fstat(dataFd, &st) < 0) {
+        perror("S: schedInit open error");
+        return -1;
+    }
+    dataEnd = (uint64_t)st.st_size;
+    if (!fresh) {
+        if (heapMap(h.cap) < 0) {
+            return -1;
+        }
+        // What the live records do not cover was fired before the restart
+        for (k = 0; k < hdr->count; k++) {
+            live += recSize(heap[k].off);
+        }
+        dead = dataEnd > live ? dataEnd - live : 0;
+        printf("S: %lu scheduled messages pending\n",
+               (unsigned long)hdr->count);
+        return 0;
+    }
+    // Fresh (or unusable) heap - start over with an empty body file too
+    if (heapMap(SCHED_MINCAP) < 0 || ftruncate(dataFd, 0) < 0) {
+        return -1;
+    }
+    hdr->magic = SCHED_MAGIC;
+    hdr->gen = 0;
+    hdr->count = 0;
+    dataEnd = 0;
+    return 0;
+}
+
+static int before(const struct schedEntry *a, const struct schedEntry *b) {
+    return a->when < b->when || (a->when == b->when && a->off < b->off);
+}
+
+static void siftUp(uint64_t k) {
+    struct schedEntry e = heap[k];
+
+    while (k > 0 && before(&e, &heap[(k - 1) / 2])) {
+        heap[k] = heap[(k - 1) / 2];
+        k = (k - 1) / 2;
+    }
+    heap[k] = e;
+}
+
+static void siftDown(uint64_t k) {
+    struct schedEntry e = heap[k];
+    uint64_t child;
+
+    while ((child = 2 * k + 1) < hdr->count) {
+        if (child + 1 < hdr->count && before(&heap[child + 1], &heap[child])) {
+            child++;
+        }
+        if (!before(&heap[child], &e)) {
+            break;
+        }
+        heap[k] = heap[child];
+        k = child;
+    }
+    heap[k] = e;
+}
+
+int schedAdd(time_t when, const char *room, const char *line, size_t len) {
+    struct schedRec rec;
+    struct iovec iov[2];
+
+    if (hdr->count == hdr->cap && heapMap(hdr->cap * 2) < 0) {
+        return -1;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.len = (uint32_t)len;
+    snprintf(rec.room, sizeof(rec.room), "%s", room);
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = (void *)line;
+    iov[1].iov_len = len;
+    if (pwritev(dataFd, iov, 2, dataEnd) != (ssize_t)(sizeof(rec) + len)) {
+        perror("S: schedAdd write error");
+        return -1;
+    }
+    heap[hdr->count].when = when;
+    heap[hdr->count].off = dataEnd;
+    dataEnd += sizeof(rec) + len;
+    siftUp(hdr->count++);
+    return 0;
+}
+
+static int byOff(const void *a, const void *b) {
+    const struct move *x = a, *y = b;
+
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+static struct move *movedTo(uint64_t off) {
+    struct move key = {off, 0};
+
+    return bsearch(&key, job.m, job.n, sizeof(*job.m), byOff);
+}
+
+static void jobEnd(void) {
+    if (job.fd > -1) {
+        close(job.fd);
+        unlink(bodyPath(hdr->gen + 1));
+    }
+    free(job.m);
+    job.fd = -1;
+    job.m = NULL;
+    job.n = job.cap = 0;
+}
+
+static void jobStart(void) {
+    job.fd = open(bodyPath(hdr->gen + 1), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (job.fd < 0) {
+        perror("S: sched compact open error");
+        dead = 0; // try again after as many bytes more
+        return;
+    }
+    job.pos = job.at = job.dead = 0;
+}
+
+/* flag a body as delivered, in the copy too when it already went there */
+static void fired(uint64_t off, uint32_t len) {
+    struct move *m;
+
+    len |= SCHED_FIRED;
+    if (pwrite(dataFd, &len, sizeof(len), off) != sizeof(len)) {
+        perror("S: sched flag error");
+    }
+    if (job.fd > -1 && off < job.pos && (m = movedTo(off)) != NULL) {
+        if (pwrite(job.fd, &len, sizeof(len), m->to) != sizeof(len)) {
+            perror("S: sched flag error");
+        }
+        job.dead += sizeof(struct schedRec) + (len & ~SCHED_FIRED);
+    }
+}
+
+/* the copy has caught up: replace the heap with one that points into it */
+static int jobSwap(void) {
+    char tmp[sizeof(heapName) + 4];
+    struct schedHeader *img;
+    struct schedEntry *e;
+    struct move *m;
+    uint64_t k, size = heapSize(hdr->cap);
+    void *p;
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.new", heapName);
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0 ||
+        (p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ==
+            MAP_FAILED) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    img = p;
+    *img = *hdr;
+    img->gen = hdr->gen + 1;
+    e = (struct schedEntry *)(img + 1);
+    for (k = 0; k < hdr->count; k++) {
+        if ((m = movedTo(heap[k].off)) == NULL) {
+            break;
+        }
+        e[k].when = heap[k].when;
+        e[k].off = m->to;
+    }
+    // Bodies first, then the heap naming them, then the rename
+    if (k < hdr->count || fsync(job.fd) < 0 || msync(p, size, MS_SYNC) < 0 ||
+        rename(tmp, heapName) < 0) {
+        munmap(p, size);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    munmap(hdr, size);
+    close(heapFd);
+    heapFd = fd;
+    hdr = img;
+    heap = e;
+    unlink(bodyPath(hdr->gen + 1));
+    close(dataFd);
+    dataFd = job.fd;
+    dataEnd = job.at;
+    dead = job.dead;
+    job.fd = -1;
+    jobEnd();
+    schedCompacted++;
+    return 0;
+}
+
+int schedTimeout(void) { return job.fd > -1 ? 0 : -1; }
+
+/* copy up to SCHED_SLICE more body bytes, and swap once caught up */
+void schedTick(void) {
+    char body[sizeof(struct schedRec) + MAXCHR];
+    uint64_t done = 0, size;
+    struct move *m;
+    uint32_t len;
+
+    while (job.fd > -1 && done < SCHED_SLICE && job.pos < dataEnd) {
+        if (pread(dataFd, &len, sizeof(len), job.pos) != sizeof(len) ||
+            (size = sizeof(struct schedRec) + (len & ~SCHED_FIRED)) >
+                sizeof(body) ||
+            job.pos + size > dataEnd) {
+            printf("S: sched compact stopped at %lu\n",
+                   (unsigned long)job.pos);
+            jobEnd();
+            dead = 0;
+            return;
+        }
+        if (!(len & SCHED_FIRED)) {
+            if (job.n == job.cap) {
+                job.cap = job.cap ? job.cap * 2 : SCHED_MINCAP;
+                if ((m = realloc(job.m, job.cap * sizeof(*m))) == NULL) {
+                    jobEnd();
+                    dead = 0;
+                    return;
+                }
+                job.m = m;
+            }
+            if (pread(dataFd, body, size, job.pos) != (ssize_t)size ||
+                pwrite(job.fd, body, size, job.at) != (ssize_t)size) {
+                perror("S: sched compact error");
+                jobEnd();
+                dead = 0;
+                return;
+            }
+            job.m[job.n].off = job.pos;
+            job.m[job.n++].to = job.at;
+            job.at += size;
+        }
+        job.pos += size;
+        done += size;
+    }
+    if (job.fd > -1 && job.pos == dataEnd && jobSwap() < 0) {
+        perror("S: sched compact swap error");
+        jobEnd();
+        dead = 0;
+    }
+}
+
+int schedRun(time_t now, schedDeliver deliver, void *arg) {
+    struct schedRec rec;
+    struct schedEntry top;
+    char line[MAXCHR];
+    ssize_t got;
+    int n = 0;
+
+    while (n < SCHED_BATCH && hdr->count > 0 && heap[0].when <= now) {
+        top = heap[0];
+        heap[0] = heap[--hdr->count];
+        if (hdr->count > 0) {
+            siftDown(0);
+        }
+        if ((got = pread(dataFd, &rec, sizeof(rec), top.off)) !=
+                sizeof(rec) ||
+            rec.len >= sizeof(line) ||
+            pread(dataFd, line, rec.len, top.off + sizeof(rec)) !=
+                (ssize_t)rec.len) {
+            perror("S: schedRun read error");
+            dead += sizeof(rec);
+            if (got == sizeof(rec)) {
+                fired(top.off, rec.len);
+            }
+            continue;
+        }
+        rec.room[MAXROOM - 1] = '\0';
+        line[rec.len] = '\0';
+        dead += sizeof(rec) + rec.len;
+        fired(top.off, rec.len);
+        deliver(arg, rec.room, line, rec.len);
+        schedFired++;
+        n++;
+    }
+    if (n > 0 && hdr->count == 0) {
+        // Nothing pending: the bodies can all go, and any copy of them
+        jobEnd();
+        if (ftruncate(dataFd, 0) < 0) {
+            perror("S: schedRun ftruncate error");
+        }
+        dataEnd = dead = 0;
+    } else if (n > 0 && job.fd < 0 && dead >= SCHED_COMPACT &&
+               dead > dataEnd / 2) {
+        jobStart();
+    }
+    return n;
+}
+
+unsigned long schedPending(void) { return hdr ? (unsigned long)hdr->count : 0; }
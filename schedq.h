@@ -0,0 +1,59 @@
+/* *
+ * Name: schedq.h                                                   *
+ *                                                                  *
+ * Description: scheduled messages include file                     *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __SCHEDQ_H
+#define __SCHEDQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SCHED_HEAP "schedule.heap" /* mmap'd min-heap of due times */
+#define SCHED_DATA "schedule.dat"  /* message bodies, or SCHED_DATA.1 */
+#define SCHED_MAGIC 0x48534347     /* "GCSH" */
+#define SCHED_BATCH 1024           /* messages injected per tick at most */
+#define SCHED_COMPACT (1 << 20)    /* fired body bytes before a rewrite */
+
+struct schedHeader {
+    uint32_t magic;
+    uint32_t gen; /* which of the two body files the offsets are in */
+    uint64_t count;
+    uint64_t cap;
+};
+
+/* heap entries stay small; the body lives in SCHED_DATA at off */
+struct schedEntry {
+    int64_t when;
+    uint64_t off;
+};
+
+typedef void (*schedDeliver)(void *arg, const char *room, const char *line,
+                             size_t len);
+
+extern unsigned long schedFired, schedCompacted;
+
+int schedInit(const char *heap, const char *data);
+int schedAdd(time_t when, const char *room, const char *line, size_t len);
+int schedRun(time_t now, schedDeliver deliver, void *arg);
+int schedTimeout(void);
+void schedTick(void);
+unsigned long schedPending(void);
+
+#endif
@@ -20,15 +20,63 @@
  */
 
 #include "chat.h"
+#include "mailbox.h"
+#include "room.h"
+#include "history.h"
+#include "timer.h"
+#include "schedq.h"
+#include "idgen.h"
+#include "scan.h"
+#include "ws.h"
+#include "json.h"
+#include "tls.h"
+#include "auth.h"
+#include "mcast.h"
+#include "rudp.h"
+#include "zc.h"
+#include "kfan.h"
+#include "acceptor.h"
+#include "co.h"
+#include "boot.h"
+#include "snap.h"
+#include "cursor.h"
+#include "node.h"
+#include "dir.h"
+#include "quota.h"
+#include "redir.h"
 #include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <signal.h>
+#include <sys/random.h>
+#include <sys/stat.h>
 
 /* ipv6 aware with mapped address */
 
 int nClient = 0;
 char buffer[MAXCHR];
 char message[MAXCHR];
+char inBuf[MAXCON][MAXCHR];  // partial input line per connection
+size_t inUsed[MAXCON];       // bytes in inBuf
+size_t inChecked[MAXCON];    // leading bytes already scanned
+struct co *co[MAXCON];       // receive path coroutine, in coroutine mode
+intern_t nick[MAXCON];
+struct room *roomOf[MAXCON];
+fd_set afds;
+struct bitmap online; /* connected clients */
+struct bitmap quiet;  /* clients not receiving announcements */
+struct bitmap authed; /* clients logged in as their nickname */
+struct bitmap mcast;  /* clients taking room traffic by multicast */
+unsigned gen[MAXCON]; /* bumped on accept, to drop stale login verdicts */
+char peer[MAXCON][INET6_ADDRSTRLEN]; /* client address, for rate limits */
+struct timer snapTimer; /* next background snapshot */
+int snapEvery;          /* seconds between them, 0 when off */
+struct timer redirTimer; /* next load report to the other servers */
+time_t movedAt[MAXCON];  /* when the client was told to move, 0 never */
+char sessId[MAXCON][REDIR_TOKEN]; /* only ever sent to the client itself */
 
-int openSocket(internet_domain_sockaddr *addr) {
+/* bound to every interface, or to loopback only when local */
+int openSocket(internet_domain_sockaddr *addr, int port, int local) {
     int sd;
     int optval = 1;
 
@@ -46,12 +94,12 @@ int openSocket(internet_domain_sockaddr *addr) {
         printf("S: openSocket socket OK\n");
 #ifdef IPV6_CHAT
         addr->sin6_family = AF_INET6;
-        addr->sin6_port = htons(5900);
-        addr->sin6_addr = in6addr_any;
+        addr->sin6_port = htons(port);
+        addr->sin6_addr = local ? in6addr_loopback : in6addr_any;
 #else
         addr->sin_family = AF_INET;
-        addr->sin_addr.s_addr = htonl(INADDR_ANY);
-        addr->sin_port = htons(5900);
+        addr->sin_addr.s_addr = htonl(local ? INADDR_LOOPBACK : INADDR_ANY);
+        addr->sin_port = htons(port);
 #endif
         // Set SO_REUSEADDR to avoid "Address already in use" error
         if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
@@ -70,6 +118,26 @@ int openSocket(internet_domain_sockaddr *addr) {
     }
 }
 
+/* a listener inherited from a supervisor, or a fresh one */
+int openListener(internet_domain_sockaddr *addr, int port, int local) {
+    int sd;
+
+#ifdef IPV6_CHAT
+    if ((sd = bootListener(AF_INET6, SOCK_STREAM, port)) > -1) {
+#else
+    if ((sd = bootListener(AF_INET, SOCK_STREAM, port)) > -1) {
+#endif
+        // Already listening: keep the supervisor's backlog
+        return sd;
+    }
+    if ((sd = openSocket(addr, port, local)) > -1 && listen(sd, MAXCON) < 0) {
+        perror("S: listen error");
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
 int freeConnections(int *fd) {
     int fdlib = 0;
 
@@ -83,56 +151,981 @@ int freeConnections(int *fd) {
     }
 }
 
-void dispatch(int *fd, int i) {
+void notify(int sd, const char *fmt, ...) {
+    char line[MAXCHR];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (wsSend(sd, line, strlen(line)) < 0) {
+        perror("S: notify send error");
+    }
+}
+
+const char *label(int i) {
+    static char name[MAXNICK];
+
+    if (nick[i] != 0) {
+        return internStr(nick[i]);
+    }
+    snprintf(name, sizeof(name), "C%d", i + 1);
+    return name;
+}
+
+int validName(const char *name) {
+    size_t len = strlen(name);
+
+    if (len == 0 || len >= MAXNICK) {
+        return 0;
+    }
+    // "S" and "C<n>" label server lines and anonymous clients
+    if (strcmp(name, "S") == 0 ||
+        (name[0] == 'C' && strspn(name + 1, "0123456789") == len - 1)) {
+        return 0;
+    }
+    for (; *name; name++) {
+        if (!isalnum((unsigned char)*name) && *name != '_' && *name != '-') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int findNick(int *fd, const char *name) {
+    intern_t id = internFind(name);
     int k;
 
-    memset(message, 0, MAXCHR);
-    snprintf(message, MAXCHR, "C%d: %s", i + 1, buffer);
-    for (k = 0; k < MAXCON; k++) {
+    for (k = 0; id != 0 && k < MAXCON; k++) {
+        if ((fd[k] > -1) && (nick[k] == id)) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+void dropClient(int *fd, int k) {
+    FD_CLR(fd[k], &afds);
+    wsClose(fd[k]);
+    jsonSet(fd[k], 0);
+    tlsClose(fd[k]);
+    rudpClose(fd[k]);
+    zcClose(fd[k]);
+    kfanClose(fd[k]);
+    coFree(co[k]); // suspended between wake-ups, nothing to unwind
+    co[k] = NULL;
+    close(fd[k]);
+    fd[k] = -1;
+    nClient--;
+    if (roomOf[k] != NULL) {
+        roomLeave(roomOf[k], k); // WebSocket clients join after the upgrade
+        roomOf[k] = NULL;
+    }
+    bitmapRemove(&online, k);
+    bitmapRemove(&quiet, k);
+    bitmapRemove(&authed, k);
+    bitmapRemove(&mcast, k);
+    if (nick[k] != 0) {
+        dirDel(internStr(nick[k]), k, gen[k]);
+    }
+    internPut(nick[k]);
+    nick[k] = 0;
+}
+
+/* each wire format of a fan-out message, encoded on first use */
+struct wire {
+    char frame[MAXCHR + WS_HDRMAX];
+    size_t frameLen;
+    char json[JSON_WIRE];
+    size_t jsonLen;
+    char jsonFrame[JSON_WIRE + WS_HDRMAX];
+    size_t jsonFrameLen;
+};
+
+static const char *wire(int sd, struct wire *w, const char *msg, size_t len,
+                        size_t *outLen) {
+    char *frame = w->frame;
+    size_t *frameLen = &w->frameLen;
+
+    if (jsonIs(sd)) {
+        if (w->jsonLen == 0 &&
+            (w->jsonLen = jsonLines(w->json, sizeof(w->json), msg, len)) == 0) {
+            return NULL;
+        }
+        msg = w->json;
+        len = w->jsonLen;
+        frame = w->jsonFrame;
+        frameLen = &w->jsonFrameLen;
+    }
+    if (!wsIs(sd)) {
+        *outLen = len;
+        return msg;
+    }
+    // Encoded once, the same frame goes to every WebSocket peer
+    if (*frameLen == 0) {
+        if (frame == w->frame && len > MAXCHR) {
+            return NULL;
+        }
+        *frameLen = wsFrame(frame, msg, len);
+    }
+    *outLen = *frameLen;
+    return frame;
+}
+
+/* the copy-free fan-out engines a socket takes; either may be refused,
+ * and a copying send() remains */
+static void fastPaths(int sd) {
+    kfanEnable(sd);
+    // The kernel's TLS layer refuses MSG_ZEROCOPY, but takes splice()
+    if (!tlsIs(sd)) {
+        zcEnable(sd);
+    }
+}
+
+/* sends msg to every client in ids except client i (-1 for nobody) */
+void sendEach(int *fd, const uint32_t *ids, size_t n, int i, const char *msg,
+              size_t len) {
+    struct wire w;
+    struct zcBuf *zb = NULL;
+    int zbTried = 0;
+    int piped = -1; /* payload in the tee() source pipe, once tried */
+    const char *out;
+    size_t outLen;
+    size_t j;
+    int k;
+
+    w.frameLen = w.jsonLen = w.jsonFrameLen = 0;
+
+    for (j = 0; j < n; j++) {
+        k = (int)ids[j];
         if ((k != i) && (fd[k] > -1)) {
-            int bytes_sent = send(fd[k], message, strlen(message), 0);
+            if ((out = wire(fd[k], &w, msg, len, &outLen)) == NULL) {
+                wsSend(fd[k], msg, len); // too large to keep encoded
+                continue;
+            }
+            int bytes_sent = -1;
+            errno = ENOBUFS;
+            // Large plain payloads teed from one pipe, when that is on
+            if (out == msg && len >= kfanMin() && kfanIs(fd[k]) &&
+                !tlsQueued(fd[k])) {
+                if (piped < 0) {
+                    piped = kfanLoad(msg, len) == 0;
+                }
+                if (piped) {
+                    bytes_sent = kfanSend(fd[k], len);
+                }
+            }
+            // Large plain payloads: one pinned copy shared by every send
+            if (bytes_sent < 0 && errno == ENOBUFS && out == msg &&
+                len >= zcMin() && zcIs(fd[k]) && !tlsQueued(fd[k])) {
+                if (!zbTried++) {
+                    zb = zcGet(msg, len);
+                }
+                bytes_sent = zcSend(fd[k], zb);
+            }
+            // A splice or zero-copy send cut short: the rest the ordinary
+            // way, so nothing goes out twice
+            if (bytes_sent >= 0 && (size_t)bytes_sent < len) {
+                bytes_sent = tlsSend(fd[k], msg + bytes_sent, len - bytes_sent);
+            }
+            if (bytes_sent < 0 && errno == ENOBUFS) {
+                bytes_sent = tlsSend(fd[k], out, outLen);
+            }
             if (bytes_sent < 0) {
                 if (errno == EINTR) {
                     // Interrupted by signal - retry once for dispatch
                     printf("S: dispatch send interrupted, retrying to client %d...\n", k + 1);
-                    bytes_sent = send(fd[k], message, strlen(message), 0);
+                    bytes_sent = tlsSend(fd[k], out, outLen);
                     if (bytes_sent < 0) {
                         printf("S: dispatch retry failed for client %d, removing connection\n", k + 1);
-                        close(fd[k]);
-                        fd[k] = -1;
-                        nClient--;
+                        dropClient(fd, k);
                     }
                 } else if (errno == EPIPE || errno == ECONNRESET) {
                     // Connection broken - client disconnected
                     printf("S: client %d disconnected during message dispatch, removing connection\n", k + 1);
-                    close(fd[k]);
-                    fd[k] = -1;
-                    nClient--;
+                    dropClient(fd, k);
                 } else {
                     // Other network error - assume connection is bad
                     perror("S: dispatch send error");
                     printf("S: removing client %d connection due to send error\n", k + 1);
-                    close(fd[k]);
-                    fd[k] = -1;
-                    nClient--;
+                    dropClient(fd, k);
                 }
             }
             // bytes_sent >= 0 means success, continue to next client
         }
     }
+    zcPut(zb); // the pool gets it back once the last send completes
+    if (piped > 0) {
+        kfanUnload(len);
+    }
 }
 
-int communication(int *fd, int i) {
+/* names client i in multicast headers, so it can skip its own lines;
+   the node keeps tags of a cluster's servers apart */
+static uint32_t mcastTag(int i) {
+    return i < 0 ? 0
+                 : ((uint32_t)(nodeSelf() & 0x7f) << 24) |
+                       ((gen[i] & 0xffff) << 8) | (uint32_t)(i + 1);
+}
+
+/* multicast subscribers get one shared datagram, the rest unicast */
+void fanout(int *fd, struct room *r, int i, const char *msg, size_t len) {
+    uint32_t ids[MAXCON];
+    struct bitmap uni;
+    uint64_t n;
+
+    if (!mcastOn()) {
+        sendEach(fd, ids, bitmapToArray(&r->member, ids, MAXCON), i, msg, len);
+        return;
+    }
+    bitmapInit(&uni);
+    bitmapAndNot(&uni, &r->member, &mcast);
+    n = bitmapCard(&r->member) - bitmapCard(&uni);
+    if (n > 0 && mcastSend(r, msg, len, (int)n, mcastTag(i)) < 0 &&
+        errno != EAGAIN) {
+        perror("S: mcast send error"); // kept in the ring, NACKs repair it
+    }
+    sendEach(fd, ids, bitmapToArray(&uni, ids, MAXCON), i, msg, len);
+    bitmapFree(&uni);
+}
+
+void dispatch(int *fd, int i, int ttl) {
+    memset(message, 0, MAXCHR);
+    snprintf(message, MAXCHR, "%s: %s", label(i), buffer);
+    histAppend(roomOf[i], idNext(), message, strlen(message), ttl);
+    fanout(fd, roomOf[i], i, message, strlen(message));
+}
+
+/* scheduler callback: a due message enters the normal fan-out path */
+void deliver(void *arg, const char *name, const char *line, size_t len) {
+    int *fd = arg;
+    struct room *r;
+
+    if ((r = roomGet(name, 1, 0)) != NULL) {
+        histAppend(r, idNext(), line, len, 0);
+        fanout(fd, r, -1, line, len);
+    }
+}
+
+/* "+secs", "HH:MM" (next occurrence, local time) or seconds since epoch */
+time_t parseWhen(const char *when) {
+    time_t now = time(NULL);
+    struct tm tm;
+    int hh, mm;
+
+    if (when[0] == '+') {
+        return now + atol(when + 1);
+    }
+    if (sscanf(when, "%d:%d", &hh, &mm) == 2 && strchr(when, ':')) {
+        localtime_r(&now, &tm);
+        tm.tm_hour = hh;
+        tm.tm_min = mm;
+        tm.tm_sec = 0;
+        if (mktime(&tm) <= now) {
+            tm.tm_mday++;
+        }
+        return mktime(&tm);
+    }
+    return (time_t)atol(when);
+}
+
+/* "/announce a,b,c text": every member of the rooms once, minus quiet */
+void announce(int *fd, int i) {
+    char rooms[MAXCHR];
+    char *text, *name, *save;
+    struct bitmap to;
+    struct room *r;
+    uint32_t ids[MAXCON];
+    uint64_t id = idNext();
+    int n = 0;
+
+    rooms[0] = '\0';
+    sscanf(buffer + strlen(CMD_ANNOUNCE), "%255s %n", rooms, &n);
+    text = buffer + strlen(CMD_ANNOUNCE) + n;
+    if (n == 0 || *text == '\0') {
+        notify(fd[i], "S: usage /announce <room>[,<room>...] <text>\n");
+        return;
+    }
+    memset(message, 0, MAXCHR);
+    snprintf(message, MAXCHR, "%s (announce): %s%s", label(i), text,
+             strchr(text, '\n') ? "" : "\n");
+    bitmapInit(&to);
+    for (name = strtok_r(rooms, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+        if ((r = roomGet(name, 0, 0)) != NULL) {
+            bitmapOr(&to, &to, &r->member);
+            histAppend(r, id, message, strlen(message), 0);
+        }
+    }
+    bitmapAndNot(&to, &to, &quiet);
+    // The sender's copy must not drop it while its line is being processed
+    if (bitmapContains(&to, i)) {
+        notify(fd[i], "%s", message);
+    }
+    sendEach(fd, ids, bitmapToArray(&to, ids, MAXCON), i, message,
+             strlen(message));
+    bitmapFree(&to);
+}
+
+/* "/who": members of the current room that are online */
+void who(int *fd, int i) {
+    char line[MAXCHR];
+    struct bitmap here;
+    uint32_t ids[MAXCON];
+    size_t n, k, used;
+
+    bitmapInit(&here);
+    bitmapAnd(&here, &roomOf[i]->member, &online);
+    n = bitmapToArray(&here, ids, MAXCON);
+    used = snprintf(line, sizeof(line), "S: %zu in %s:", n,
+                    roomName(roomOf[i]));
+    for (k = 0; k < n && used < sizeof(line) - 2; k++) {
+        used += snprintf(line + used, sizeof(line) - used - 1, " %s",
+                         label(ids[k]));
+    }
+    strcpy(line + (used < sizeof(line) - 2 ? used : sizeof(line) - 2), "\n");
+    notify(fd[i], "%s", line);
+    bitmapFree(&here);
+}
+
+/* runs in the snapshot child on the frozen state, see snap.h */
+int snapshot(FILE *out, void *arg) {
+    int *fd = arg;
+    struct room *r;
+    struct stat st;
+    uint32_t head[3] = {SNAP_MAGIC, 0, 0}, n;
+    uint64_t when = (uint64_t)time(NULL), bytes;
+    int32_t ttl;
+    uint16_t slot;
+    uint8_t flags;
+    int i;
+
+    for (r = roomNext(NULL); r != NULL; r = roomNext(r)) {
+        head[1]++;
+    }
+    for (i = 0; i < MAXCON; i++) {
+        head[2] += fd[i] > -1;
+    }
+    fwrite(head, sizeof(head), 1, out);
+    fwrite(&when, sizeof(when), 1, out);
+    for (r = roomNext(NULL); r != NULL; r = roomNext(r)) {
+        snapStr(out, roomName(r));
+        ttl = r->ttl;
+        fwrite(&ttl, sizeof(ttl), 1, out);
+        n = r->members;
+        fwrite(&n, sizeof(n), 1, out);
+        n = r->mcast != NULL ? r->mcast->next : 0;
+        fwrite(&n, sizeof(n), 1, out);
+        bytes = r->logfd > -1 && fstat(r->logfd, &st) == 0 ? st.st_size : 0;
+        fwrite(&bytes, sizeof(bytes), 1, out);
+    }
+    for (i = 0; i < MAXCON; i++) {
+        if (fd[i] < 0) {
+            continue;
+        }
+        slot = i;
+        fwrite(&slot, sizeof(slot), 1, out);
+        snapStr(out, nick[i] ? internStr(nick[i]) : "");
+        snapStr(out, roomOf[i] != NULL ? roomName(roomOf[i]) : "");
+        flags = (bitmapContains(&quiet, i) ? SNAP_QUIET : 0) |
+                (bitmapContains(&authed, i) ? SNAP_AUTHED : 0) |
+                (bitmapContains(&mcast, i) ? SNAP_MCAST : 0);
+        fwrite(&flags, sizeof(flags), 1, out);
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+/* directory callback: a private message from another server */
+int dirDeliver(void *arg, const char *name, int k, unsigned g, const char *msg,
+               size_t len) {
+    int *fd = arg;
+
+    if (k < 0 || k >= MAXCON || fd[k] < 0 || gen[k] != g ||
+        nick[k] != internFind(name)) {
+        return -1;
+    }
+    if (wsSend(fd[k], msg, len) < 0) {
+        perror("S: private send error");
+    }
+    return 0;
+}
+
+/* directory callback: a later login elsewhere took the nick */
+void dirDrop(void *arg, const char *name, int k, unsigned g) {
+    int *fd = arg;
+
+    if (k < 0 || k >= MAXCON || fd[k] < 0 || gen[k] != g ||
+        nick[k] != internFind(name)) {
+        return;
+    }
+    internPut(nick[k]);
+    nick[k] = 0;
+    bitmapRemove(&authed, k);
+    // Not while the client resumes on the server it was sent to
+    if (time(NULL) >= movedAt[k] + REDIR_HOLD) {
+        notify(fd[k], "S: %s logged in from another connection\n", name);
+    }
+}
+
+/* directory callback: tell the sender what became of a private message */
+void dirResult(void *arg, int k, unsigned g, const char *name, int how) {
+    int *fd = arg;
+
+    if (fd[k] < 0 || gen[k] != g) {
+        return;
+    }
+    if (how == DIR_STORED) {
+        notify(fd[k], "S: %s is offline, message stored\n", name);
+    } else if (how == DIR_FULL) {
+        notify(fd[k], "S: mailbox of %s is full\n", name);
+    } else if (how == DIR_FAILED) {
+        notify(fd[k], "S: could not reach %s, try again later\n", name);
+    }
+}
+
+/* timer callback: fork a snapshot unless the last one still runs */
+void snapTick(void *arg) {
+    if (!snapBusy() && snapStart(SNAP_FILE, snapshot, arg) < 0) {
+        printf("S: snapshot not started\n");
+    }
+    timerArm(&snapTimer, time(NULL) + snapEvery);
+}
+
+/* the connection at k loses its nick to a login or a resumed session */
+void takeOver(int *fd, int k, const char *name) {
+    dirDel(name, k, gen[k]);
+    internPut(nick[k]);
+    nick[k] = 0;
+    bitmapRemove(&authed, k);
+    notify(fd[k], "S: %s logged in from another connection\n", name);
+}
+
+void setNick(int *fd, int i, const char *name) {
+    int n;
+
+    if (nick[i] != 0) {
+        dirDel(internStr(nick[i]), i, gen[i]);
+    }
+    internPut(nick[i]);
+    nick[i] = internGet(name);
+    dirPut(name, i, gen[i]);
+    printf("S: client %d is now %s\n", i + 1, name);
+    if ((n = mboxDrain(name, fd[i])) > 0) {
+        printf("S: delivered %d offline messages to %s\n", n, name);
+    }
+}
+
+/* authenticated: the name is taken over and a fresh token handed out */
+void login(int *fd, int i, const char *name, int created) {
+    char token[AUTH_TOKEN];
+    int k;
+
+    if ((k = findNick(fd, name)) >= 0 && k != i) {
+        takeOver(fd, k, name);
+    }
+    setNick(fd, i, name);
+    bitmapAdd(&authed, i);
+    if (authToken(name, token, sizeof(token)) == 0) {
+        notify(fd[i], "S: %s as %s, token %s\n",
+               created ? "registered" : "logged in", name, token);
+    }
+}
+
+void joinRoom(int *fd, int i, struct room *r) {
+    char notice[MAXCHR];
+
+    roomLeave(roomOf[i], i);
+    roomOf[i] = r;
+    roomEnter(r, i);
+    printf("S: %s joined room %s\n", label(i), roomName(r));
+    notify(fd[i], "S: now in room %s\n", roomName(r));
+    histReplay(r, fd[i]);
+    if (bitmapContains(&mcast, i)) {
+        mcastNotice(r, notice, sizeof(notice), mcastTag(i));
+        notify(fd[i], "%s", notice);
+    }
+}
+
+/* redirection callback: the target took the session, or never answered */
+void redirReady(void *arg, int k, unsigned g, int to, const char *token) {
+    int *fd = arg;
+
+    if (fd[k] < 0 || gen[k] != g) {
+        return;
+    } else if (token == NULL) {
+        movedAt[k] = 0; // stays, and counts here again
+        return;
+    }
+    printf("S: %s sent to server %d\n", label(k), to);
+    notify(fd[k], REDIR_LINE "%s %d %s %d %s\n", nodeHost(to), 5900, token,
+           REDIR_JITTER, sessId[k]);
+}
+
+/* timer callback: report our load, and move clients off while we run hot */
+void moveTick(void *arg) {
+    static int next; // where the last round stopped, so moves rotate
+    struct redirSession s;
+    int *fd = arg;
+    int i, k, n, to, staying = nClient;
+
+    // Clients told to go count as gone, they may still wait out the jitter
+    for (i = 0; i < MAXCON; i++) {
+        if (fd[i] > -1 && time(NULL) < movedAt[i] + REDIR_HOLD) {
+            staying--;
+        }
+    }
+    if ((to = redirPlan(staying, &n)) > -1) {
+        // Only plain connections, the client program knows how to follow
+        for (k = 0; k < MAXCON && n > 0; k++) {
+            i = (next + k) % MAXCON;
+            if (fd[i] < 0 || time(NULL) < movedAt[i] + REDIR_HOLD ||
+                wsIs(fd[i]) || tlsIs(fd[i]) || rudpIs(fd[i]) || jsonIs(fd[i])) {
+                continue;
+            }
+            // Rooms are per server: a client with room-mates here stays
+            if (roomOf[i]->members > 1) {
+                continue;
+            }
+            snprintf(s.nick, sizeof(s.nick), "%s",
+                     nick[i] ? internStr(nick[i]) : "");
+            snprintf(s.room, sizeof(s.room), "%s", roomName(roomOf[i]));
+            s.flags = (bitmapContains(&quiet, i) ? REDIR_QUIET : 0) |
+                      (bitmapContains(&authed, i) ? REDIR_AUTHED : 0) |
+                      (bitmapContains(&mcast, i) ? REDIR_MCAST : 0);
+            // The client hears of it once the target has the session
+            if (redirHandoff(to, &s, i, gen[i]) == 0) {
+                movedAt[i] = time(NULL);
+                n--;
+            }
+        }
+        next = (next + k) % MAXCON;
+    }
+    timerArm(&redirTimer, time(NULL) + REDIR_EVERY);
+}
+
+/* a client another server sent over takes up its session here */
+void resume(int *fd, int i, const struct redirSession *s) {
+    char notice[MAXCHR];
+    struct room *r;
+    int k;
+
+    if (validName(s->nick)) {
+        if ((k = findNick(fd, s->nick)) >= 0 && k != i) {
+            takeOver(fd, k, s->nick);
+        }
+        if (k != i) {
+            setNick(fd, i, s->nick);
+        }
+        // Sessions only come in signed by a server holding the cluster key,
+        // which checked the login before handing it over
+        if (s->flags & REDIR_AUTHED) {
+            bitmapAdd(&authed, i);
+        }
+    }
+    if (s->flags & REDIR_QUIET) {
+        bitmapAdd(&quiet, i);
+    }
+    if ((s->flags & REDIR_MCAST) && mcastOn()) {
+        bitmapAdd(&mcast, i);
+    }
+    if (validName(s->room) && (r = roomGet(s->room, 1, 0)) != NULL &&
+        r != roomOf[i]) {
+        joinRoom(fd, i, r);
+    } else if (bitmapContains(&mcast, i)) {
+        mcastNotice(roomOf[i], notice, sizeof(notice), mcastTag(i));
+        notify(fd[i], "%s", notice);
+    }
+    notify(fd[i], REDIR_RESUMED "%s\n", label(i));
+}
+
+/* returns 1 when the line was a command and must not be dispatched */
+int command(int *fd, int i) {
+    char name[MAXCHR];
+    char secret[MAXCHR];
+    char *text;
+    struct room *r;
+    int k, n, ttl;
+
+    if (strncmp(buffer, CMD_NICK, strlen(CMD_NICK)) == 0) {
+        name[0] = '\0';
+        sscanf(buffer + strlen(CMD_NICK), "%255s", name);
+        if (!validName(name)) {
+            notify(fd[i], "S: invalid nickname\n");
+        } else if ((k = findNick(fd, name)) >= 0 && k != i) {
+            notify(fd[i], "S: nickname %s already in use\n", name);
+        } else if (k != i && authExists(name)) {
+            notify(fd[i], "S: %s is registered, use /login\n", name);
+        } else if (k != i) {
+            bitmapRemove(&authed, i);
+            setNick(fd, i, name);
+        }
+        return 1;
+    }
+    if (strncmp(buffer, CMD_LOGIN, strlen(CMD_LOGIN)) == 0) {
+        // The password check runs on a worker, the verdict comes back later
+        if (sscanf(buffer + strlen(CMD_LOGIN), "%255s %255s", name, secret) != 2 ||
+            !validName(name)) {
+            notify(fd[i], "S: usage /login <nick> <password>\n");
+        } else if (authSubmit(i, gen[i], name, secret) < 0) {
+            notify(fd[i], "S: login not available, try again later\n");
+        }
+        memset(secret, 0, sizeof(secret));
+        return 1;
+    }
+    if (strncmp(buffer, CMD_TOKEN, strlen(CMD_TOKEN)) == 0) {
+        secret[0] = '\0';
+        sscanf(buffer + strlen(CMD_TOKEN), "%255s", secret);
+        if (authVerify(secret, name, MAXNICK) == 0 && validName(name)) {
+            login(fd, i, name, 0);
+        } else {
+            notify(fd[i], "S: invalid or expired token\n");
+        }
+        return 1;
+    }
+    if (strncmp(buffer, CMD_RESUME, strlen(CMD_RESUME)) == 0) {
+        struct redirSession moved;
+        secret[0] = '\0';
+        sscanf(buffer + strlen(CMD_RESUME), "%255s", secret);
+        if (redirResume(secret, &moved) == 0) {
+            resume(fd, i, &moved);
+        } else {
+            notify(fd[i], REDIR_UNKNOWN "\n");
+        }
+        return 1;
+    }
+    if (strncmp(buffer, CMD_MSG, strlen(CMD_MSG)) == 0) {
+        text = buffer + strlen(CMD_MSG);
+        n = 0;
+        sscanf(text, "%255s%n", name, &n);
+        text += n;
+        if (*text == ' ') {
+            text++;
+        }
+        if (n == 0 || !validName(name) || *text == '\0') {
+            notify(fd[i], "S: usage /msg <nick> <text>\n");
+            return 1;
+        }
+        memset(message, 0, MAXCHR);
+        snprintf(message, MAXCHR, "%s (private): %s%s", label(i), text,
+                 strchr(text, '\n') ? "" : "\n");
+        if ((k = findNick(fd, name)) >= 0) {
+            if (wsSend(fd[k], message, strlen(message)) < 0) {
+                perror("S: private send error");
+            }
+        } else if (dirSend(name, message, strlen(message), i, gen[i]) == 0) {
+            // Another server may hold the nick, the outcome comes back later
+        } else if (mboxAppend(name, message, strlen(message)) < 0) {
+            notify(fd[i], "S: mailbox of %s is full\n", name);
+        } else {
+            notify(fd[i], "S: %s is offline, message stored\n", name);
+        }
+        return 1;
+    }
+    if (strncmp(buffer, CMD_JOIN, strlen(CMD_JOIN)) == 0) {
+        name[0] = '\0';
+        ttl = 0;
+        sscanf(buffer + strlen(CMD_JOIN), "%255s %d", name, &ttl);
+        if (!validName(name) || strlen(name) >= MAXROOM || ttl < 0) {
+            notify(fd[i], "S: usage /join <room> [ttl seconds]\n");
+        } else if ((r = roomGet(name, 1, ttl)) != NULL && r != roomOf[i]) {
+            joinRoom(fd, i, r);
+        }
+        return 1;
+    }
+    if (strncmp(buffer, CMD_TTL, strlen(CMD_TTL)) == 0) {
+        n = 0;
+        if (sscanf(buffer + strlen(CMD_TTL), "%d %n", &ttl, &n) < 1 ||
+            ttl <= 0 || n == 0) {
+            notify(fd[i], "S: usage /ttl <seconds> <text>\n");
+            return 1;
+        }
+        // Strip the command, the rest is an ordinary room message
+        text = buffer + strlen(CMD_TTL) + n;
+        memmove(buffer, text, strlen(text) + 1);
+        dispatch(fd, i, ttl);
+        return 1;
+    }
+    if (strncmp(buffer, CMD_AT, strlen(CMD_AT)) == 0) {
+        time_t when;
+        n = 0;
+        name[0] = '\0';
+        sscanf(buffer + strlen(CMD_AT), "%255s %n", name, &n);
+        text = buffer + strlen(CMD_AT) + n;
+        if (n == 0 || *text == '\0' || (when = parseWhen(name)) <= 0) {
+            notify(fd[i], "S: usage /at <+secs|HH:MM|epoch> <text>\n");
+            return 1;
+        }
+        memset(message, 0, MAXCHR);
+        snprintf(message, MAXCHR, "%s: %s%s", label(i), text,
+                 strchr(text, '\n') ? "" : "\n");
+        if (schedAdd(when, roomName(roomOf[i]), message, strlen(message)) <
+            0) {
+            notify(fd[i], "S: could not schedule message\n");
+        } else {
+            notify(fd[i], "S: scheduled for %s", ctime(&when));
+        }
+        return 1;
+    }
+    if (strncmp(buffer, CMD_ANNOUNCE, strlen(CMD_ANNOUNCE)) == 0) {
+        announce(fd, i);
+        return 1;
+    }
+    if (strncmp(buffer, CMD_WHO, strlen(CMD_WHO)) == 0) {
+        who(fd, i);
+        return 1;
+    }
+    if (strncmp(buffer, CMD_MCAST, strlen(CMD_MCAST)) == 0) {
+        // Datagrams carry plain lines, so only plain connections qualify
+        if (bitmapContains(&mcast, i)) {
+            bitmapRemove(&mcast, i);
+            notify(fd[i], "S: mcast off\n");
+        } else if (!mcastOn()) {
+            notify(fd[i], "S: multicast not enabled\n");
+        } else if (wsIs(fd[i]) || tlsIs(fd[i]) || jsonIs(fd[i])) {
+            notify(fd[i], "S: multicast needs a plain connection\n");
+        } else {
+            bitmapAdd(&mcast, i);
+            mcastNotice(roomOf[i], name, sizeof(name), mcastTag(i));
+            notify(fd[i], "%s", name);
+        }
+        return 1;
+    }
+    if (strncmp(buffer, CMD_NACK, strlen(CMD_NACK)) == 0) {
+        unsigned long from, to;
+        if (sscanf(buffer + strlen(CMD_NACK), "%31s %lu %lu", name, &from,
+                   &to) != 3 || from > to) {
+            notify(fd[i], "S: usage /nack <room> <from> <to>\n");
+        } else if ((r = roomGet(name, 0, 0)) == NULL || r != roomOf[i]) {
+            notify(fd[i], "S: not in room %s\n", name);
+        } else if ((n = mcastResend(r, from, to, fd[i], mcastTag(i))) > 0) {
+            notify(fd[i], "S: mcast lost %d messages of %s\n", n, name);
+        }
+        return 1;
+    }
+    if (strncmp(buffer, CMD_JSON, strlen(CMD_JSON)) == 0) {
+        jsonSet(fd[i], !jsonIs(fd[i]));
+        notify(fd[i], "S: JSON mode %s\n", jsonIs(fd[i]) ? "on" : "off");
+        return 1;
+    }
+    if (strncmp(buffer, CMD_QUIET, strlen(CMD_QUIET)) == 0) {
+        if (bitmapContains(&quiet, i)) {
+            bitmapRemove(&quiet, i);
+            notify(fd[i], "S: announcements on\n");
+        } else {
+            bitmapAdd(&quiet, i);
+            notify(fd[i], "S: announcements off\n");
+        }
+        return 1;
+    }
+    if (strncmp(buffer, CMD_STATS, strlen(CMD_STATS)) == 0) {
+        histReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        internReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        scanReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        tlsReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        authReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        mcastReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        rudpReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        zcReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        coReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        accReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        kfanReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        bootReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        snapReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        curReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        nodeReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        dirReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        quotaReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        redirReport(name, sizeof(name));
+        notify(fd[i], "%s", name);
+        notify(fd[i], "S: scheduled pending %lu fired %lu compactions %lu\n",
+               schedPending(), schedFired, schedCompacted);
+        notify(fd[i], "S: clients %d rooms %d clock regressions %lu\n",
+               nClient, nRoom, idRegressions());
+        return 1;
+    }
+    return 0;
+}
+
+/* room and private messages count against the sender's rate limits */
+static int limited(int *fd, int i) {
+    int why;
+
+    if (!quotaOn() || strncmp(buffer, MSG_C, strlen(MSG_C)) == 0 ||
+        (buffer[0] == '/' && strncmp(buffer, CMD_MSG, strlen(CMD_MSG)) != 0 &&
+         strncmp(buffer, CMD_ANNOUNCE, strlen(CMD_ANNOUNCE)) != 0 &&
+         strncmp(buffer, CMD_TTL, strlen(CMD_TTL)) != 0 &&
+         strncmp(buffer, CMD_AT, strlen(CMD_AT)) != 0)) {
+        return 0;
+    }
+    if ((why = quotaTake(nick[i] ? internStr(nick[i]) : NULL, peer[i])) ==
+        QUOTA_OK) {
+        return 0;
+    }
+    notify(fd[i], "S: slow down, %s rate limit reached\n",
+           why == QUOTA_USER_LIMIT ? "nickname" : "address");
+    return 1;
+}
+
+/* process the complete line in buffer, -1 once the client said exit */
+static int processLine(int *fd, int i) {
+    const char *err;
+    int n;
+
+    if (jsonIs(fd[i])) {
+        // Same command line a native client would send
+        if ((n = jsonToLine(buffer, message, MAXCHR, &err)) < 0) {
+            notify(fd[i], "%s", err);
+            return 0;
+        }
+        memcpy(buffer, message, n + 1);
+    }
+    if (strncmp(buffer, CMD_LOGIN, strlen(CMD_LOGIN)) == 0 ||
+        strncmp(buffer, CMD_TOKEN, strlen(CMD_TOKEN)) == 0) {
+        printf("S: client %d authenticating\n", i + 1); // no secrets in logs
+    } else {
+        printf("S: %s", buffer);
+    }
+    if (limited(fd, i)) {
+        return 0;
+    }
+    if (buffer[0] == '/' && command(fd, i)) {
+        return 0;
+    }
+    // The goodbye is not room traffic, a redirected client sends it too
+    if (strncmp(buffer, MSG_C, strlen(MSG_C)) == 0) {
+        // Enhanced send() with sophisticated error handling
+        int bytes_sent = wsSend(fd[i], ACK_S, sizeof(ACK_S));
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                // Interrupted by signal - in this case, we'll treat as error
+                // since ACK delivery is critical for proper shutdown
+                printf("S: ACK send interrupted, client %d may not receive confirmation\n", i + 1);
+            } else if (errno == EPIPE || errno == ECONNRESET) {
+                // Connection broken - client disconnected
+                printf("S: client %d disconnected during ACK send\n", i + 1);
+            } else {
+                // Other network error
+                perror("S: communication send ACK error");
+            }
+        } else {
+            printf("S: send ACK to client %d\n", i + 1);
+        }
+        return -1; // Normal exit after ACK
+    }
+    dispatch(fd, i, 0);
+    return 0;
+}
+
+static void welcome(int *fd, int i) {
+    unsigned char raw[(REDIR_TOKEN - 1) / 2];
+    size_t k;
+
+    roomOf[i] = roomGet(ROOM_DEFAULT, 1, 0);
+    roomEnter(roomOf[i], i);
+    bitmapAdd(&online, i);
+    // A redirect must quote this, which no other client ever sees
+    if (redirOn() && getrandom(raw, sizeof(raw), 0) == sizeof(raw)) {
+        for (k = 0; k < sizeof(raw); k++) {
+            snprintf(sessId[i] + 2 * k, 3, "%02x", raw[k]);
+        }
+        notify(fd[i], REDIR_SESSION "%s\n", sessId[i]);
+    } else {
+        sessId[i][0] = '\0';
+    }
+    histReplay(roomOf[i], fd[i]);
+}
+
+/* validates what was just added to in, then processes each whole line */
+static int lines(int *fd, int i, char *in, size_t *used, size_t *checked) {
+    size_t lastNl = (size_t)-1, len;
+    int full = (*used == MAXCHR - 2);
+    char *p = in, *nl;
+    int out = 0;
+
+    *checked = scanClean(in, *checked, used, full, &lastNl);
+    if (lastNl != (size_t)-1) {
+        // A failed send may have dropped the client, its other lines go too
+        while (out == 0 && fd[i] > -1 &&
+               (nl = memchr(p, '\n', in + lastNl + 1 - p))) {
+            len = nl + 1 - p;
+            memcpy(buffer, p, len);
+            buffer[len] = '\0';
+            p = nl + 1;
+            out = processLine(fd, i);
+        }
+    } else if (full && *checked > 0) {
+        // No newline in a full buffer: pass it on as one line
+        len = *checked;
+        memcpy(buffer, p, len);
+        buffer[len] = '\n';
+        buffer[len + 1] = '\0';
+        p += len;
+        out = processLine(fd, i);
+    }
+    len = p - in;
+    memmove(in, p, *used - len);
+    *used -= len;
+    *checked -= len;
+    return out;
+}
+
+static int receive(int *fd, int i) {
     int out = 0;
     int bytes_received;
+    int wasOpen;
+
+    if (!tlsReady(fd[i])) {
+        // Handshake in progress: one step per readable event
+        if ((wasOpen = tlsHandshake(fd[i])) < 0) {
+            return -1;
+        } else if (wasOpen == 1) {
+            if (tlsKernelTx(fd[i])) {
+                fastPaths(fd[i]); // the kernel encrypts what they send
+            }
+            welcome(fd, i);
+        }
+        return 0;
+    }
 
-    memset(buffer, 0, MAXCHR);
-    
     // Enhanced recv() with EINTR handling
     do {
-        bytes_received = recv(fd[i], buffer, MAXCHR, 0);
+        if (wsIs(fd[i])) {
+            wasOpen = wsOpen(fd[i]);
+            bytes_received = wsRecv(fd[i], inBuf[i] + inUsed[i],
+                                    MAXCHR - 2 - inUsed[i]);
+            if (!wasOpen && wsOpen(fd[i])) {
+                printf("S: client %d upgraded to WebSocket\n", i + 1);
+                welcome(fd, i);
+                if (bytes_received < 0) {
+                    break; // nothing sent beyond the handshake yet
+                }
+            }
+        } else {
+            bytes_received = tlsRecv(fd[i], inBuf[i] + inUsed[i],
+                                     MAXCHR - 2 - inUsed[i]);
+        }
         if (bytes_received < 0) {
-            if (errno == EINTR) {
+            if (errno == EAGAIN) {
+                // Handshake or frame still incomplete, or control only
+                break;
+            } else if (errno == EINTR) {
                 // Interrupted by signal, retry
                 printf("S: recv interrupted by signal, retrying...\n");
                 continue;
@@ -147,34 +1140,9 @@ int communication(int *fd, int i) {
             out = -1; // Signal connection should be closed
             break;
         } else {
-            // Successful recv, process the message
-            printf("S: %s", buffer);
-            if (nClient > 1) {
-                dispatch(fd, i);
-            }
-            if (strncmp(buffer, MSG_C, strlen(MSG_C)) == 0) {
-                // Enhanced send() with sophisticated error handling
-                int bytes_sent = send(fd[i], ACK_S, sizeof(ACK_S), 0);
-                if (bytes_sent < 0) {
-                    if (errno == EINTR) {
-                        // Interrupted by signal - in this case, we'll treat as error
-                        // since ACK delivery is critical for proper shutdown
-                        printf("S: ACK send interrupted, client %d may not receive confirmation\n", i + 1);
-                        out = -1;
-                    } else if (errno == EPIPE || errno == ECONNRESET) {
-                        // Connection broken - client disconnected
-                        printf("S: client %d disconnected during ACK send\n", i + 1);
-                        out = -1;
-                    } else {
-                        // Other network error
-                        perror("S: communication send ACK error");
-                        out = -1;
-                    }
-                } else {
-                    printf("S: send ACK to client %d\n", i + 1);
-                    out = -1; // Normal exit after ACK
-                }
-            }
+            // Successful recv, validate and cut it into complete lines
+            inUsed[i] += bytes_received;
+            out = lines(fd, i, inBuf[i], &inUsed[i], &inChecked[i]);
             break; // Exit the retry loop
         }
     } while (bytes_received < 0 && errno == EINTR);
@@ -182,25 +1150,265 @@ int communication(int *fd, int i) {
     return out;
 }
 
-int main() {
-    int sockfd, newsockfd;
-    int nfds;
+/* reads what is there, including what WebSocket, TLS or reliable UDP
+   still hold buffered */
+static int serve(int *fd, int i) {
+    int out;
+
+    if (zcReap(fd[i])) {
+        return 0; // woken by send completions only
+    }
+    do {
+        out = receive(fd, i);
+    } while (out == 0 && fd[i] > -1 &&
+             (wsPending(fd[i]) || tlsPending(fd[i]) || rudpPending(fd[i])));
+    return out;
+}
+
+/* coroutine mode: each wake-up first sends on what the client's socket
+   did not take, then goes through the same receive path as the callback
+   mode. The socket is non-blocking, so writes to it never stall the
+   loop; the session yields until it drains, or more arrives */
+struct session {
+    int *fd;
+    int i;
+};
+
+static struct session sess[MAXCON];
+
+static void session(void *arg) {
+    int *fd = ((struct session *)arg)->fd;
+    int i = ((struct session *)arg)->i;
+
+    for (;;) {
+        if (tlsFlush(fd[i]) < 0) {
+            perror("S: communication send error");
+            return;
+        }
+        if (serve(fd, i) < 0) {
+            return;
+        }
+        coYield();
+    }
+}
+
+int communication(int *fd, int i) {
+    if (co[i] != NULL) {
+        return coResume(co[i]) ? 0 : -1; // the session ends with the client
+    }
+    return serve(fd, i);
+}
+
+/* the client's address as text, the key its rate limit is counted under */
+static void peerName(int sd, char *name, size_t len) {
+    struct sockaddr_storage ss;
+    socklen_t sl = sizeof(ss);
+
+    name[0] = '\0';
+    if (getpeername(sd, (struct sockaddr *)&ss, &sl) < 0) {
+        return;
+    }
+    if (ss.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&ss)->sin6_addr, name, len);
+    } else if (ss.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&ss)->sin_addr, name, len);
+    }
+}
+
+/* puts an accepted connection in slot i */
+static void admit(int *fd, int i, int newsockfd, int ws, int tls, int rudp) {
+    if ((ws && wsAccept(newsockfd) < 0) || (tls && tlsAccept(newsockfd) < 0)) {
+        close(newsockfd);
+        return;
+    }
+    FD_SET(newsockfd, &afds);
+    fd[i] = newsockfd;
+    if (!ws && !tls && !rudp) {
+        fastPaths(newsockfd);
+    }
+    nick[i] = 0;
+    gen[i]++;
+    movedAt[i] = 0;
+    peerName(newsockfd, peer[i], sizeof(peer[i]));
+    inUsed[i] = inChecked[i] = 0;
+    nClient += 1;
+    // Without a free stack the connection keeps the callback path
+    sess[i].fd = fd;
+    sess[i].i = i;
+    co[i] = coOn() ? coNew(session, &sess[i]) : NULL;
+    // Its session sends on what the socket does not take at once
+    if (co[i] != NULL && !tls && !rudp && tlsQueue(newsockfd) < 0) {
+        perror("S: admit non-blocking error");
+    }
+    printf("S: client %d connected%s", i + 1,
+           ws ? " (WebSocket)" : tls ? " (TLS)"
+           : rudp ? " (reliable UDP)" : "");
+    printf(" n client %d\n", nClient);
+    if (!ws && !tls) {
+        welcome(fd, i);
+    }
+}
+
+void acceptClient(int *fd, int sockfd, int ws, int tls, int rudp) {
+    internet_domain_sockaddr cliAddr;
     socklen_t cliLen;
+    int newsockfd;
     int i;
+
+    if ((i = freeConnections(fd)) < 0) {
+        printf("S: no free channels\n");
+    } else {
+        cliLen = sizeof(cliAddr);
+        memset((char *)&cliAddr, 0, sizeof(cliAddr));
+        newsockfd = rudp ? rudpAccept(sockfd)
+                         : accept(sockfd, (struct sockaddr *)&cliAddr, &cliLen);
+        if (newsockfd < 0) {
+            if (errno != EAGAIN) {
+                perror("S: main accept error");
+            }
+        } else {
+            admit(fd, i, newsockfd, ws, tls, rudp);
+        }
+    }
+}
+
+/* connections the accept thread handed to this loop */
+void adoptClients(int *fd) {
+    int newsockfd;
+    int i;
+
+    while ((newsockfd = accTake(0)) > -1) {
+        if ((i = freeConnections(fd)) < 0) {
+            // Another listener took the slot since this loop last reported
+            printf("S: no free channels\n");
+            close(newsockfd);
+        } else {
+            admit(fd, i, newsockfd, 0, 0, 0);
+        }
+    }
+}
+
+/* SIGTERM or SIGINT: note where ids got to, so a restart need not skip ahead */
+static void stop(int sig) {
+    (void)sig;
+    idStop();
+    _exit(0);
+}
+
+int main() {
+    int sockfd, wsfd, tlsfd = -1, authfd, rudpfd, accfd = -1, curfd;
+    int nfds;
+    int i, ms, ready;
+    long us;
     int fd[MAXCON];
-    fd_set rfds;
-    fd_set afds;
+    fd_set rfds, wfds;
+    struct timeval tick;
+    struct timespec busy, done;
     internet_domain_sockaddr serAddr;
-    internet_domain_sockaddr cliAddr;
+    internet_domain_sockaddr wsAddr;
+    internet_domain_sockaddr tlsAddr;
+    internet_domain_sockaddr curAddr;
+    struct authResult verdict;
+
+    // Writes to a vanished peer fail with EPIPE instead of killing us
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, stop);
+    signal(SIGINT, stop);
 
-    if ((sockfd = openSocket(&serAddr)) < 0) {
+    // CHAT_PREFAULT warms the heap and tables up front, empty for the default
+    bootInit(getenv("CHAT_PREFAULT") == NULL ? 0
+             : *getenv("CHAT_PREFAULT") ? strtoul(getenv("CHAT_PREFAULT"), NULL, 0)
+                                        : BOOT_HEAP);
+    if (getenv("CHAT_PREFAULT") != NULL) {
+        internReserve(BOOT_INTERN);
+    }
+    // Listen first, so clients queue in the backlog while we start up
+    if ((sockfd = openListener(&serAddr, 5900, 0)) < 0) {
         exit(0);
     }
-    if (listen(sockfd, MAXCON) < 0) {
-        perror("S: listen error");
+    if (idInit(getenv("CHAT_NODE_ID") ? atoi(getenv("CHAT_NODE_ID")) : 0,
+               ID_FILE) < 0) {
         exit(1);
-    } else {
-        printf("S: listening...\n");
+    }
+    // CHAT_NODES lists the servers of a cluster, this one at CHAT_NODE_ID,
+    // all sharing CHAT_NODE_KEY
+    if (getenv("CHAT_NODES") != NULL &&
+        nodeInit(getenv("CHAT_NODES"),
+                 getenv("CHAT_NODE_ID") ? atoi(getenv("CHAT_NODE_ID")) : 0,
+                 getenv("CHAT_NODE_KEY")) < 0) {
+        exit(1);
+    }
+    // CHAT_RATE="user,address[,seconds]" limits messages, across the cluster
+    if (getenv("CHAT_RATE") != NULL) {
+        int user = QUOTA_USER, addr = QUOTA_ADDR, win = QUOTA_WINDOW;
+        sscanf(getenv("CHAT_RATE"), "%d,%d,%d", &user, &addr, &win);
+        quotaInit(user, addr, win);
+    }
+    timerInit(time(NULL));
+    if (mboxInit(MBOX_DIR) < 0) {
+        exit(1);
+    }
+    if (schedInit(SCHED_HEAP, SCHED_DATA) < 0) {
+        exit(1);
+    }
+    if (histInit(HIST_DIR, getenv("CHAT_HIST_BUDGET")
+                               ? strtoul(getenv("CHAT_HIST_BUDGET"), NULL, 0)
+                               : HIST_BUDGET) < 0) {
+        exit(1);
+    }
+    printf("S: listening...\n");
+    // CHAT_CORO runs each connection's receive path as a coroutine
+    if (getenv("CHAT_CORO") != NULL) {
+        coInit(CO_STACK);
+    }
+    // CHAT_ACCEPTOR moves accept() for the main port onto its own thread
+    if (getenv("CHAT_ACCEPTOR") != NULL && accInit(sockfd, 1, MAXCON) == 0) {
+        accfd = accFd(0);
+    }
+    // The WebSocket gateway is optional: run without it if the port is taken
+    wsfd = openListener(&wsAddr, WS_PORT, 0);
+    // Log subscribers get their own port, outside the chat slots. It has
+    // no login, so only this host reaches it unless CHAT_CURSOR_ANY is set
+    if ((curfd = openListener(&curAddr, CURSOR_PORT,
+                              getenv("CHAT_CURSOR_ANY") == NULL)) > -1 &&
+        curInit(CURSOR_DIR, curfd) < 0) {
+        close(curfd);
+    }
+    // Experimental zero-copy fan-out from CHAT_ZC bytes, with no default
+    // for the same reason as CHAT_KFAN below
+    if (getenv("CHAT_ZC") != NULL) {
+        zcInit(strtoul(getenv("CHAT_ZC"), NULL, 0));
+    }
+    // Experimental tee() fan-out from CHAT_KFAN bytes. There is no default:
+    // chat lines are far below any size where it pays off
+    if (getenv("CHAT_KFAN") != NULL) {
+        kfanInit(strtoul(getenv("CHAT_KFAN"), NULL, 0));
+    }
+    // Reliable UDP for lossy links, also optional
+    rudpfd = rudpListen(RUDP_PORT);
+    // TLS listener only when a certificate is configured
+    if (getenv("CHAT_TLS_CERT") != NULL) {
+        // The key may live in the certificate file
+        if (tlsServerInit(getenv("CHAT_TLS_CERT"),
+                          getenv("CHAT_TLS_KEY") ? getenv("CHAT_TLS_KEY")
+                                                 : getenv("CHAT_TLS_CERT")) < 0) {
+            exit(1);
+        }
+        tlsfd = openListener(&tlsAddr, TLS_PORT, 0);
+    }
+    if ((authfd = authInit(AUTH_DIR,
+                           getenv("CHAT_AUTH_WORKERS")
+                               ? atoi(getenv("CHAT_AUTH_WORKERS"))
+                               : AUTH_WORKERS,
+                           getenv("CHAT_AUTH_KEY"))) < 0) {
+        printf("S: login disabled\n");
+    }
+    // Multicast delivery is opt-in, CHAT_MCAST names the base group
+    if (getenv("CHAT_MCAST") != NULL &&
+        mcastInit(*getenv("CHAT_MCAST") ? getenv("CHAT_MCAST") : MCAST_GROUP,
+                  getenv("CHAT_MCAST_IF") ? getenv("CHAT_MCAST_IF") : MCAST_IF,
+                  MCAST_PORT) < 0) {
+        printf("S: multicast disabled\n");
     }
 
     nfds = FD_SETSIZE;
@@ -208,41 +1416,129 @@ int main() {
     for (i = 0; i < MAXCON; i++) {
         fd[i] = -1;
     }
+    // CHAT_SNAPSHOT forks a state snapshot every so many seconds, empty for
+    // the default
+    if (getenv("CHAT_SNAPSHOT") != NULL &&
+        (snapEvery = *getenv("CHAT_SNAPSHOT") ? atoi(getenv("CHAT_SNAPSHOT"))
+                                               : SNAP_EVERY) > 0) {
+        snapTimer.fire = snapTick;
+        snapTimer.arg = fd;
+        timerArm(&snapTimer, time(NULL) + snapEvery);
+    }
+    // Private messages find users on the other servers through the directory
+    if (nodeActive()) {
+        struct dirOps ops = {dirDeliver, dirDrop, dirResult, fd};
+        dirInit(&ops);
+    }
+    // CHAT_REDIRECT moves clients to a quieter server past the given load,
+    // empty for the default percentage
+    if (getenv("CHAT_REDIRECT") != NULL) {
+        struct redirOps ops = {redirReady, fd};
+        redirInit(MAXCON, atoi(getenv("CHAT_REDIRECT")), &ops);
+    }
+    if (redirOn()) {
+        redirTimer.fire = moveTick;
+        redirTimer.arg = fd;
+        timerArm(&redirTimer, time(NULL) + REDIR_EVERY);
+    }
 
     /* PASSIVE SOCKET MASK INITIALIZATION */
     FD_ZERO(&afds);
 
     /* PASSIVE SOCKET MASK SET */
-    FD_SET(sockfd, &afds);
+    FD_SET(accfd > -1 ? accfd : sockfd, &afds);
+    if (wsfd > -1) {
+        FD_SET(wsfd, &afds);
+    }
+    if (tlsfd > -1) {
+        FD_SET(tlsfd, &afds);
+    }
+    if (authfd > -1) {
+        FD_SET(authfd, &afds);
+    }
+    if (rudpfd > -1) {
+        FD_SET(rudpfd, &afds);
+    }
+
+    bootServing();
 
     /* CONNECTIONS MANAGEMENT LOOP */
     while (1) {
         /* COPIES DUMMY MASK IN THE READ MASK */
         memcpy((char *)&rfds, (char *)&afds, sizeof(rfds));
+        FD_ZERO(&wfds);
+        curFds(&rfds, &wfds);
+        tlsFds(&wfds);
+        nodeFds(&rfds);
 
-        /* BLOCKING SELECT */
-        if (select(nfds, &rfds, (fd_set *)0, (fd_set *)0, (struct timeval *)0) <
-            0) {
+        /* SELECT, WAKING UP EVERY SECOND FOR THE TIMER WHEEL */
+        /* OR SOONER FOR A UDP RETRANSMISSION */
+        ms = rudpTimeout();
+        if ((i = dirTimeout()) > -1 && (ms < 0 || i < ms)) {
+            ms = i;
+        }
+        if ((i = quotaTimeout()) > -1 && (ms < 0 || i < ms)) {
+            ms = i;
+        }
+        if ((i = redirTimeout()) > -1 && (ms < 0 || i < ms)) {
+            ms = i;
+        }
+        if ((i = histTimeout()) > -1 && (ms < 0 || i < ms)) {
+            ms = i;
+        }
+        if ((i = schedTimeout()) > -1 && (ms < 0 || i < ms)) {
+            ms = i;
+        }
+        tick.tv_sec = (ms < 0 || ms >= 1000) ? 1 : 0;
+        tick.tv_usec = (ms < 0 || ms >= 1000) ? 0 : ms * 1000;
+        if ((ready = select(nfds, &rfds, &wfds, (fd_set *)0, &tick)) < 0) {
             perror("S: main select error");
+            FD_ZERO(&rfds);
+            FD_ZERO(&wfds);
         }
+        clock_gettime(CLOCK_MONOTONIC, &busy);
+        rudpTick();
+        nodeRun(&rfds);
+        dirTick();
+        quotaTick();
+        redirTick();
+        histTick();
+        snapPoll();
+        timerRun(time(NULL));
+        schedRun(time(NULL), deliver, fd);
+        schedTick();
 
         /* NEW CONNECTIONS MANAGEMENT */
-        if (FD_ISSET(sockfd, &rfds)) {
-            if ((i = freeConnections(fd)) < 0) {
-                printf("S: no free channels\n");
-            } else {
-                cliLen = sizeof(cliAddr);
-                memset((char *)&cliAddr, 0, sizeof(cliAddr));
-                newsockfd =
-                    accept(sockfd, (struct sockaddr *)&cliAddr, &cliLen);
-                if (newsockfd < 0) {
-                    perror("S: main accept error");
+        if (accfd > -1 && FD_ISSET(accfd, &rfds)) {
+            adoptClients(fd);
+        } else if (accfd < 0 && FD_ISSET(sockfd, &rfds)) {
+            acceptClient(fd, sockfd, 0, 0, 0);
+        }
+        if (wsfd > -1 && FD_ISSET(wsfd, &rfds)) {
+            acceptClient(fd, wsfd, 1, 0, 0);
+        }
+        if (tlsfd > -1 && FD_ISSET(tlsfd, &rfds)) {
+            acceptClient(fd, tlsfd, 0, 1, 0);
+        }
+        if (rudpfd > -1 && FD_ISSET(rudpfd, &rfds)) {
+            acceptClient(fd, rudpfd, 0, 0, 1);
+        }
+
+        /* LOG SUBSCRIBERS, EACH AT ITS OWN PACE */
+        curRun(&rfds, &wfds);
+        tlsRun(&wfds);
+
+        /* LOGIN VERDICTS FROM THE WORKERS */
+        if (authfd > -1 && FD_ISSET(authfd, &rfds)) {
+            while (authDone(&verdict)) {
+                // The client may have gone, or its slot been reused
+                if (fd[verdict.slot] < 0 || gen[verdict.slot] != verdict.gen) {
+                    continue;
+                }
+                if (verdict.ok) {
+                    login(fd, verdict.slot, verdict.nick, verdict.created);
                 } else {
-                    FD_SET(newsockfd, &afds);
-                    fd[i] = newsockfd;
-                    nClient += 1;
-                    printf("S: client %d connected", i + 1);
-                    printf(" n client %d\n", nClient);
+                    notify(fd[verdict.slot], "S: login failed\n");
                 }
             }
         }
@@ -250,18 +1546,32 @@ int main() {
         /* CLIENTS CONNECTED MANAGEMENT */
         for (i = 0; i < MAXCON; i++) {
             if (fd[i] > -1) {
-                if (FD_ISSET(fd[i], &rfds)) {
+                // A reliable UDP peer that stopped acking reads as an error
+                if (FD_ISSET(fd[i], &rfds) || rudpDead(fd[i]) ||
+                    (co[i] != NULL && FD_ISSET(fd[i], &wfds))) {
                     if (communication(fd, i) < 0) {
-                        FD_CLR(fd[i], &afds);
-                        close(fd[i]);
-                        fd[i] = -1;
-                        nClient -= 1;
+                        dropClient(fd, i);
                         printf("S: client %d disconnected", i + 1);
                         printf(" n client %d\n", nClient);
                     }
                 }
             }
         } /* for */
+
+        /* LINES FOR OTHER SERVERS LEAVE TOGETHER, ONCE PER PASS */
+        nodeFlush();
+
+        /* TIME BUSY: STARTUP LATENCY, AND LOAD SEEN BY THE ACCEPT THREAD */
+        clock_gettime(CLOCK_MONOTONIC, &done);
+        us = (done.tv_sec - busy.tv_sec) * 1000000L +
+             (done.tv_nsec - busy.tv_nsec) / 1000;
+        if (ready > 0) {
+            bootPass(us);
+        }
+        if (accfd > -1) {
+            accLoad(0, nClient, us);
+        }
+        redirBusy(us);
     } /* while */
     return 0;
 } /* main */
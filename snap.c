@@ -0,0 +1,186 @@
+/* *
+ * Name: snap.c                                                     *
+ *                                                                  *
+ * Description: copy-on-write fork snapshots of server state        *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+#include "snap.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The child gets a copy-on-write view of the whole process at the
+ * moment of fork(), so it can walk the rooms and clients at leisure
+ * while the parent goes on serving. Every page either side writes to
+ * afterwards is copied once; the child counts those as its private
+ * dirty memory and reports them through a pipe before it exits.
+ */
+
+struct snapResult {
+    int ok;
+    unsigned long bytes;
+    unsigned long cowKiB; /* pages copied since the fork */
+    long writeUs;
+};
+
+static pid_t child = -1;
+static int resultFd = -1;
+
+/* statistics */
+static unsigned long nDone, nFailed;
+static long forkUs, lastUs, maxUs;
+static unsigned long lastBytes, lastCow, maxCow;
+
+static long usSince(const struct timespec *t0) {
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1000000L +
+           (t1.tv_nsec - t0->tv_nsec) / 1000;
+}
+
+static unsigned long privateDirty(void) {
+    char line[128];
+    unsigned long kb = 0;
+    FILE *f;
+
+    if ((f = fopen("/proc/self/smaps_rollup", "r")) == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "Private_Dirty: %lu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+void snapStr(FILE *out, const char *s) {
+    size_t len = strlen(s);
+    unsigned char n = len > 255 ? 255 : (unsigned char)len;
+
+    fwrite(&n, 1, 1, out);
+    fwrite(s, 1, n, out);
+}
+
+static void run(const char *path, snapWriter fn, void *arg, int report) {
+    struct snapResult res = {0, 0, 0, 0};
+    struct timespec t0;
+    struct stat st;
+    char tmp[256];
+    FILE *out;
+    int sd;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    // Holding the parent's sockets would keep closed connections open
+    for (sd = 3; sd < FD_SETSIZE; sd++) {
+        if (sd != report && fstat(sd, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            close(sd);
+        }
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((out = fopen(tmp, "w")) != NULL) {
+        res.ok = fn(out, arg) == 0 && fflush(out) == 0 &&
+                 fsync(fileno(out)) == 0;
+        res.bytes = (unsigned long)ftell(out);
+        res.ok = fclose(out) == 0 && res.ok && rename(tmp, path) == 0;
+    }
+    res.cowKiB = privateDirty();
+    res.writeUs = usSince(&t0);
+    if (!res.ok) {
+        unlink(tmp);
+    }
+    if (write(report, &res, sizeof(res)) != sizeof(res)) {
+        perror("S: snapshot report error");
+    }
+    _exit(res.ok ? 0 : 1);
+}
+
+int snapStart(const char *path, snapWriter fn, void *arg) {
+    struct timespec t0;
+    int pfd[2];
+
+    if (child > 0) {
+        return -1;
+    }
+    if (pipe(pfd) < 0) {
+        perror("S: snapshot pipe error");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if ((child = fork()) < 0) {
+        perror("S: snapshot fork error");
+        close(pfd[0]);
+        close(pfd[1]);
+        return -1;
+    }
+    if (child == 0) {
+        close(pfd[0]);
+        run(path, fn, arg, pfd[1]);
+    }
+    // The time the loop stood still: copying the page tables
+    forkUs = usSince(&t0);
+    close(pfd[1]);
+    resultFd = pfd[0];
+    return 0;
+}
+
+int snapBusy(void) { return child > 0; }
+
+/* reaps a finished child, call once per pass */
+void snapPoll(void) {
+    struct snapResult res;
+    int status;
+
+    if (child <= 0 || waitpid(child, &status, WNOHANG) <= 0) {
+        return;
+    }
+    if (read(resultFd, &res, sizeof(res)) == sizeof(res) && res.ok &&
+        WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        // Timed by the child: the loop may only notice it a tick later
+        lastUs = res.writeUs;
+        maxUs = lastUs > maxUs ? lastUs : maxUs;
+        nDone++;
+        lastBytes = res.bytes;
+        lastCow = res.cowKiB;
+        maxCow = lastCow > maxCow ? lastCow : maxCow;
+    } else {
+        nFailed++;
+        printf("S: snapshot failed\n");
+    }
+    close(resultFd);
+    resultFd = -1;
+    child = -1;
+}
+
+void snapReport(char *buf, size_t len) {
+    snprintf(buf, len,
+             "S: snapshots %lu failed %lu%s last %lu bytes in %ld ms "
+             "(max %ld) fork %ld us copied %lu KiB (max %lu)\n",
+             nDone, nFailed, child > 0 ? " running" : "", lastBytes,
+             lastUs / 1000, maxUs / 1000, forkUs, lastCow, maxCow);
+}
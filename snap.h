@@ -0,0 +1,53 @@
+/* *
+ * Name: snap.h                                                     *
+ *                                                                  *
+ * Description: fork snapshot include file                          *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+#ifndef __SNAP_H
+#define __SNAP_H
+
+#include <stdio.h>
+
+#define SNAP_FILE "snapshot.bin"
+#define SNAP_EVERY 300          /* default seconds between snapshots */
+#define SNAP_MAGIC 0x31534e43u  /* "CNS1" */
+
+/*
+ * File layout, integers in host byte order, strings as a length byte
+ * followed by that many bytes:
+ *
+ *   u32 magic, u32 rooms, u32 clients, u64 time
+ *   per room:   str name, i32 ttl, u32 members, u32 mcast next,
+ *               u64 history log bytes
+ *   per client: u16 slot, str nick, str room, u8 flags (SNAP_*)
+ */
+#define SNAP_QUIET 1
+#define SNAP_AUTHED 2
+#define SNAP_MCAST 4
+
+/* runs in the child on the frozen state, 0 on success */
+typedef int (*snapWriter)(FILE *out, void *arg);
+
+int snapStart(const char *path, snapWriter fn, void *arg);
+int snapBusy(void);
+void snapPoll(void);
+void snapStr(FILE *out, const char *s);
+void snapReport(char *buf, size_t len);
+
+#endif
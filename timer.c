@@ -0,0 +1,101 @@
+/* *
+ * Name: timer.c                                                    *
+ *                                                                  *
+ * Description: hashed timer wheel                                  *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "timer.h"
+#include <stddef.h>
+
+/*
+ * Timers hash into TIMER_SLOTS one second slots by expiry time. Arming
+ * and cancelling are O(1); each tick only visits the slots the clock
+ * moved over, and a timer further away than one turn of the wheel just
+ * stays in its slot until its round comes.
+ */
+
+static struct timer wheel[TIMER_SLOTS]; /* list heads */
+static time_t lastTick;
+
+void timerInit(time_t now) {
+    int k;
+
+    for (k = 0; k < TIMER_SLOTS; k++) {
+        wheel[k].prev = wheel[k].next = &wheel[k];
+    }
+    lastTick = now;
+}
+
+void timerCancel(struct timer *t) {
+    if (t->armed) {
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        t->prev = t->next = NULL;
+        t->armed = 0;
+    }
+}
+
+void timerArm(struct timer *t, time_t when) {
+    struct timer *head;
+
+    timerCancel(t);
+    if (when <= lastTick) {
+        when = lastTick + 1;
+    }
+    head = &wheel[when % TIMER_SLOTS];
+    t->when = when;
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    t->armed = 1;
+}
+
+void timerRun(time_t now) {
+    struct timer due;
+    struct timer *head, *t, *next;
+    time_t tick;
+
+    if (now - lastTick > TIMER_SLOTS) {
+        // Clock jumped: one full turn visits every slot
+        lastTick = now - TIMER_SLOTS;
+    }
+    for (tick = lastTick + 1; tick <= now; tick++) {
+        // Detach the due timers first, callbacks may re-arm into this slot
+        due.prev = due.next = &due;
+        head = &wheel[tick % TIMER_SLOTS];
+        for (t = head->next; t != head; t = next) {
+            next = t->next;
+            if (t->when <= now) {
+                t->prev->next = t->next;
+                t->next->prev = t->prev;
+                t->next = &due;
+                t->prev = due.prev;
+                due.prev->next = t;
+                due.prev = t;
+            }
+        }
+        lastTick = tick;
+        while ((t = due.next) != &due) {
+            due.next = t->next;
+            t->next->prev = &due;
+            t->prev = t->next = NULL;
+            t->armed = 0;
+            t->fire(t->arg);
+        }
+    }
+}
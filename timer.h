@@ -0,0 +1,43 @@
+/* *
+ * Name: timer.h                                                    *
+ *                                                                  *
+ * Description: timer wheel include file                            *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __TIMER_H
+#define __TIMER_H
+
+#include <time.h>
+
+#define TIMER_SLOTS 256 /* one second per slot */
+
+/* embedded in the object it belongs to, never allocated by the wheel */
+struct timer {
+    struct timer *prev;
+    struct timer *next;
+    time_t when;
+    void (*fire)(void *arg);
+    void *arg;
+    int armed;
+};
+
+void timerInit(time_t now);
+void timerArm(struct timer *t, time_t when);
+void timerCancel(struct timer *t);
+void timerRun(time_t now);
+
+#endif
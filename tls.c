@@ -0,0 +1,506 @@
+/* *
+ * Name: tls.c                                                      *
+ *                                                                  *
+ * Description: TLS termination with kernel TLS offload             *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "tls.h"
+#include "rudp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * OpenSSL only does the handshake. With SSL_OP_ENABLE_KTLS it then
+ * installs the session keys in the socket (setsockopt TCP_ULP "tls"
+ * plus TLS_TX/TLS_RX), and from that point the kernel encrypts: a
+ * kTLS socket takes plain writev() - and sendfile() - so the fan-out
+ * path writes to it exactly as to a plaintext one. When the kernel or
+ * the negotiated cipher has no kTLS support the same descriptor calls
+ * fall back to SSL_read()/SSL_write() in user space.
+ *
+ * Sockets stay non-blocking after the handshake. What the send buffer
+ * does not take waits in a per-socket queue, up to TLS_QUEUE, and the
+ * main loop sends it on when select() finds the socket writable.
+ * tlsQueue() gives a plaintext socket the same queue; the caller then
+ * sends it on itself with tlsFlush().
+ *
+ * Built without CHAT_TLS the calls below are plain socket calls and
+ * the init functions fail, so the TLS listener is simply not opened.
+ */
+
+#ifdef CHAT_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+struct outq {
+    char *data;
+    size_t off, len, cap;
+    size_t retry;  /* user space: bytes SSL_write() last wanted again */
+    int wantRead;  /* user space: SSL_write() waits for the peer */
+};
+
+static SSL_CTX *ctx;
+static SSL *ssl[FD_SETSIZE];
+static unsigned char ready[FD_SETSIZE];
+static unsigned char plain[FD_SETSIZE]; /* plaintext, writes queued */
+static struct outq q[FD_SETSIZE];
+static int nQueued; /* sockets with something in their queue */
+
+/* statistics */
+static unsigned long nKernelTx, nKernelRx, nUser, nFailed, nFull;
+static unsigned long long userBytes, queuedBytes;
+
+static int drain(SSL *s, int sd);
+
+static SSL *get(int sd) {
+    return (sd >= 0 && sd < FD_SETSIZE) ? ssl[sd] : NULL;
+}
+
+static int kernelTx(SSL *s) { return BIO_get_ktls_send(SSL_get_wbio(s)); }
+
+static int kernelRx(SSL *s) { return BIO_get_ktls_recv(SSL_get_rbio(s)); }
+
+static SSL_CTX *newCtx(const SSL_METHOD *method) {
+    SSL_CTX *c;
+
+    if ((c = SSL_CTX_new(method)) == NULL) {
+        ERR_print_errors_fp(stderr);
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(c, TLS1_2_VERSION);
+    // A peer closing without close_notify is an ordinary disconnect
+    SSL_CTX_set_options(c, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // A queued write is retried from wherever the queue has moved it
+    SSL_CTX_set_mode(c, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // Ciphers the kernel can take over come first
+    SSL_CTX_set_ciphersuites(c, "TLS_AES_128_GCM_SHA256:"
+                                "TLS_AES_256_GCM_SHA384:"
+                                "TLS_CHACHA20_POLY1305_SHA256");
+    SSL_CTX_set_cipher_list(c, "ECDHE+AESGCM:ECDHE+CHACHA20");
+    return c;
+}
+
+int tlsServerInit(const char *cert, const char *key) {
+    if ((ctx = newCtx(TLS_server_method())) == NULL) {
+        return -1;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1) {
+        fprintf(stderr, "S: tlsServerInit cannot load %s / %s\n", cert, key);
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int tlsClientInit(const char *ca) {
+    if ((ctx = newCtx(TLS_client_method())) == NULL) {
+        return -1;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    if ((ca != NULL && SSL_CTX_load_verify_locations(ctx, ca, NULL) != 1) ||
+        (ca == NULL && SSL_CTX_set_default_verify_paths(ctx) != 1)) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    return 0;
+}
+
+static void done(int sd, SSL *s, const char *who) {
+    ready[sd] = 1;
+    if (kernelTx(s)) {
+        nKernelTx++;
+    }
+    if (kernelRx(s)) {
+        nKernelRx++;
+    }
+    if (!kernelTx(s) || !kernelRx(s)) {
+        nUser++;
+    }
+    printf("%s: %s %s, kTLS tx %s rx %s\n", who, SSL_get_version(s),
+           SSL_get_cipher_name(s), kernelTx(s) ? "on" : "off",
+           kernelRx(s) ? "on" : "off");
+}
+
+int tlsAccept(int sd) {
+    if (ctx == NULL || sd < 0 || sd >= FD_SETSIZE ||
+        (ssl[sd] = SSL_new(ctx)) == NULL) {
+        return -1;
+    }
+    SSL_set_fd(ssl[sd], sd);
+    ready[sd] = 0;
+    // Stays non-blocking: select() may flag a socket holding only part
+    // of a record, and a blocking SSL_read() would then stall the loop
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+int tlsHandshake(int sd) {
+    SSL *s = get(sd);
+    int r;
+
+    if (s == NULL || ready[sd]) {
+        return 1;
+    }
+    ERR_clear_error();
+    if ((r = SSL_accept(s)) == 1) {
+        done(sd, s, "S");
+        return 1;
+    }
+    r = SSL_get_error(s, r);
+    if (r == SSL_ERROR_WANT_READ || r == SSL_ERROR_WANT_WRITE) {
+        return 0;
+    }
+    nFailed++;
+    ERR_print_errors_fp(stderr);
+    return -1;
+}
+
+int tlsConnect(int sd, const char *host) {
+    SSL *s;
+
+    if (ctx == NULL || sd < 0 || sd >= FD_SETSIZE ||
+        (s = ssl[sd] = SSL_new(ctx)) == NULL) {
+        return -1;
+    }
+    SSL_set_fd(s, sd);
+    SSL_set_tlsext_host_name(s, host);
+    SSL_set1_host(s, host);
+    if (SSL_connect(s) != 1) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    done(sd, s, "C");
+    return 0;
+}
+
+static void drop(int sd) {
+    nQueued -= q[sd].off < q[sd].len;
+    free(q[sd].data);
+    memset(&q[sd], 0, sizeof(q[sd]));
+}
+
+void tlsClose(int sd) {
+    SSL *s = get(sd);
+
+    if (sd >= 0 && sd < FD_SETSIZE && plain[sd]) {
+        drop(sd);
+        plain[sd] = 0;
+    }
+    if (s != NULL) {
+        drop(sd);
+        if (ready[sd]) {
+            SSL_shutdown(s);
+        }
+        SSL_free(s);
+        ssl[sd] = NULL;
+        ready[sd] = 0;
+    }
+}
+
+int tlsIs(int sd) { return get(sd) != NULL; }
+
+int tlsQueue(int sd) {
+    if (sd < 0 || sd >= FD_SETSIZE || get(sd) != NULL ||
+        fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK) < 0) {
+        return -1;
+    }
+    plain[sd] = 1;
+    return 0;
+}
+
+int tlsKernelTx(int sd) {
+    SSL *s = get(sd);
+
+    return s != NULL && ready[sd] && kernelTx(s);
+}
+
+int tlsReady(int sd) { return get(sd) == NULL || ready[sd]; }
+
+int tlsPending(int sd) {
+    SSL *s = get(sd);
+
+    return s != NULL && ready[sd] && SSL_pending(s) > 0;
+}
+
+ssize_t tlsRecv(int sd, void *buf, size_t len) {
+    SSL *s = get(sd);
+    int n;
+
+    if (s == NULL) {
+        return rudpRecv(sd, buf, len);
+    }
+    // A queued write that needed something from the peer goes first
+    if (q[sd].wantRead) {
+        q[sd].wantRead = 0;
+        if (drain(s, sd) < 0) {
+            return -1;
+        }
+    }
+    // SSL_read() also covers kTLS RX: it picks up non-data records
+    ERR_clear_error();
+    errno = 0;
+    if ((n = SSL_read(s, buf, (int)len)) > 0) {
+        return n;
+    }
+    switch (SSL_get_error(s, n)) {
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN; // part of a record, or one without application data
+        return -1;
+    case SSL_ERROR_SYSCALL:
+        return errno != 0 ? -1 : 0;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+/* what a socket still has to send, after its send buffer filled up */
+static int queue(int sd, const char *p, size_t len) {
+    struct outq *o = &q[sd];
+    size_t need = o->len - o->off + len, cap;
+    char *grown;
+
+    if (need > TLS_QUEUE) {
+        nFull++;
+        errno = EAGAIN; // a reader this far behind is not coming back
+        return -1;
+    }
+    if (o->off > 0 && o->len + len > o->cap) {
+        // A pending SSL_write() may move along with its bytes
+        memmove(o->data, o->data + o->off, o->len - o->off);
+        o->len -= o->off;
+        o->off = 0;
+    }
+    if (o->len + len > o->cap) {
+        for (cap = o->cap ? o->cap : TLS_CHUNK; cap < o->len + len; cap *= 2) {
+        }
+        if ((grown = realloc(o->data, cap)) == NULL) {
+            return -1;
+        }
+        o->data = grown;
+        o->cap = cap;
+    }
+    if (o->len == o->off) {
+        nQueued++;
+    }
+    memcpy(o->data + o->len, p, len);
+    o->len += len;
+    queuedBytes += len;
+    return 0;
+}
+
+/* sends what the socket takes now: 0 when that is all of it or it is
+ * full, -1 when the connection is broken */
+static int drain(SSL *s, int sd) {
+    struct outq *o = &q[sd];
+    size_t n;
+    ssize_t w;
+    int r;
+
+    while (o->off < o->len) {
+        errno = 0;
+        if (s == NULL || kernelTx(s)) {
+            if ((w = write(sd, o->data + o->off, o->len - o->off)) > 0) {
+                o->off += (size_t)w;
+                continue;
+            }
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            return w < 0 && errno == EAGAIN ? 0 : -1;
+        }
+        // A retry must pass as many of the same bytes as the last try
+        n = o->retry ? o->retry : o->len - o->off;
+        n = n > TLS_CHUNK ? TLS_CHUNK : n;
+        ERR_clear_error();
+        if ((r = SSL_write(s, o->data + o->off, (int)n)) > 0) {
+            o->off += (size_t)r;
+            o->retry = 0;
+            userBytes += (size_t)r;
+            continue;
+        }
+        switch (SSL_get_error(s, r)) {
+        case SSL_ERROR_WANT_WRITE:
+            o->retry = n;
+            return 0;
+        case SSL_ERROR_WANT_READ:
+            o->retry = n;
+            o->wantRead = 1; // retried when the socket is readable
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            errno = errno != 0 ? errno : EPIPE;
+            return -1;
+        default:
+            errno = EPIPE;
+            return -1;
+        }
+    }
+    if (o->len > 0) {
+        o->off = o->len = 0;
+        nQueued--;
+    }
+    return 0;
+}
+
+/* a write that did not go through at once waits in the socket's queue,
+ * which the main loop sends on as the socket drains */
+ssize_t tlsWritev(int sd, const struct iovec *iov, int n) {
+    SSL *s = get(sd);
+    size_t total = 0, skip;
+    ssize_t w = 0;
+    int k;
+
+    if (s == NULL && (sd < 0 || sd >= FD_SETSIZE || !plain[sd])) {
+        return rudpWritev(sd, iov, n);
+    }
+    for (k = 0; k < n; k++) {
+        total += iov[k].iov_len;
+    }
+    // Straight to the kernel when nothing is waiting ahead of it
+    if ((s == NULL || kernelTx(s)) && q[sd].off == q[sd].len &&
+        (w = writev(sd, iov, n)) < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            return -1;
+        }
+        w = 0;
+    }
+    for (skip = (size_t)w, k = 0; k < n; k++) {
+        if (skip >= iov[k].iov_len) {
+            skip -= iov[k].iov_len;
+        } else if (queue(sd, (const char *)iov[k].iov_base + skip,
+                         iov[k].iov_len - skip) < 0) {
+            return -1;
+        } else {
+            skip = 0;
+        }
+    }
+    if (!q[sd].wantRead && drain(s, sd) < 0) {
+        return -1;
+    }
+    return (ssize_t)total;
+}
+
+int tlsQueued(int sd) {
+    return sd >= 0 && sd < FD_SETSIZE && q[sd].off < q[sd].len;
+}
+
+int tlsFlush(int sd) {
+    if (!tlsQueued(sd) || q[sd].wantRead) {
+        return 0;
+    }
+    if (drain(get(sd), sd) < 0) {
+        drop(sd);
+        return -1;
+    }
+    return 0;
+}
+
+/* sockets waiting for room to send their queue */
+void tlsFds(fd_set *out) {
+    int sd;
+
+    for (sd = 0; nQueued > 0 && sd < FD_SETSIZE; sd++) {
+        if (tlsQueued(sd) && !q[sd].wantRead) {
+            FD_SET(sd, out);
+        }
+    }
+}
+
+void tlsRun(fd_set *writable) {
+    int sd;
+
+    // A plaintext queue is its owner's to send on
+    for (sd = 0; nQueued > 0 && sd < FD_SETSIZE; sd++) {
+        if (ssl[sd] != NULL && tlsQueued(sd) && FD_ISSET(sd, writable) &&
+            drain(ssl[sd], sd) < 0) {
+            // The reader sees the end and drops the client as usual
+            shutdown(sd, SHUT_RDWR);
+            drop(sd);
+        }
+    }
+}
+
+void tlsReport(char *buf, size_t len) {
+    snprintf(buf, len,
+             "S: tls sessions kTLS tx %lu rx %lu user space %lu failed %lu "
+             "user space bytes %llu queued bytes %llu sockets waiting %d "
+             "overflowed %lu\n",
+             nKernelTx, nKernelRx, nUser, nFailed, userBytes, queuedBytes,
+             nQueued, nFull);
+}
+
+#else
+
+int tlsServerInit(const char *cert, const char *key) {
+    (void)cert;
+    (void)key;
+    fprintf(stderr, "S: built without TLS support\n");
+    return -1;
+}
+
+int tlsClientInit(const char *ca) {
+    (void)ca;
+    fprintf(stderr, "C: built without TLS support\n");
+    return -1;
+}
+
+int tlsAccept(int sd) { return (void)sd, -1; }
+int tlsHandshake(int sd) { return (void)sd, 1; }
+int tlsConnect(int sd, const char *host) { return (void)sd, (void)host, -1; }
+void tlsClose(int sd) { (void)sd; }
+int tlsIs(int sd) { return (void)sd, 0; }
+int tlsReady(int sd) { return (void)sd, 1; }
+int tlsPending(int sd) { return (void)sd, 0; }
+
+ssize_t tlsRecv(int sd, void *buf, size_t len) {
+    return rudpRecv(sd, buf, len);
+}
+
+ssize_t tlsWritev(int sd, const struct iovec *iov, int n) {
+    return rudpWritev(sd, iov, n);
+}
+
+int tlsKernelTx(int sd) { return (void)sd, 0; }
+int tlsQueue(int sd) { return (void)sd, -1; }
+int tlsQueued(int sd) { return (void)sd, 0; }
+int tlsFlush(int sd) { return (void)sd, 0; }
+void tlsFds(fd_set *out) { (void)out; }
+void tlsRun(fd_set *writable) { (void)writable; }
+
+void tlsReport(char *buf, size_t len) { snprintf(buf, len, "S: tls off\n"); }
+
+#endif
+
+ssize_t tlsSend(int sd, const void *buf, size_t len) {
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    return tlsWritev(sd, &iov, 1);
+}
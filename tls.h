@@ -0,0 +1,53 @@
+/* *
+ * Name: tls.h                                                      *
+ *                                                                  *
+ * Description: TLS termination include file                        *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __TLS_H
+#define __TLS_H
+
+#include <stddef.h>
+#include <sys/select.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define TLS_PORT 5902
+#define TLS_CHUNK 16384 /* one TLS record worth of plaintext */
+#define TLS_QUEUE (256 * 1024) /* bytes a socket may have waiting to go out */
+
+int tlsServerInit(const char *cert, const char *key);
+int tlsClientInit(const char *ca);
+int tlsAccept(int sd);
+int tlsHandshake(int sd);
+int tlsConnect(int sd, const char *host);
+void tlsClose(int sd);
+int tlsIs(int sd);
+int tlsReady(int sd);
+int tlsPending(int sd);
+int tlsKernelTx(int sd);
+int tlsQueue(int sd);
+int tlsQueued(int sd);
+int tlsFlush(int sd);
+void tlsFds(fd_set *out);
+void tlsRun(fd_set *writable);
+ssize_t tlsRecv(int sd, void *buf, size_t len);
+ssize_t tlsWritev(int sd, const struct iovec *iov, int n);
+ssize_t tlsSend(int sd, const void *buf, size_t len);
+void tlsReport(char *buf, size_t len);
+
+#endif
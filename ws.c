@@ -0,0 +1,493 @@
+/* *
+ * Name: ws.c                                                       *
+ *                                                                  *
+ * Description: WebSocket gateway, handshake and framing            *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "ws.h"
+#include "json.h"
+#include "tls.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * WebSocket clients share the slots, the event loop and the fan-out of
+ * native clients; only the bytes on the wire differ. wsRecv() turns
+ * frames back into the line stream communication() already parses (a
+ * newline closes every message), and everything written to a WebSocket
+ * client leaves as one text frame per write. State is kept per socket
+ * descriptor, so modules that only know a descriptor - history replay,
+ * mailbox drain - frame their writes by calling wsWritev().
+ */
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define OP_CONT 0x0
+#define OP_TEXT 0x1
+#define OP_BINARY 0x2
+#define OP_CLOSE 0x8
+#define OP_PING 0x9
+#define OP_PONG 0xa
+
+struct wsConn {
+    int open;          /* handshake done */
+    size_t used;       /* bytes in in[] */
+    char in[WS_BUF + 1];
+};
+
+static struct wsConn *conn[FD_SETSIZE];
+
+/* SHA-1 of a short message, only for the Sec-WebSocket-Accept value */
+static void sha1(const unsigned char *msg, size_t len, unsigned char out[20]) {
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                     0xc3d2e1f0};
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    unsigned char buf[192];
+    size_t total = (len + 8) / 64 * 64 + 64, off;
+    int i;
+
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, msg, len);
+    buf[len] = 0x80;
+    for (i = 0; i < 8; i++) {
+        buf[total - 1 - i] = (unsigned char)((uint64_t)len * 8 >> (8 * i));
+    }
+    for (off = 0; off < total; off += 64) {
+        for (i = 0; i < 16; i++) {
+            w[i] = (uint32_t)buf[off + 4 * i] << 24 |
+                   (uint32_t)buf[off + 4 * i + 1] << 16 |
+                   (uint32_t)buf[off + 4 * i + 2] << 8 | buf[off + 4 * i + 3];
+        }
+        for (i = 16; i < 80; i++) {
+            t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = t << 1 | t >> 31;
+        }
+        a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (i = 0; i < 80; i++) {
+            if (i < 20) {
+                f = (b & c) | (~b & d), k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d, k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d), k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d, k = 0xca62c1d6;
+            }
+            t = (a << 5 | a >> 27) + f + e + k + w[i];
+            e = d, d = c, c = b << 30 | b >> 2, b = a, a = t;
+        }
+        h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
+    }
+    for (i = 0; i < 20; i++) {
+        out[i] = (unsigned char)(h[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+static void base64(const unsigned char *in, size_t len, char *out) {
+    static const char tab[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t j;
+    uint32_t v;
+
+    for (j = 0; j < len; j += 3) {
+        v = (uint32_t)in[j] << 16;
+        v |= (j + 1 < len) ? (uint32_t)in[j + 1] << 8 : 0;
+        v |= (j + 2 < len) ? in[j + 2] : 0;
+        *out++ = tab[v >> 18];
+        *out++ = tab[(v >> 12) & 63];
+        *out++ = (j + 1 < len) ? tab[(v >> 6) & 63] : '=';
+        *out++ = (j + 2 < len) ? tab[v & 63] : '=';
+    }
+    *out = '\0';
+}
+
+/* XOR with the 4-byte masking key, 32 or 16 bytes per step */
+static void unmask(unsigned char *dst, const unsigned char *src, size_t len,
+                   const unsigned char *key) {
+    size_t j = 0;
+    int32_t k;
+
+    memcpy(&k, key, 4);
+#if defined(__AVX2__)
+    __m256i m8 = _mm256_set1_epi32(k);
+    for (; j + 32 <= len; j += 32) {
+        _mm256_storeu_si256(
+            (__m256i *)(dst + j),
+            _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src + j)),
+                             m8));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i m4 = _mm_set1_epi32(k);
+    for (; j + 16 <= len; j += 16) {
+        _mm_storeu_si128(
+            (__m128i *)(dst + j),
+            _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + j)), m4));
+    }
+#endif
+    for (; j < len; j++) {
+        dst[j] = src[j] ^ key[j & 3];
+    }
+}
+
+static int writeAll(int sd, struct iovec *iov, int n) {
+    ssize_t w;
+
+    while (n > 0) {
+        if ((w = tlsWritev(sd, iov, n)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // Partial write - skip what the kernel took
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+static size_t header(unsigned char *h, int op, uint64_t len) {
+    int j;
+
+    h[0] = 0x80 | op;
+    if (len < 126) {
+        h[1] = (unsigned char)len;
+        return 2;
+    } else if (len < 65536) {
+        h[1] = 126;
+        h[2] = (unsigned char)(len >> 8);
+        h[3] = (unsigned char)len;
+        return 4;
+    }
+    h[1] = 127;
+    for (j = 0; j < 8; j++) {
+        h[2 + j] = (unsigned char)(len >> (56 - 8 * j));
+    }
+    return 10;
+}
+
+static int control(int sd, int op, const void *payload, size_t len) {
+    unsigned char h[WS_HDRMAX];
+    struct iovec iov[2];
+
+    iov[0].iov_base = h;
+    iov[0].iov_len = header(h, op, len);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+    return writeAll(sd, iov, 2);
+}
+
+static void closeWith(int sd, int code) {
+    unsigned char status[2];
+
+    status[0] = (unsigned char)(code >> 8);
+    status[1] = (unsigned char)code;
+    control(sd, OP_CLOSE, status, 2);
+}
+
+/* 1 when the request is complete and answered, 0 if partial, -1 bad */
+static int handshake(int sd, struct wsConn *c) {
+    char *end, *line, *key = NULL;
+    char reply[256];
+    char accept[32];
+    unsigned char digest[20];
+    struct iovec iov;
+    size_t n;
+
+    c->in[c->used] = '\0';
+    if ((end = strstr(c->in, "\r\n\r\n")) == NULL) {
+        return c->used == WS_BUF ? -1 : 0;
+    }
+    end[2] = '\0';
+    for (line = strstr(c->in, "\r\n"); line != NULL && line < end;
+         line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Sec-WebSocket-Key:", 18) == 0) {
+            key = line + 20;
+            while (*key == ' ') {
+                key++;
+            }
+            *strstr(key, "\r\n") = '\0';
+            break;
+        }
+    }
+    if (key == NULL || strlen(key) > 64) {
+        snprintf(reply, sizeof(reply), "HTTP/1.1 400 Bad Request\r\n\r\n");
+        iov.iov_base = reply;
+        iov.iov_len = strlen(reply);
+        writeAll(sd, &iov, 1);
+        return -1;
+    }
+    n = strlen(key);
+    memmove(reply, key, n);
+    memcpy(reply + n, WS_GUID, sizeof(WS_GUID));
+    sha1((unsigned char *)reply, n + sizeof(WS_GUID) - 1, digest);
+    base64(digest, sizeof(digest), accept);
+    snprintf(reply, sizeof(reply),
+             "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+             "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n",
+             accept);
+    iov.iov_base = reply;
+    iov.iov_len = strlen(reply);
+    if (writeAll(sd, &iov, 1) < 0) {
+        return -1;
+    }
+    // Frames may already follow the request
+    n = end + 4 - c->in;
+    memmove(c->in, c->in + n, c->used - n);
+    c->used -= n;
+    c->open = 1;
+    return 1;
+}
+
+/* header and payload size of the first buffered frame, 0 if incomplete */
+static int frameAt(const struct wsConn *c, size_t *hdr, uint64_t *plen) {
+    const unsigned char *p = (const unsigned char *)c->in;
+    int j;
+
+    if (c->used < 2) {
+        return 0;
+    }
+    *plen = p[1] & 0x7f;
+    *hdr = 2;
+    if (*plen == 126) {
+        if (c->used < 4) {
+            return 0;
+        }
+        *plen = (uint64_t)p[2] << 8 | p[3];
+        *hdr = 4;
+    } else if (*plen == 127) {
+        if (c->used < 10) {
+            return 0;
+        }
+        for (*plen = 0, j = 2; j < 10; j++) {
+            *plen = *plen << 8 | p[j];
+        }
+        *hdr = 10;
+    }
+    if (p[1] & 0x80) {
+        *hdr += 4;
+    }
+    return c->used >= *hdr && c->used - *hdr >= *plen;
+}
+
+int wsAccept(int sd) {
+    if (sd < 0 || sd >= FD_SETSIZE || conn[sd] != NULL) {
+        return -1;
+    }
+    if ((conn[sd] = calloc(1, sizeof(struct wsConn))) == NULL) {
+        perror("S: wsAccept calloc error");
+        return -1;
+    }
+    return 0;
+}
+
+void wsClose(int sd) {
+    if (wsIs(sd)) {
+        free(conn[sd]);
+        conn[sd] = NULL;
+    }
+}
+
+int wsIs(int sd) { return sd >= 0 && sd < FD_SETSIZE && conn[sd] != NULL; }
+
+int wsOpen(int sd) { return wsIs(sd) && conn[sd]->open; }
+
+int wsPending(int sd) {
+    size_t hdr;
+    uint64_t plen;
+
+    return wsOpen(sd) && frameAt(conn[sd], &hdr, &plen);
+}
+
+ssize_t wsRecv(int sd, char *out, size_t room) {
+    struct wsConn *c = conn[sd];
+    unsigned char *p;
+    size_t hdr, take, got = 0;
+    uint64_t plen;
+    ssize_t n;
+    int op;
+
+    if (!wsPending(sd)) {
+        n = tlsRecv(sd, c->in + c->used, WS_BUF - c->used);
+        if (n <= 0) {
+            return n;
+        }
+        c->used += n;
+    }
+    if (!c->open) {
+        if ((n = handshake(sd, c)) <= 0) {
+            errno = EAGAIN;
+            return n < 0 ? 0 : -1;
+        }
+    }
+    while (frameAt(c, &hdr, &plen)) {
+        p = (unsigned char *)c->in;
+        op = p[0] & 0x0f;
+        if (!(p[1] & 0x80)) {
+            closeWith(sd, 1002); // clients must mask
+            return 0;
+        }
+        if (op == OP_CONT || op == OP_TEXT || op == OP_BINARY) {
+            if (got > 0 && plen + 1 > room - got) {
+                break; // next call, once the lines so far are processed
+            }
+            // An oversized message is cut, like an overlong native line
+            take = plen + 1 > room - got ? room - got - 1 : plen;
+            unmask((unsigned char *)out + got, p + hdr, take, p + hdr - 4);
+            got += take;
+            if ((p[0] & 0x80) && (got == 0 || out[got - 1] != '\n')) {
+                out[got++] = '\n';
+            }
+        } else if (op == OP_PING) {
+            unmask(p + hdr, p + hdr, plen, p + hdr - 4);
+            control(sd, OP_PONG, p + hdr, plen);
+        } else if (op == OP_CLOSE) {
+            closeWith(sd, 1000);
+            return 0;
+        } else if (op != OP_PONG) {
+            closeWith(sd, 1002);
+            return 0;
+        }
+        memmove(c->in, c->in + hdr + plen, c->used - hdr - plen);
+        c->used -= hdr + plen;
+    }
+    if (c->used == WS_BUF && !frameAt(c, &hdr, &plen)) {
+        closeWith(sd, 1009); // a frame that can never fit
+        return 0;
+    }
+    if (got == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return got;
+}
+
+size_t wsFrame(char *out, const char *msg, size_t len) {
+    size_t h = header((unsigned char *)out, OP_TEXT, len);
+
+    memcpy(out + h, msg, len);
+    return h + len;
+}
+
+static ssize_t put(int sd, const struct iovec *iov, int n) {
+    unsigned char h[WS_HDRMAX];
+    struct iovec v[8];
+    size_t len = 0;
+    int k;
+
+    if (!wsIs(sd)) {
+        return tlsWritev(sd, iov, n);
+    }
+    if (!wsOpen(sd)) {
+        errno = ENOTCONN; // nothing may precede the handshake reply
+        return -1;
+    }
+    if (n > 7) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (k = 0; k < n; k++) {
+        v[k + 1] = iov[k];
+        len += iov[k].iov_len;
+    }
+    v[0].iov_base = h;
+    v[0].iov_len = header(h, OP_TEXT, len);
+    return writeAll(sd, v, n + 1) < 0 ? -1 : (ssize_t)len;
+}
+
+/* whole JSON lines only, so a WebSocket frame never splits an object */
+static int flushLines(int sd, char *enc, size_t *used, int all) {
+    struct iovec iov;
+    size_t end = *used;
+
+    while (!all && end > 0 && enc[end - 1] != '\n') {
+        end--;
+    }
+    if (end == 0) {
+        end = *used; // one line larger than the buffer
+    }
+    iov.iov_base = enc;
+    iov.iov_len = end;
+    if (wsIs(sd) ? put(sd, &iov, 1) < 0 : writeAll(sd, &iov, 1) < 0) {
+        return -1;
+    }
+    memmove(enc, enc + end, *used - end);
+    *used -= end;
+    return 0;
+}
+
+ssize_t wsWritev(int sd, const struct iovec *iov, int n) {
+    char enc[WS_BUF];
+    const char *src;
+    size_t left, used = 0, total = 0;
+    int k, open = 0;
+
+    if (!jsonIs(sd)) {
+        return put(sd, iov, n);
+    }
+    // JSON clients: encode line by line, flushing whole lines as it fills
+    for (k = 0; k < n; k++) {
+        src = iov[k].iov_base;
+        left = iov[k].iov_len;
+        total += left;
+        while (left > 0) {
+            used += jsonEncode(enc + used, sizeof(enc) - used, &src, &left,
+                               &open);
+            if (left > 0 && flushLines(sd, enc, &used, 0) < 0) {
+                return -1;
+            }
+        }
+    }
+    if (open) {
+        if (sizeof(enc) - used < JSON_ESCMAX &&
+            flushLines(sd, enc, &used, 0) < 0) {
+            return -1;
+        }
+        memcpy(enc + used, "\"}\n", 3);
+        used += 3;
+    }
+    if (used > 0 && flushLines(sd, enc, &used, 1) < 0) {
+        return -1;
+    }
+    return total;
+}
+
+ssize_t wsSend(int sd, const void *buf, size_t len) {
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    return wsWritev(sd, &iov, 1);
+}
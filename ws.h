@@ -0,0 +1,42 @@
+/* *
+ * Name: ws.h                                                       *
+ *                                                                  *
+ * Description: WebSocket gateway include file                      *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __WS_H
+#define __WS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define WS_PORT 5901
+#define WS_BUF 4096 /* handshake request or buffered frames */
+#define WS_HDRMAX 10
+
+int wsAccept(int sd);
+void wsClose(int sd);
+int wsIs(int sd);
+int wsOpen(int sd);
+int wsPending(int sd);
+ssize_t wsRecv(int sd, char *out, size_t room);
+size_t wsFrame(char *out, const char *msg, size_t len);
+ssize_t wsWritev(int sd, const struct iovec *iov, int n);
+ssize_t wsSend(int sd, const void *buf, size_t len);
+
+#endif
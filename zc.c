@@ -0,0 +1,319 @@
+/* *
+ * Name: zc.c                                                       *
+ *                                                                  *
+ * Description: MSG_ZEROCOPY sends and their buffer pool            *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include "zc.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/errqueue.h>
+
+/*
+ * A fan-out payload above the threshold is copied once into a pool
+ * buffer and every recipient's send() pins that buffer instead of
+ * copying it into socket memory. The kernel numbers each such send per
+ * socket and reports finished ranges on the socket's error queue, which
+ * makes select() flag the socket readable; communication() reaps them
+ * before reading and the buffer goes back to the pool with its last
+ * reference. A socket closed with sends in flight keeps its buffers
+ * until their completions arrive on a duplicate descriptor.
+ */
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+struct zcBuf {
+    struct zcBuf *next; /* free list */
+    int refs;
+    size_t len;
+    char *data;
+};
+
+struct zcSock {
+    struct zcSock *next; /* closed, still waiting for completions */
+    int fd;              /* our duplicate of a closed socket */
+    uint32_t id;         /* kernel id of our next zero-copy send */
+    struct zcBuf *pend[ZC_INFLIGHT];
+};
+
+static struct zcBuf pool[ZC_POOL];
+static struct zcBuf *freeBuf;
+static struct zcSock *sock[FD_SETSIZE];
+static struct zcSock *closing;
+static size_t minLen;
+
+/* statistics */
+static unsigned long nSend, nDone, nCopied, nFallback, nLost;
+static unsigned long long nBytes;
+
+int zcInit(size_t min) {
+    char *area;
+    int k;
+
+    if ((minLen = min) == 0) {
+        return 0;
+    }
+    // One prefaulted area, so the first pins do not take page faults
+    area = mmap(NULL, (size_t)ZC_POOL * ZC_BUF, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (area == MAP_FAILED) {
+        perror("S: zcInit mmap error");
+        minLen = 0;
+        return -1;
+    }
+    for (k = 0; k < ZC_POOL; k++) {
+        pool[k].data = area + (size_t)k * ZC_BUF;
+        pool[k].next = freeBuf;
+        freeBuf = &pool[k];
+    }
+    return 0;
+}
+
+size_t zcMin(void) { return minLen; }
+
+int zcEnable(int sd) {
+    int on = 1;
+
+    if (minLen == 0 || sd >= FD_SETSIZE ||
+        setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0 ||
+        (sock[sd] = calloc(1, sizeof(*sock[sd]))) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+int zcIs(int sd) { return sd >= 0 && sd < FD_SETSIZE && sock[sd] != NULL; }
+
+void zcPut(struct zcBuf *b) {
+    if (b != NULL && --b->refs == 0) {
+        b->next = freeBuf;
+        freeBuf = b;
+    }
+}
+
+static void release(struct zcSock *z, uint32_t id) {
+    struct zcBuf **p = &z->pend[id % ZC_INFLIGHT];
+
+    zcPut(*p);
+    *p = NULL;
+    nDone++;
+}
+
+/* completions waiting on the error queue, returns whether there were any */
+static int drain(int sd, struct zcSock *z) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    uint32_t id;
+    int got = 0;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return got;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // [ee_info, ee_data] finished; COPIED if the kernel copied anyway
+            for (id = serr->ee_info; id != serr->ee_data + 1; id++) {
+                release(z, id);
+                nCopied += (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+            }
+            got = 1;
+        }
+    }
+}
+
+static int busy(const struct zcSock *z) {
+    int k;
+
+    for (k = 0; k < ZC_INFLIGHT; k++) {
+        if (z->pend[k] != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* closed sockets whose last sends are done give their buffers back */
+static void settle(void) {
+    struct zcSock **p = &closing, *z;
+
+    while ((z = *p) != NULL) {
+        drain(z->fd, z);
+        if (busy(z)) {
+            p = &z->next;
+            continue;
+        }
+        *p = z->next;
+        close(z->fd);
+        free(z);
+    }
+}
+
+struct zcBuf *zcGet(const void *data, size_t len) {
+    struct zcBuf *b;
+    int sd;
+
+    if (freeBuf == NULL) {
+        // Every buffer is waiting on some socket's completions
+        settle();
+        for (sd = 0; sd < FD_SETSIZE; sd++) {
+            if (sock[sd] != NULL) {
+                drain(sd, sock[sd]);
+            }
+        }
+    }
+    if ((b = freeBuf) == NULL || len > ZC_BUF) {
+        nFallback++;
+        return NULL;
+    }
+    freeBuf = b->next;
+    memcpy(b->data, data, len);
+    b->len = len;
+    b->refs = 1;
+    return b;
+}
+
+/* ENOBUFS when this send cannot be zero-copy, the caller then copies */
+ssize_t zcSend(int sd, struct zcBuf *b) {
+    struct zcSock *z = zcIs(sd) ? sock[sd] : NULL;
+    size_t off = 0;
+    ssize_t n;
+
+    if (z == NULL || b == NULL) {
+        errno = ENOBUFS; // zcGet() already counted a missing buffer
+        return -1;
+    }
+    // Each send of a short run takes a slot, and completes on its own
+    while (off < b->len) {
+        // A burst can outrun the loop's reaping, collect what is done first
+        if (z->pend[z->id % ZC_INFLIGHT] != NULL &&
+            (!drain(sd, z) || z->pend[z->id % ZC_INFLIGHT] != NULL)) {
+            nFallback++;
+            break;
+        }
+        if ((n = send(sd, b->data + off, b->len - off, MSG_ZEROCOPY)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            nFallback += errno == ENOBUFS; // the socket's optmem is used up
+            if (off == 0 && errno != ENOBUFS) {
+                return -1;
+            }
+            break;
+        }
+        b->refs++;
+        z->pend[z->id++ % ZC_INFLIGHT] = b;
+        nBytes += n;
+        off += (size_t)n;
+    }
+    if (off == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    nSend += off == b->len;
+    // Short: the caller sends the rest the ordinary way
+    return (ssize_t)off;
+}
+
+/* drain completions; 1 when that was all there was to read */
+int zcReap(int sd) {
+    struct zcSock *z = zcIs(sd) ? sock[sd] : NULL;
+    struct pollfd p;
+
+    if (z == NULL || !drain(sd, z)) {
+        return 0;
+    }
+    p.fd = sd;
+    p.events = POLLIN;
+    return poll(&p, 1, 0) == 0;
+}
+
+void zcClose(int sd) {
+    struct zcSock *z = zcIs(sd) ? sock[sd] : NULL;
+    uint32_t id;
+
+    if (z == NULL) {
+        return;
+    }
+    sock[sd] = NULL;
+    settle();
+    drain(sd, z);
+    if (!busy(z)) {
+        free(z);
+        return;
+    }
+    // Unsent data still reads from its buffers, so they stay out of the
+    // pool until the kernel reports them done. That report comes on the
+    // socket, so keep a duplicate of it; shutdown() ends the connection
+    // the caller's close() no longer does
+    if ((z->fd = dup(sd)) < 0) {
+        for (id = 0; id < ZC_INFLIGHT; id++) {
+            nLost += z->pend[id] != NULL; // never reused
+        }
+        free(z);
+        return;
+    }
+    shutdown(sd, SHUT_RDWR);
+    z->next = closing;
+    closing = z;
+}
+
+void zcReport(char *buf, size_t len) {
+    struct zcSock *z;
+    struct zcBuf *b;
+    int used = ZC_POOL, waiting = 0;
+
+    if (minLen == 0) {
+        snprintf(buf, len, "S: zerocopy off\n");
+        return;
+    }
+    settle();
+    for (b = freeBuf; b != NULL; b = b->next) {
+        used--;
+    }
+    for (z = closing; z != NULL; z = z->next) {
+        waiting++;
+    }
+    snprintf(buf, len,
+             "S: zerocopy from %zu bytes sends %lu (%llu bytes) completed %lu "
+             "copied by kernel %lu fallbacks %lu pool in use %d/%d lost %lu "
+             "closed sockets waiting %d\n",
+             minLen, nSend, nBytes, nDone, nCopied, nFallback, used, ZC_POOL,
+             nLost, waiting);
+}
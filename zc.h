@@ -0,0 +1,45 @@
+/* *
+ * Name: zc.h                                                       *
+ *                                                                  *
+ * Description: zero-copy send include file                         *
+ *                                                                  *
+ * Copyright (C) 2000 Cesare Placanica                              *
+ *                                                                  *
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License      *
+ * as published by the Free Software Foundation; either version 2   *
+ * of the License, or (at your option) any later version.           *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef __ZC_H
+#define __ZC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ZC_BUF 65536     /* largest payload a pool buffer holds */
+#define ZC_POOL 64       /* pool buffers */
+#define ZC_INFLIGHT 64   /* sends awaiting completion per socket */
+
+struct zcBuf;
+
+int zcInit(size_t min);
+size_t zcMin(void);
+int zcEnable(int sd);
+int zcIs(int sd);
+struct zcBuf *zcGet(const void *data, size_t len);
+void zcPut(struct zcBuf *b);
+ssize_t zcSend(int sd, struct zcBuf *b);
+int zcReap(int sd);
+void zcClose(int sd);
+void zcReport(char *buf, size_t len);
+
+#endif